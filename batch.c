@@ -0,0 +1,300 @@
+#define _GNU_SOURCE
+
+#include <glib.h>
+#include <agent.h>
+
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "batch.h"
+#include "global.h"
+#include "timing.h"
+#include "metrics.h"
+#include "session.h"
+#include "callbacks.h"
+#include "outq.h"
+
+// outgoing: datagrams read from the local fd, handed to the agent at once
+static gchar *in_buf = NULL;
+static struct mmsghdr in_msgs[BATCH_MAX];
+static struct iovec in_iov[BATCH_MAX];
+static NiceOutputMessage out_msgs[BATCH_MAX];
+static GOutputVector out_vec[BATCH_MAX];
+
+// incoming: datagrams waiting to be written to the session's output fd
+struct _Batch {
+  gchar *pending_buf;
+  struct mmsghdr pending_msgs[BATCH_MAX];
+  struct iovec pending_iov[BATCH_MAX];
+  guint pending_count;
+  guint flush_id;
+
+  gint input_fd;          // the last fd read, and whether it blocks
+  gboolean input_nonblocking;
+  gint kind_fd;           // the output fd and what it takes
+  gint kind;
+};
+
+static guint64 sent_msgs = 0, sent_syscalls = 0, dropped_sent = 0;
+static guint64 recv_msgs = 0, recv_syscalls = 0, dropped_recv = 0;
+
+// a second read() of a blocking fd (e.g. stdin) would wait for more data
+static gboolean
+batch_nonblocking(Batch *batch, gint fd) {
+  if(fd != batch->input_fd) {
+    gint flags = fcntl(fd, F_GETFL);
+
+    batch->input_nonblocking = flags >= 0 && (flags & O_NONBLOCK);
+    batch->input_fd = fd;
+  }
+
+  return batch->input_nonblocking;
+}
+
+static gint
+batch_read(Batch *batch, gint fd, gboolean *eof) {
+  gint i, n, max_reads = batch_nonblocking(batch, fd) ? batch_size : 1;
+
+  n = recvmmsg(fd, in_msgs, batch_size, MSG_DONTWAIT, NULL);
+  if(n >= 0 || errno != ENOTSOCK) {
+    if(n > 0)
+      sent_syscalls++;
+    for(i = 0; i < n; i++) {
+      if(in_msgs[i].msg_len == 0) {
+        // end of stream
+        *eof = TRUE;
+        return i;
+      }
+    }
+    return n;
+  }
+
+  // not a socket (stdin, tun): one read() per datagram
+  for(i = 0; i < max_reads; i++) {
+    gssize res = read(fd, in_iov[i].iov_base, BATCH_MSG_SIZE);
+    if(res <= 0) {
+      *eof = (res == 0);
+      break;
+    }
+    sent_syscalls++;
+    in_msgs[i].msg_len = res;
+  }
+
+  return (i == 0 && !*eof) ? -1 : i;
+}
+
+enum { BATCH_STREAM, BATCH_DATAGRAMS, BATCH_PACKETS };
+
+static gint
+batch_output_kind(Batch *batch, gint fd) {
+  struct stat st;
+  gint type, kind;
+  socklen_t type_len = sizeof(type);
+
+  if(fd == batch->kind_fd)
+    return batch->kind;
+
+  if(fstat(fd, &st) != 0)
+    kind = BATCH_PACKETS;
+  // sendmmsg() could tear a message apart on a stream socket
+  else if(S_ISSOCK(st.st_mode))
+    kind = (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &type_len) == 0 && type == SOCK_STREAM)
+      ? BATCH_STREAM : BATCH_DATAGRAMS;
+  else if(S_ISFIFO(st.st_mode) || S_ISREG(st.st_mode))
+    kind = BATCH_STREAM;
+  else
+    kind = BATCH_PACKETS;
+
+  batch->kind_fd = fd;
+  batch->kind = kind;
+  return kind;
+}
+
+static gboolean
+batch_flush(gpointer session_ptr) {
+  NiceSession *session = session_ptr;
+  Batch *batch = session->batch;
+  struct iovec *pending_iov = batch->pending_iov;
+  guint pending_count = batch->pending_count;
+  gint fd = session->output_fd;
+  guint written = 0, i;
+  gint kind = batch_output_kind(batch, fd);
+
+  batch->flush_id = 0;
+  if(pending_count == 0)
+    return FALSE;
+
+  if(kind == BATCH_DATAGRAMS) {
+    gint res = sendmmsg(fd, batch->pending_msgs, pending_count, MSG_DONTWAIT);
+    written = (res > 0) ? res : 0;
+    recv_syscalls++;
+  }
+  else if(kind == BATCH_STREAM) {
+    // byte streams, message boundaries do not matter; the output queue
+    // keeps what the fd did not take, a full one drops like a datagram
+    // socket would
+    OutputQueue *queue = output_queue(session);
+
+    if(!outq_full(queue) && outq_writev(queue, pending_iov, pending_count))
+      written = pending_count;
+    recv_syscalls++;
+  }
+  else {
+    // e.g. a tun device: every write() is one packet
+    for(i = 0; i < pending_count; i++, recv_syscalls++)
+      if(write(fd, pending_iov[i].iov_base, pending_iov[i].iov_len) > 0)
+        written++;
+  }
+
+  recv_msgs += written;
+  dropped_recv += pending_count - written;
+  for(i = 0; i < written; i++)
+    metrics.received_bytes += pending_iov[i].iov_len;
+  metrics.received_messages += written;
+  metrics.dropped += pending_count - written;
+  batch->pending_count = 0;
+
+  return FALSE;
+}
+
+void
+batch_init(NiceSession *session) {
+  Batch *batch = g_new0(Batch, 1);
+  guint i;
+
+  // every read is sent before the next one, sessions share these
+  if(in_buf == NULL) {
+    in_buf = g_malloc(BATCH_MAX * BATCH_MSG_SIZE);
+
+    for(i = 0; i < BATCH_MAX; i++) {
+      in_iov[i].iov_base = in_buf + i*BATCH_MSG_SIZE;
+      in_iov[i].iov_len = BATCH_MSG_SIZE;
+      in_msgs[i].msg_hdr.msg_iov = &in_iov[i];
+      in_msgs[i].msg_hdr.msg_iovlen = 1;
+
+      out_vec[i].buffer = in_iov[i].iov_base;
+      out_msgs[i].buffers = &out_vec[i];
+      out_msgs[i].n_buffers = 1;
+    }
+  }
+
+  batch->pending_buf = g_malloc(BATCH_MAX * BATCH_MSG_SIZE);
+  for(i = 0; i < BATCH_MAX; i++) {
+    batch->pending_iov[i].iov_base = batch->pending_buf + i*BATCH_MSG_SIZE;
+    batch->pending_msgs[i].msg_hdr.msg_iov = &batch->pending_iov[i];
+    batch->pending_msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+  batch->input_fd = -1;
+  batch->kind_fd = -1;
+  session->batch = batch;
+}
+
+void
+batch_free(NiceSession *session) {
+  Batch *batch = session->batch;
+
+  if(batch == NULL)
+    return;
+
+  if(batch->flush_id != 0)
+    g_source_remove(batch->flush_id);
+  g_free(batch->pending_buf);
+  g_free(batch);
+  session->batch = NULL;
+}
+
+gboolean
+batch_send_data(GIOChannel *source, GIOCondition cond, gpointer session_ptr) {
+  NiceSession *session = session_ptr;
+  gint fd = g_io_channel_unix_get_fd(source);
+  gint n, i, sent;
+
+  do {
+    gboolean eof = FALSE;
+    GError *error = NULL;
+
+    n = batch_read(session->batch, fd, &eof);
+    if(n < 0) {
+      if(errno != EAGAIN && errno != EWOULDBLOCK) {
+        g_critical("Error sending: errno=%i\n", errno);
+        session_end(session);
+        return FALSE;
+      }
+      break;
+    }
+
+    for(i = 0; i < n; i++)
+      out_vec[i].size = in_msgs[i].msg_len;
+
+    if(n > 0) {
+      sent = nice_agent_send_messages_nonblocking(session->agent, session->stream_id, 1,
+        out_msgs, n, NULL, &error);
+      if(sent < 0) {
+        g_debug("nice_agent_send_messages_nonblocking: %s\n", error->message);
+        g_error_free(error);
+        sent = 0;
+      }
+      if(sent > 0)
+        timing_mark(TIMING_FIRST_SENT);
+      for(i = 0; i < sent; i++)
+        metrics.sent_bytes += out_vec[i].size;
+      metrics.sent_messages += sent;
+      metrics.send_failed += n - sent;
+      sent_msgs += sent;
+      dropped_sent += n - sent;
+    }
+
+    if(eof) {
+      // probably FLUSHED
+      session_end(session);
+      return FALSE;
+    }
+  }
+  while(n == batch_size);
+
+  return TRUE;
+}
+
+void
+batch_recv(NiceAgent *agent, guint stream_id, guint component_id, guint len,
+    gchar *buf, gpointer session_ptr) {
+  NiceSession *session = session_ptr;
+  Batch *batch = session->batch;
+  struct iovec *iov;
+
+  if(len > BATCH_MSG_SIZE) {
+    g_debug("batch_recv: dropping oversized datagram (%u bytes)\n", len);
+    dropped_recv++;
+    metrics.dropped++;
+    return;
+  }
+
+  iov = &batch->pending_iov[batch->pending_count++];
+  memcpy(iov->iov_base, buf, len);
+  iov->iov_len = len;
+
+  // write out when the batch is full or the current burst is over
+  if(batch->pending_count == batch_size) {
+    if(batch->flush_id != 0)
+      g_source_remove(batch->flush_id);
+    batch_flush(session);
+  }
+  else if(batch->flush_id == 0)
+    batch->flush_id = g_idle_add_full(G_PRIORITY_DEFAULT, batch_flush, session, NULL);
+}
+
+void
+batch_report() {
+  g_message("batch: sent %" G_GUINT64_FORMAT " datagrams with %" G_GUINT64_FORMAT
+    " reads (%.1f per syscall, %" G_GUINT64_FORMAT " dropped)\n",
+    sent_msgs, sent_syscalls, sent_syscalls ? (gdouble) sent_msgs/sent_syscalls : 0.0, dropped_sent);
+  g_message("batch: received %" G_GUINT64_FORMAT " datagrams with %" G_GUINT64_FORMAT
+    " writes (%.1f per syscall, %" G_GUINT64_FORMAT " dropped)\n",
+    recv_msgs, recv_syscalls, recv_syscalls ? (gdouble) recv_msgs/recv_syscalls : 0.0, dropped_recv);
+}
@@ -0,0 +1,19 @@
+#ifndef __BATCH_H__
+#define __BATCH_H__
+
+#include <glib.h>
+#include <agent.h>
+
+#include "session.h"
+
+// largest datagram read or written in batched mode
+#define BATCH_MSG_SIZE 10240
+#define BATCH_MAX 64
+
+void batch_init(NiceSession *session);
+void batch_free(NiceSession *session);
+gboolean batch_send_data(GIOChannel *source, GIOCondition cond, gpointer session_ptr);
+void batch_recv(NiceAgent *agent, guint stream_id, guint component_id, guint len, gchar *buf, gpointer session_ptr);
+void batch_report();
+
+#endif
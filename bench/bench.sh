@@ -0,0 +1,108 @@
+#!/bin/sh
+# Runs a caller/callee pair on this host and pushes messages through it.
+# Prints one line of key=value pairs per configuration, e.g.
+#
+#   commit=1a2b3c4 path=port mode=reliable size=1024 count=10000 window=32 bytes=... mb_per_s=... ...
+#
+# mb_per_s and msgs_per_s count the payload echoed back, p50_us and p99_us
+# are round trip times, cpu_s_per_gb is the CPU time of both peers per GB
+# that went through the tunnel (both directions).
+#
+# Configure with BENCH_PATHS, BENCH_MODES, BENCH_SIZES, BENCH_COUNT,
+# BENCH_WINDOW and BENCH_PORT; BENCH_FLAGS are passed to both peers.
+# Mode 'udp' is reliable over -U instead of pseudo TCP. BENCH_NETEM
+# emulates a path on the loopback device (as root), e.g.
+# BENCH_NETEM="delay 75ms loss 1%" for 150 ms round trips.
+
+cd "$(dirname "$0")/.."
+
+PATHS=${BENCH_PATHS:-"port pipe"}
+MODES=${BENCH_MODES:-"reliable unreliable"}
+SIZES=${BENCH_SIZES:-"64 1024 8192"}
+COUNT=${BENCH_COUNT:-10000}
+WINDOW=${BENCH_WINDOW:-32}
+PORT=${BENCH_PORT:-15000}
+EXTRA=${BENCH_FLAGS:-}
+NETEM=${BENCH_NETEM:-}
+
+COMMIT=`git rev-parse --short HEAD 2>/dev/null || echo unknown`
+CLK_TCK=`getconf CLK_TCK`
+HOST=bench$$
+
+# utime + stime of the given processes in clock ticks
+cpu_ticks() {
+	for pid in "$@"; do
+		cut -d')' -f2 /proc/$pid/stat 2>/dev/null | awk '{print $12+$13}'
+	done | awk '{s+=$1} END {print s+0}'
+}
+
+run() {
+	BENCH_PATH=$1
+	MODE=$2
+	SIZE=$3
+
+	# no STUN server and a private exchange directory
+	DIR=`mktemp -d`
+	export NICE_EXCHANGE_DIR=$DIR
+	CLIENT="./bench/nicebench client -s $SIZE -n $COUNT -w $WINDOW"
+
+	if [ "$BENCH_PATH" = 'port' ]; then
+		FLAGS=$EXTRA
+		[ "$MODE" = 'unreliable' ] && FLAGS="$FLAGS -u"
+		[ "$MODE" = 'udp' ] && FLAGS="$FLAGS -U"
+
+		./bench/nicebench echo -P $((PORT+1)) &
+		ECHO=$!
+		./niceport_raw -c 0 -H $HOST -P $((PORT+1)) $FLAGS 2>$DIR/callee.log &
+		CALLEE=$!
+		./niceport_raw -c 1 -H $HOST -P $PORT $FLAGS 2>$DIR/caller.log &
+		CALLER=$!
+
+		RESULT=`$CLIENT -P $PORT`
+		TICKS=`cpu_ticks $CALLER $CALLEE`
+		kill $CALLER $CALLEE $ECHO 2>/dev/null
+	else
+		FLAGS=$EXTRA
+		[ "$MODE" = 'unreliable' ] && FLAGS="$FLAGS -u 1"
+		[ "$MODE" = 'udp' ] && FLAGS="$FLAGS -U"
+
+		./bench/nicebench echo -- ./nicepipe_raw -c 0 -H $HOST $FLAGS 2>$DIR/callee.log &
+		ECHO=$!
+		$CLIENT -- ./nicepipe_raw -c 1 -H $HOST $FLAGS 2>$DIR/caller.log > $DIR/result &
+		CLIENT_PID=$!
+
+		# the peers are children of nicebench, measure them before it stops them
+		while kill -0 $CLIENT_PID 2>/dev/null; do
+			PIDS=`pgrep -P $ECHO; pgrep -P $CLIENT_PID`
+			TICKS=`cpu_ticks $PIDS`
+			sleep 0.2
+		done
+		RESULT=`cat $DIR/result`
+		kill $ECHO 2>/dev/null
+	fi
+	wait 2>/dev/null
+
+	BYTES=`echo "$RESULT" | sed -n 's/.*bytes=\([0-9]*\).*/\1/p'`
+	CPU=`awk -v t=${TICKS:-0} -v hz=$CLK_TCK -v b=${BYTES:-0} 'BEGIN { if(b > 0) printf "%.2f", t/hz / (2*b/1e9); else print "nan" }'`
+
+	echo "commit=$COMMIT path=$BENCH_PATH mode=$MODE flags=\"$EXTRA\" netem=\"$NETEM\" size=$SIZE count=$COUNT window=$WINDOW $RESULT cpu_s_per_gb=$CPU"
+	rm -rf $DIR
+}
+
+if [ ! -x ./bench/nicebench ] || [ ! -e ./exchange_providers/dummy.so ]; then
+	echo "Please run 'make bench' first." 1>&2
+	exit 1
+fi
+
+if [ -n "$NETEM" ]; then
+	tc qdisc replace dev lo root netem $NETEM || exit 1
+	trap 'tc qdisc del dev lo root' EXIT
+fi
+
+for BENCH_PATH in $PATHS; do
+	for MODE in $MODES; do
+		for SIZE in $SIZES; do
+			run $BENCH_PATH $MODE $SIZE
+		done
+	done
+done
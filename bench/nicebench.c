@@ -0,0 +1,321 @@
+#include <glib.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+// Load generator for niceport_raw and nicepipe_raw.
+//
+//   nicebench echo -P <port>          echo everything sent to localhost:<port>
+//   nicebench echo -- <cmd...>        echo everything <cmd> writes to stdout
+//   nicebench client -P <port> ...    send messages to localhost:<port>
+//   nicebench client ... -- <cmd...>  send messages to <cmd>'s stdin
+//
+// The client sends count messages of size bytes with at most window of them
+// in flight, and prints throughput and round trip times as key=value pairs.
+// Messages carry a magic number, so the client can resynchronize after
+// datagrams were lost with -u.
+
+#define BENCH_MAGIC 0x6e696365
+#define BENCH_HEADER_SIZE 24
+#define BENCH_CONNECT_TIMEOUT_MS 60000
+#define BENCH_WARMUP_SEQ G_MAXUINT32
+#define BENCH_WARMUP_RETRY_US 500000
+
+typedef struct {
+  guint32 magic;
+  guint32 seq;
+  guint64 sent_us;
+  guint32 len;
+  guint32 reserved;
+} BenchHeader;
+
+static gint port = 0;
+static gint msg_size = 1024;
+static gint msg_count = 10000;
+static gint window = 32;
+static gint idle_timeout_ms = 2000;
+static GPid child_pid = 0;
+
+GOptionEntry all_options[] =
+{
+  { "port", 'P', 0, G_OPTION_ARG_INT, &port,
+    "TCP port on localhost to connect to (client) or listen at (echo)", "P" },
+  { "size", 's', 0, G_OPTION_ARG_INT, &msg_size,
+    "message size in bytes (default: 1024)", "s" },
+  { "count", 'n', 0, G_OPTION_ARG_INT, &msg_count,
+    "number of messages (default: 10000)", "n" },
+  { "window", 'w', 0, G_OPTION_ARG_INT, &window,
+    "messages in flight (default: 32, 1 measures pure round trip times)", "w" },
+  { "timeout", 't', 0, G_OPTION_ARG_INT, &idle_timeout_ms,
+    "give up after t ms without progress, the rest counts as lost (default: 2000)", "t" },
+  { NULL }
+};
+
+static gint
+connect_port(gint port) {
+  struct sockaddr_in addr;
+  gint64 deadline = g_get_monotonic_time() + BENCH_CONNECT_TIMEOUT_MS*1000;
+  gint fd, one = 1;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  // the caller only listens once the ICE connection is up
+  while(TRUE) {
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(connect(fd, (struct sockaddr*) &addr, sizeof(addr)) == 0)
+      break;
+    close(fd);
+
+    if(g_get_monotonic_time() > deadline) {
+      fprintf(stderr, "nicebench: cannot connect to port %i\n", port);
+      exit(1);
+    }
+    g_usleep(100000);
+  }
+
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  return fd;
+}
+
+static gint
+accept_port(gint port) {
+  struct sockaddr_in addr;
+  gint listen_fd, fd, one = 1;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+  setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  if(bind(listen_fd, (struct sockaddr*) &addr, sizeof(addr)) < 0 || listen(listen_fd, 1) < 0) {
+    fprintf(stderr, "nicebench: cannot listen at port %i: %s\n", port, strerror(errno));
+    exit(1);
+  }
+
+  fd = accept(listen_fd, NULL, NULL);
+  close(listen_fd);
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  return fd;
+}
+
+// runs argv with a socket as stdin and stdout, since nicepipe_raw reads
+// its stdin with recvmsg()
+static gint
+spawn_command(gchar **argv) {
+  gint sv[2];
+
+  if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+    perror("socketpair");
+    exit(1);
+  }
+
+  child_pid = fork();
+  if(child_pid == 0) {
+    dup2(sv[1], 0);
+    dup2(sv[1], 1);
+    close(sv[0]);
+    close(sv[1]);
+    execvp(argv[0], argv);
+    perror(argv[0]);
+    _exit(127);
+  }
+  close(sv[1]);
+
+  return sv[0];
+}
+
+static void
+stop_command() {
+  if(child_pid > 0) {
+    kill(child_pid, SIGTERM);
+    waitpid(child_pid, NULL, 0);
+  }
+}
+
+static void
+run_echo(gint fd) {
+  gchar buf[65536];
+  gssize len, written, res;
+
+  while((len = read(fd, buf, sizeof(buf))) > 0) {
+    for(written = 0; written < len; written += res) {
+      res = write(fd, buf + written, len - written);
+      if(res < 0)
+        return;
+    }
+  }
+}
+
+static gint
+compare_guint64(gconstpointer a, gconstpointer b) {
+  guint64 x = *(const guint64*) a, y = *(const guint64*) b;
+  return (x > y) - (x < y);
+}
+
+static void
+run_client(gint fd) {
+  gchar *out = g_malloc0(msg_size);
+  GByteArray *rx = g_byte_array_new();
+  guint64 *rtts = g_new(guint64, msg_count);
+  BenchHeader *header = (BenchHeader*) out;
+  gint sent = 0, received = 0, out_off = msg_size;
+  gint64 start = 0, last_progress, warmup_sent = 0;
+  gboolean warmed_up = FALSE;
+  gchar buf[65536];
+  struct pollfd pfd;
+  gdouble seconds;
+
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  pfd.fd = fd;
+  last_progress = g_get_monotonic_time();
+
+  // warm-up messages only wait for the connection, they are not counted
+  while(received < msg_count) {
+    gint64 now = g_get_monotonic_time();
+    gsize offset = 0;
+    gssize res;
+
+    if(out_off == msg_size && !warmed_up && now - warmup_sent > BENCH_WARMUP_RETRY_US) {
+      header->magic = BENCH_MAGIC;
+      header->seq = BENCH_WARMUP_SEQ;
+      header->sent_us = now;
+      header->len = msg_size;
+      out_off = 0;
+      warmup_sent = now;
+    }
+    else if(out_off == msg_size && warmed_up && sent < msg_count && sent - received < window) {
+      header->magic = BENCH_MAGIC;
+      header->seq = sent++;
+      header->sent_us = now;
+      header->len = msg_size;
+      out_off = 0;
+    }
+
+    pfd.events = POLLIN | (out_off < msg_size ? POLLOUT : 0);
+    if(poll(&pfd, 1, 100) < 0 && errno != EINTR)
+      break;
+
+    if(out_off < msg_size) {
+      res = write(fd, out + out_off, msg_size - out_off);
+      if(res > 0)
+        out_off += res;
+    }
+
+    res = read(fd, buf, sizeof(buf));
+    if(res == 0)
+      break;
+    if(res > 0)
+      g_byte_array_append(rx, (guint8*) buf, res);
+
+    while(rx->len - offset >= BENCH_HEADER_SIZE) {
+      BenchHeader in;
+
+      memcpy(&in, rx->data + offset, sizeof(in));
+      if(in.magic != BENCH_MAGIC || in.len != msg_size) {
+        // lost or cut datagram, look for the next message
+        offset++;
+        continue;
+      }
+      if(rx->len - offset < msg_size)
+        break;
+
+      now = g_get_monotonic_time();
+      if(!warmed_up) {
+        warmed_up = TRUE;
+        start = now;
+      }
+      if(in.seq != BENCH_WARMUP_SEQ)
+        rtts[received++] = now - in.sent_us;
+      last_progress = now;
+      offset += msg_size;
+    }
+    g_byte_array_remove_range(rx, 0, offset);
+
+    if(warmed_up && now - last_progress > idle_timeout_ms*1000)
+      break;
+    if(!warmed_up && now - last_progress > BENCH_CONNECT_TIMEOUT_MS*1000) {
+      fprintf(stderr, "nicebench: no answer from the peer\n");
+      stop_command();
+      exit(1);
+    }
+  }
+
+  seconds = MAX((g_get_monotonic_time() - start) / 1e6, 1e-6);
+  qsort(rtts, received, sizeof(guint64), compare_guint64);
+
+  printf("bytes=%" G_GUINT64_FORMAT " seconds=%.3f mb_per_s=%.2f msgs_per_s=%.0f p50_us=%" G_GUINT64_FORMAT
+    " p99_us=%" G_GUINT64_FORMAT " lost=%i\n",
+    (guint64) received * msg_size, seconds, received * msg_size / seconds / 1e6, received / seconds,
+    received ? rtts[received / 2] : 0, received ? rtts[(received * 99) / 100] : 0, msg_count - received);
+
+  g_free(rtts);
+  g_free(out);
+  g_byte_array_unref(rx);
+}
+
+int
+main(int argc, char *argv[]) {
+  GOptionContext *context;
+  GError* error = NULL;
+  gchar **command = NULL;
+  gint i, fd;
+
+  // everything after "--" is the command to run
+  for(i = 1; i < argc; i++) {
+    if(strcmp(argv[i], "--") == 0) {
+      command = argv + i + 1;
+      argv[i] = NULL;
+      argc = i;
+      break;
+    }
+  }
+
+  context = g_option_context_new("client|echo [-- command...]");
+  g_option_context_add_main_entries(context, all_options, NULL);
+  if (!g_option_context_parse(context, &argc, &argv, &error)) {
+    g_print("option parsing failed: %s\n", error->message);
+    g_error_free(error);
+    exit(1);
+  }
+  g_option_context_free(context);
+
+  if(argc != 2 || (port == 0) == (command == NULL || command[0] == NULL)) {
+    fprintf(stderr, "usage: %s client|echo -P <port> | -- <command...>\n", argv[0]);
+    exit(1);
+  }
+  if(msg_size < BENCH_HEADER_SIZE || msg_count < 1 || window < 1) {
+    fprintf(stderr, "nicebench: size must be at least %i, count and window at least 1\n", BENCH_HEADER_SIZE);
+    exit(1);
+  }
+  signal(SIGPIPE, SIG_IGN);
+
+  if(strcmp(argv[1], "echo") == 0) {
+    fd = port ? accept_port(port) : spawn_command(command);
+    run_echo(fd);
+  }
+  else {
+    fd = port ? connect_port(port) : spawn_command(command);
+    run_client(fd);
+  }
+
+  stop_command();
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,74 @@
+#include <glib.h>
+
+#include <stdlib.h>
+#include <errno.h>
+
+#include "bufpool.h"
+
+// only used from the main loop, no locks
+static gpointer free_chunks[BUFPOOL_MAX_FREE];
+static guint n_free = 0;
+
+gpointer
+bufpool_get() {
+  gpointer chunk;
+
+  if(n_free > 0)
+    return free_chunks[--n_free];
+
+  if(posix_memalign(&chunk, BUFPOOL_ALIGN, BUFPOOL_CHUNK_SIZE) != 0) {
+    g_critical("Error allocating a buffer: errno=%i\n", errno);
+    exit(1);
+  }
+  return chunk;
+}
+
+void
+bufpool_put(gpointer chunk) {
+  if(n_free < BUFPOOL_MAX_FREE)
+    free_chunks[n_free++] = chunk;
+  else
+    free(chunk);
+}
+
+void
+bufpool_read_init(BufRead *read, guint n_chunks, gsize chunk_len) {
+  guint i;
+
+  read->n_chunks = CLAMP(n_chunks, 1, BUFPOOL_MAX_CHUNKS);
+  read->chunk_len = MIN(chunk_len, BUFPOOL_CHUNK_SIZE);
+  for(i = 0; i < read->n_chunks; i++) {
+    read->io[i].iov_base = bufpool_get();
+    read->io[i].iov_len = read->chunk_len;
+  }
+}
+
+// after a read of len bytes, returns the number of buffers for the next one
+guint
+bufpool_read_adapt(BufRead *read, gsize len) {
+  gsize capacity = read->n_chunks * read->chunk_len;
+  guint n_chunks = read->n_chunks;
+
+  // more is waiting
+  if(len == capacity && n_chunks < BUFPOOL_MAX_CHUNKS)
+    n_chunks = MIN(2 * n_chunks, BUFPOOL_MAX_CHUNKS);
+  // the load went down
+  else if(len < capacity / 4 && n_chunks > 1)
+    n_chunks /= 2;
+
+  while(read->n_chunks < n_chunks) {
+    read->io[read->n_chunks].iov_base = bufpool_get();
+    read->io[read->n_chunks].iov_len = read->chunk_len;
+    read->n_chunks++;
+  }
+  while(read->n_chunks > n_chunks)
+    bufpool_put(read->io[--read->n_chunks].iov_base);
+
+  return n_chunks;
+}
+
+void
+bufpool_read_release(BufRead *read) {
+  while(read->n_chunks > 0)
+    bufpool_put(read->io[--read->n_chunks].iov_base);
+}
@@ -0,0 +1,34 @@
+#ifndef __BUFPOOL_H__
+#define __BUFPOOL_H__
+
+#include <glib.h>
+#include <sys/uio.h>
+
+// one buffer, a read takes one or more of them
+#define BUFPOOL_CHUNK_SIZE 16384
+// reads of up to 128 KB
+#define BUFPOOL_MAX_CHUNKS 8
+#define BUFPOOL_ALIGN 64
+// buffers kept for reuse, beyond that they are freed
+#define BUFPOOL_MAX_FREE 64
+
+// Buffers of the main loop's data path, cache line aligned and reused. A
+// buffer goes back to the pool once its data was handed on, so forwarding
+// does not allocate once the pool holds what the largest read takes.
+gpointer bufpool_get();
+void bufpool_put(gpointer chunk);
+
+// A read that is spread over buffers of the pool (scatter/gather). Its
+// size adapts: a read that fills all buffers takes twice as many next
+// time, one that fills less than a quarter half as many.
+typedef struct {
+  struct iovec io[BUFPOOL_MAX_CHUNKS];
+  guint n_chunks;
+  gsize chunk_len;
+} BufRead;
+
+void bufpool_read_init(BufRead *read, guint n_chunks, gsize chunk_len);
+guint bufpool_read_adapt(BufRead *read, gsize len);
+void bufpool_read_release(BufRead *read);
+
+#endif
@@ -11,132 +11,447 @@
 #include <sys/socket.h>
 
 #include "util.h"
+#include "exchange.h"
 #include "callbacks.h"
 #include "global.h"
+#include "stripe.h"
+#include "sendq.h"
+#include "outq.h"
+#include "batch.h"
+#include "tls.h"
+#include "tun.h"
+#include "timing.h"
+#include "metrics.h"
+#include "reconnect.h"
+#include "session.h"
+#include "dataplane.h"
+#include "compress.h"
+#include "fec.h"
+#include "rudp.h"
+#include "bufpool.h"
+
+static gboolean
+republish_credentials(gpointer session_ptr) {
+  NiceSession *session = session_ptr;
+
+  session->republish_id = 0;
+  publish_local_credentials(session, FALSE);
+
+  return FALSE;
+}
+
+// trickle ICE: publish candidates as they are gathered, a burst of them
+// (e.g. all host candidates) is published at once
+void
+new_candidate_gathered(NiceAgent *agent, NiceCandidate *candidate, gpointer session_ptr) {
+  NiceSession *session = session_ptr;
+
+  if(!exchange_supports_trickle())
+    return;
+
+  if(session->republish_id == 0)
+    session->republish_id = g_idle_add(republish_credentials, session);
+}
 
 gboolean
-exchange_credentials(NiceAgent *agent, guint stream_id, gpointer data) {
-  g_debug("exchange_credentials(): candidate gathering done\n");
+exchange_credentials(NiceAgent *agent, guint stream_id, gpointer session_ptr) {
+  NiceSession *session = session_ptr;
 
-  publish_local_credentials(agent, stream_id);
-  lookup_remote_credentials(agent, stream_id);
+  g_debug("exchange_credentials(): candidate gathering done\n");
+  timing_mark(TIMING_GATHERING_DONE);
 
-  pipe_stdio_to_hook("NICE_PIPE_BEFORE", exit_if_child_exited);
+  if(session->republish_id != 0) {
+    g_source_remove(session->republish_id);
+    session->republish_id = 0;
+  }
+  publish_local_credentials(session, TRUE);
 
   g_debug("candidate gathering done\n");
 }
 
-void
-start_server(NiceAgent *agent, guint stream_id, guint component_id, guint state, gpointer server_ptr) {
-  GSocketService* server = (GSocketService*) server_ptr;
+static void
+start_forwarding(NiceSession *session) {
   g_debug("Server starts listening.\n");
 
-  if(is_caller)
-    g_socket_service_start(server);
-  else
-    setup_client(agent);
+  if(use_tls && !tls_start(session))
+    return;
+
+  if(tun_address != NULL)
+    tun_start(session);
+  else if(session->is_caller)
+    g_socket_service_start(session->server);
+  else if(!multiplex)
+    setup_client(session);
 
-  pipe_stdio_to_hook("NICE_PIPE_AFTER", exit_if_child_exited);
+  pipe_stdio_to_hook(session->remote_hostname, "NICE_PIPE_AFTER", exit_if_child_exited);
 
-  g_message("Connection to %s established.\n", remote_hostname);
+  g_message("Connection to %s established.\n", session->remote_hostname);
 }
 
 void
-start_server_reliable(NiceAgent *agent, guint stream_id, guint component_id, gpointer server_ptr) {
-  GSocketService* server = (GSocketService*) server_ptr;
-  g_debug("Server starts listening.\n");
+start_server(NiceAgent *agent, guint stream_id, guint component_id, guint state, gpointer session_ptr) {
+  NiceSession *session = session_ptr;
 
-  if(is_caller)
-    g_socket_service_start(server);
-  else
-    setup_client(agent);
+  if(state != NICE_COMPONENT_STATE_READY || session->started)
+    return;
+  session->started = TRUE;
+
+  start_forwarding(session);
+}
+
+// reliable-transport-writable is emitted for every component and again
+// whenever a full send buffer drains, so only start once all are writable
+static gboolean
+all_components_writable(NiceSession *session, guint component_id) {
+  session->writable_components |= 1 << (component_id - 1);
+  if(session->started || session->writable_components != (1 << n_components) - 1)
+    return FALSE;
+
+  session->started = TRUE;
+  return TRUE;
+}
+
+void
+start_server_reliable(NiceAgent *agent, guint stream_id, guint component_id, gpointer session_ptr) {
+  NiceSession *session = session_ptr;
 
-  pipe_stdio_to_hook("NICE_PIPE_AFTER", exit_if_child_exited);
+  if(!all_components_writable(session, component_id))
+    return;
 
-  g_message("Connection to %s established.\n", remote_hostname);
+  start_forwarding(session);
 }
 
 void
-attach_stdin2send_callback(NiceAgent *agent, guint stream_id, guint component_id, guint state) {
-  if (state == NICE_COMPONENT_STATE_READY) {
-    unpublish_local_credentials(agent, stream_id);
+attach_stdin2send_callback(NiceAgent *agent, guint stream_id, guint component_id, guint state,
+    gpointer session_ptr) {
+  NiceSession *session = session_ptr;
+
+  if (state == NICE_COMPONENT_STATE_READY && !session->started) {
+    session->started = TRUE;
+    unpublish_local_credentials(session);
+    if(threaded) {
+      dataplane_start(session, fileno(stdin), session->output_fd);
+      return;
+    }
+
     GIOChannel* io_stdin;
     io_stdin = g_io_channel_unix_new(fileno(stdin));
 
-    g_io_add_watch(io_stdin, G_IO_IN, send_data, agent);
+    g_io_add_watch(io_stdin, G_IO_IN, send_data, session);
   }
 
-  if (state == NICE_COMPONENT_STATE_FAILED) {
-    g_main_loop_quit (gloop);
+  // with -r the connection is restarted instead
+  if (state == NICE_COMPONENT_STATE_FAILED && !(auto_reconnect && session->started)) {
+    session_end(session);
   }
 }
 
 void
-attach_stdin2send_callback_reliable(NiceAgent *agent, guint stream_id, guint component_id, gpointer data) {
-  unpublish_local_credentials(agent, stream_id);
+attach_stdin2send_callback_reliable(NiceAgent *agent, guint stream_id, guint component_id,
+    gpointer session_ptr) {
+  NiceSession *session = session_ptr;
+
+  if(!all_components_writable(session, component_id))
+    return;
+
+  unpublish_local_credentials(session);
+  if(threaded) {
+    dataplane_start(session, fileno(stdin), session->output_fd);
+    return;
+  }
 
   GIOChannel* io_stdin;
   io_stdin = g_io_channel_unix_new(fileno(stdin));
 
-  g_io_add_watch(io_stdin, G_IO_IN, send_data, agent);
+  g_io_add_watch(io_stdin, G_IO_IN, send_data, session);
+}
+
+static gboolean
+resume_send_data(gpointer session_ptr) {
+  NiceSession *session = session_ptr;
+  GIOChannel *source = session->parked_source;
+
+  g_debug("send queue drained, reading again\n");
+  session->parked_source = NULL;
+  g_io_add_watch(source, G_IO_IN, send_data, session);
+  g_io_channel_unref(source);
+
+  return FALSE;
 }
 
+// reads what is there, one datagram at a time with -u; otherwise as much
+// as the pool buffers of one read take, and more of them next time if
+// that filled all of them
 gboolean
-send_data(GIOChannel *source, GIOCondition cond, gpointer agent_ptr) {
-  static char buffer[10240];
-  struct iovec io;
-  char crap[10240];
-  const gsize max_size = 10240;
-  gsize len;
-
-  NiceAgent *agent = agent_ptr;
+send_data(GIOChannel *source, GIOCondition cond, gpointer session_ptr) {
+  NiceSession *session = session_ptr;
+  int sock = g_io_channel_unix_get_fd(source);
   struct msghdr msgh;
-  struct cmsghdr *cmsg;
+  BufRead read;
+  gboolean keep_watch = TRUE;
+  guint n_reads, i;
+  gssize res;
+  gsize left;
 
-  gint res;
-  do {
-    io.iov_base = buffer;
-    io.iov_len = max_size;
+  if(not_reliable && batch_size > 1)
+    return batch_send_data(source, cond, session_ptr);
+
+  if(not_reliable)
+    bufpool_read_init(&read, 1, SEND_DATA_MAX_DATAGRAM);
+  else
+    bufpool_read_init(&read, MAX(session->read_chunks, 1), BUFPOOL_CHUNK_SIZE);
+
+  // until the fd is drained, but leave other sources a turn eventually
+  for(n_reads = 0; n_reads < SEND_DATA_MAX_READS; n_reads++) {
     memset(&msgh, 0, sizeof(msgh));
-    msgh.msg_iov = &io;
-    msgh.msg_iovlen = 5;
-    msgh.msg_control = &crap;
-    msgh.msg_controllen = sizeof(crap);
+    msgh.msg_iov = read.io;
+    msgh.msg_iovlen = read.n_chunks;
 
-    int sock = g_io_channel_unix_get_fd(source);
-    
     res = recvmsg(sock, &msgh, MSG_DONTWAIT);
-    if(res > -1) {
-      if(res == 0) {
-        // probably FLUSHED
-        g_main_loop_quit(gloop);
-        return FALSE;
+    if(res < 0) {
+      if(errno == EINTR)
+        continue;
+      if(errno != EAGAIN && errno != EWOULDBLOCK) {
+        g_critical("Error sending: recvmsg() = %zi, errno=%i\n", res, errno);
+        session_end(session);
+        keep_watch = FALSE;
       }
+      break;
+    }
+    if(res == 0) {
+      // probably FLUSHED
+      session_end(session);
+      keep_watch = FALSE;
+      break;
+    }
 
-      g_debug("recvmsg: %i\n", res);
-      res = nice_agent_send(agent, nice_stream_id, 1, res, buffer);
-      g_debug("nice_agent_send: %i\n", res);
+    g_debug("recvmsg: %zi\n", res);
+    for(i = 0, left = res; i < read.n_chunks && left > 0; i++) {
+      gsize len = MIN(left, read.io[i].iov_len);
+
+      send_to_peer(session, len, read.io[i].iov_base);
+      left -= len;
     }
-    else {
-      if(errno != EAGAIN && errno != EWOULDBLOCK) {
-        g_critical("Error sending: recvmsg() = %i, errno=%i\n", res, errno);
-        g_main_loop_quit(gloop);
-        break;
-      }
-      if(errno == EAGAIN || errno == EWOULDBLOCK)
-        break;
+    if(!not_reliable)
+      session->read_chunks = bufpool_read_adapt(&read, res);
+
+    if(sendq_full(session)) {
+      // stop reading until the agent accepted the queued data
+      session->parked_source = g_io_channel_ref(source);
+      sendq_on_drain(session, resume_send_data, session);
+      keep_watch = FALSE;
+      break;
     }
   }
-  while(len < max_size);
 
-  return TRUE;
+  bufpool_read_release(&read);
+  return keep_watch;
+}
+
+gint
+send_to_peer(NiceSession *session, guint len, const gchar *buf) {
+  timing_mark(TIMING_FIRST_SENT);
+  metrics.sent_bytes += len;
+  metrics.sent_messages++;
+
+  if(compress_active(session))
+    return compress_send(session, len, buf);
+
+  return send_tls(session, len, buf);
+}
+
+gint
+send_tls(NiceSession *session, guint len, const gchar *buf) {
+  if(use_tls)
+    return tls_send(session, len, buf);
+
+  return send_raw(session, len, buf);
+}
+
+gint
+send_raw(NiceSession *session, guint len, const gchar *buf) {
+  if(auto_reconnect && !not_reliable)
+    return reconnect_send(session, len, buf);
+
+  if(fec_spec != NULL)
+    return fec_send(session, len, buf);
+
+  return send_components(session, len, buf);
+}
+
+gint
+send_components(NiceSession *session, guint len, const gchar *buf) {
+  if(n_components > 1)
+    return stripe_send(session, len, buf);
+
+  return sendq_send(session, 1, len, buf);
+}
+
+static void
+recv_first(NiceAgent *agent, guint stream_id, guint component_id, guint len,
+    gchar *buf, gpointer session_ptr) {
+  NiceSession *session = session_ptr;
+
+  timing_mark(TIMING_FIRST_RECEIVED);
+  session->first_received = TRUE;
+
+  // from now on without this detour
+  attach_recv_callbacks(session, session->recv_func);
+  session->recv_func(agent, stream_id, component_id, len, buf, session);
+}
+
+static void
+attach_component(NiceSession *session, guint component_id) {
+  NiceAgentRecvFunc agent_func = session->first_received ? session->recv_func : recv_first;
+
+  // the datagrams go to the transport, which hands on the stream
+  if(udp_transport) {
+    rudp_set_deliver(session, agent_func);
+    agent_func = rudp_recv;
+  }
+
+  nice_agent_attach_recv(session->agent, session->stream_id, component_id,
+    g_main_loop_get_context(gloop), agent_func, session);
+}
+
+void
+attach_recv_callbacks(NiceSession *session, NiceAgentRecvFunc func) {
+  guint component_id;
+
+  session->recv_func = func;
+  for(component_id = 1; component_id <= n_components; component_id++)
+    if(!(session->held_components & (1 << (component_id - 1))))
+      attach_component(session, component_id);
+}
+
+// after the stream was replaced
+void
+reattach_recv_callbacks(NiceSession *session) {
+  if(!session->receiving_paused)
+    attach_recv_callbacks(session, session->recv_func);
+}
+
+void
+pause_receiving(NiceSession *session) {
+  guint component_id;
+
+  // datagrams cannot be held back, they are dropped instead
+  if(session->receiving_paused || not_reliable)
+    return;
+
+  g_debug("output queue full, pausing receive\n");
+
+  // the transport of our own keeps acknowledging, its window closes instead
+  if(udp_transport) {
+    session->receiving_paused = TRUE;
+    return;
+  }
+
+  // without a callback the agent keeps the data and the pseudo TCP
+  // window closes, so the remote sender slows down
+  for(component_id = 1; component_id <= n_components; component_id++)
+    nice_agent_attach_recv(session->agent, session->stream_id, component_id,
+      g_main_loop_get_context(gloop), NULL, NULL);
+  session->receiving_paused = TRUE;
+}
+
+// hands on what the agent buffered while the component was not read, the
+// callback may pause receiving or hold the component again meanwhile
+static void
+drain_component(NiceSession *session, guint component_id) {
+  static guint8 buf[65536];
+  guint32 held = 1 << (component_id - 1);
+
+  while(!session->receiving_paused && !(session->held_components & held)) {
+    gssize len = nice_agent_recv_nonblocking(session->agent, session->stream_id, component_id,
+      buf, sizeof(buf), NULL, NULL);
+    if(len <= 0)
+      break;
+
+    session->recv_func(session->agent, session->stream_id, component_id, len, (gchar*) buf, session);
+  }
+}
+
+// a component that was held on its own (striping) is read again
+void
+resume_component(NiceSession *session, guint component_id) {
+  drain_component(session, component_id);
+
+  if(!session->receiving_paused && !(session->held_components & (1 << (component_id - 1))))
+    attach_component(session, component_id);
+}
+
+void
+resume_receiving(NiceSession *session) {
+  guint component_id;
+
+  if(!session->receiving_paused)
+    return;
+  session->receiving_paused = FALSE;
+
+  g_debug("output queue drained, resuming receive\n");
+  if(udp_transport) {
+    rudp_resume(session);
+    return;
+  }
+
+  // segments that were received but not delivered yet go first
+  if(n_components > 1)
+    stripe_resume(session);
+
+  for(component_id = 1; component_id <= n_components; component_id++)
+    drain_component(session, component_id);
+
+  if(!session->receiving_paused)
+    attach_recv_callbacks(session, session->recv_func);
+}
+
+static void
+output_written(OutputQueue *queue, gsize written, gpointer session_ptr) {
+  if(outq_pending(queue) < OUTQ_LOW_WATER)
+    resume_receiving(session_ptr);
+}
+
+gsize
+output_queue_pending(NiceSession *session) {
+  return session->output_queue != NULL ? outq_pending(session->output_queue) : 0;
+}
+
+// the queue in front of the session's current output fd
+OutputQueue*
+output_queue(NiceSession *session) {
+  if(session->output_queue == NULL || outq_get_fd(session->output_queue) != session->output_fd) {
+    if(session->output_queue != NULL)
+      outq_free(session->output_queue);
+    session->output_queue = outq_new(session->output_fd, OUTQ_CAPACITY, output_written, session);
+  }
+
+  return session->output_queue;
 }
 
 void
 recv_data2fd(NiceAgent *agent, guint stream_id, guint component_id, guint len,
-    gchar *buf, gpointer data) {
-  unpublish_local_credentials(agent, stream_id);
-  g_debug("recv_data2fd(fd=%u, len=%u)\n", output_fd, len);
-  write(output_fd, buf, len);
-//  syncfs(output_fd);
+    gchar *buf, gpointer session_ptr) {
+  NiceSession *session = session_ptr;
+
+  unpublish_local_credentials(session);
+  g_debug("recv_data2fd(fd=%i, len=%u)\n", session->output_fd, len);
+
+  if(threaded) {
+    dataplane_recv(session, len, buf);
+    return;
+  }
+
+  output_queue(session);
+  if(not_reliable && outq_full(session->output_queue)) {
+    g_debug("output queue full, dropping %u bytes\n", len);
+    metrics.dropped++;
+    return;
+  }
+
+  metrics.received_bytes += len;
+  metrics.received_messages++;
+  outq_write(session->output_queue, buf, len);
+  if(outq_full(session->output_queue))
+    pause_receiving(session);
 }
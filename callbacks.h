@@ -1,15 +1,34 @@
 #ifndef __CALLBACKS_H__
 #define __CALLBACKS_H__
 
-gboolean exchange_credentials(NiceAgent *agent, guint stream_id, gpointer data);
-void attach_stdin2send_callback(NiceAgent *agent, guint stream_id, guint component_id, guint state);
-void attach_stdin2send_callback_reliable(NiceAgent *agent, guint stream_id, guint component_id, gpointer data);
-gboolean send_data(GIOChannel *source, GIOCondition cond, gpointer agent_ptr);
-void recv_data2stdout(NiceAgent *agent, guint stream_id, guint component_id, guint len, gchar *buf, gpointer data);
+#include "session.h"
 
-void start_server(NiceAgent *agent, guint stream_id, guint component_id, guint state, gpointer server_ptr);
-void start_server_reliable(NiceAgent *agent, guint stream_id, guint component_id, gpointer data);
+// reads per wakeup of send_data(), then other sources get a turn
+#define SEND_DATA_MAX_READS 64
+// with -u every read is one datagram of up to this size
+#define SEND_DATA_MAX_DATAGRAM 10240
 
-void recv_data2fd(NiceAgent *agent, guint stream_id, guint component_id, guint len, gchar *buf, gpointer data);
+// every callback gets its NiceSession as user data
+void new_candidate_gathered(NiceAgent *agent, NiceCandidate *candidate, gpointer session_ptr);
+gboolean exchange_credentials(NiceAgent *agent, guint stream_id, gpointer session_ptr);
+void attach_stdin2send_callback(NiceAgent *agent, guint stream_id, guint component_id, guint state, gpointer session_ptr);
+void attach_stdin2send_callback_reliable(NiceAgent *agent, guint stream_id, guint component_id, gpointer session_ptr);
+gboolean send_data(GIOChannel *source, GIOCondition cond, gpointer session_ptr);
+gint send_to_peer(NiceSession *session, guint len, const gchar *buf);
+gint send_tls(NiceSession *session, guint len, const gchar *buf);
+gint send_raw(NiceSession *session, guint len, const gchar *buf);
+gint send_components(NiceSession *session, guint len, const gchar *buf);
+
+void start_server(NiceAgent *agent, guint stream_id, guint component_id, guint state, gpointer session_ptr);
+void start_server_reliable(NiceAgent *agent, guint stream_id, guint component_id, gpointer session_ptr);
+
+gsize output_queue_pending(NiceSession *session);
+OutputQueue* output_queue(NiceSession *session);
+void recv_data2fd(NiceAgent *agent, guint stream_id, guint component_id, guint len, gchar *buf, gpointer session_ptr);
+void attach_recv_callbacks(NiceSession *session, NiceAgentRecvFunc func);
+void reattach_recv_callbacks(NiceSession *session);
+void pause_receiving(NiceSession *session);
+void resume_receiving(NiceSession *session);
+void resume_component(NiceSession *session, guint component_id);
 
 #endif
@@ -0,0 +1,213 @@
+#include <glib.h>
+#include <agent.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "coalesce.h"
+#include "callbacks.h"
+#include "util.h"
+#include "metrics.h"
+#include "global.h"
+
+static guint coalesce_delay_us = COALESCE_DEFAULT_DELAY_US;
+
+struct _Coalesce {
+  NiceAgentRecvFunc deliver;
+
+  // outgoing: IP packets waiting for the frame to fill up or the deadline
+  gchar frame[COALESCE_HEADER_SIZE + COALESCE_MAX_FRAME];
+  gsize frame_len;
+  GSource *flush_source;
+
+  // incoming: partially received frames
+  GByteArray *rx;
+  gsize rx_skip; // rest of an oversized frame
+};
+
+static guint64 sent_packets = 0, sent_frames = 0;
+static guint64 recv_packets = 0, recv_frames = 0;
+
+static void
+coalesce_flush(NiceSession *session) {
+  Coalesce *coalesce = session->coalesce;
+  guint32 net_len = g_htonl(coalesce->frame_len);
+
+  g_source_set_ready_time(coalesce->flush_source, -1);
+  if(coalesce->frame_len == 0)
+    return;
+
+  memcpy(coalesce->frame, &net_len, sizeof(net_len));
+  send_to_peer(session, COALESCE_HEADER_SIZE + coalesce->frame_len, coalesce->frame);
+
+  sent_frames++;
+  coalesce->frame_len = 0;
+}
+
+static gboolean
+coalesce_timeout(gpointer session_ptr) {
+  coalesce_flush(session_ptr);
+  return TRUE;
+}
+
+static gboolean
+coalesce_dispatch(GSource *source, GSourceFunc callback, gpointer data) {
+  return callback(data);
+}
+
+static GSourceFuncs coalesce_source_funcs = {
+  NULL, NULL, coalesce_dispatch, NULL
+};
+
+void
+coalesce_init(NiceSession *session, guint delay_us, NiceAgentRecvFunc deliver) {
+  Coalesce *coalesce = g_new0(Coalesce, 1);
+
+  coalesce->deliver = deliver;
+  coalesce_delay_us = delay_us;
+  coalesce->rx = g_byte_array_new();
+
+  // a timeout source only has millisecond resolution, a ready time is
+  // checked against the monotonic clock on every main loop iteration
+  coalesce->flush_source = g_source_new(&coalesce_source_funcs, sizeof(GSource));
+  g_source_set_callback(coalesce->flush_source, coalesce_timeout, session, NULL);
+  g_source_set_ready_time(coalesce->flush_source, -1);
+  g_source_attach(coalesce->flush_source, g_main_loop_get_context(gloop));
+  session->coalesce = coalesce;
+}
+
+void
+coalesce_free(NiceSession *session) {
+  Coalesce *coalesce = session->coalesce;
+
+  if(coalesce == NULL)
+    return;
+
+  g_source_destroy(coalesce->flush_source);
+  g_source_unref(coalesce->flush_source);
+  g_byte_array_unref(coalesce->rx);
+  g_free(coalesce);
+  session->coalesce = NULL;
+}
+
+void
+coalesce_packet(NiceSession *session, const gchar *packet, gsize len) {
+  Coalesce *coalesce = session->coalesce;
+  guint16 net_len = g_htons(len);
+
+  if(COALESCE_PACKET_HEADER_SIZE + len > COALESCE_MAX_FRAME) {
+    // only with a tun MTU far above the path MTU
+    g_debug("coalesce: dropping oversized packet (%zu bytes)\n", len);
+    metrics.dropped++;
+    return;
+  }
+
+  if(coalesce->frame_len + COALESCE_PACKET_HEADER_SIZE + len > COALESCE_MAX_FRAME)
+    coalesce_flush(session);
+
+  memcpy(coalesce->frame + COALESCE_HEADER_SIZE + coalesce->frame_len, &net_len, sizeof(net_len));
+  coalesce->frame_len += COALESCE_PACKET_HEADER_SIZE;
+  memcpy(coalesce->frame + COALESCE_HEADER_SIZE + coalesce->frame_len, packet, len);
+  coalesce->frame_len += len;
+  sent_packets++;
+
+  if(coalesce_delay_us == 0 || coalesce->frame_len >= COALESCE_MAX_FRAME)
+    coalesce_flush(session);
+  else if(g_source_get_ready_time(coalesce->flush_source) == -1)
+    g_source_set_ready_time(coalesce->flush_source, g_get_monotonic_time() + coalesce_delay_us);
+}
+
+static void
+coalesce_split(NiceAgent *agent, guint stream_id, gchar *payload, gsize len, gpointer data) {
+  NiceSession *session = data;
+  gsize offset = 0, packet_len;
+
+  while(offset < len) {
+    guint16 net_len;
+    gchar *packet = payload + offset + COALESCE_PACKET_HEADER_SIZE;
+    gsize len_field;
+
+    if(len - offset < COALESCE_PACKET_HEADER_SIZE) {
+      g_debug("coalesce: dropping %zu trailing bytes\n", len - offset);
+      metrics.dropped++;
+      return;
+    }
+    memcpy(&net_len, payload + offset, sizeof(net_len));
+    len_field = g_ntohs(net_len);
+    if(len_field > len - offset - COALESCE_PACKET_HEADER_SIZE) {
+      g_debug("coalesce: truncated packet (%zu of %zu bytes)\n",
+        len - offset - COALESCE_PACKET_HEADER_SIZE, len_field);
+      metrics.dropped++;
+      return;
+    }
+    offset += COALESCE_PACKET_HEADER_SIZE + len_field;
+
+    // the length in front of it still leads to the next one
+    if(!parse_packet(packet, len_field, &packet_len) || packet_len != len_field) {
+      g_debug("coalesce: dropping malformed packet (%zu bytes)\n", len_field);
+      metrics.dropped++;
+      continue;
+    }
+
+    session->coalesce->deliver(agent, stream_id, 1, packet_len, packet, data);
+    recv_packets++;
+  }
+}
+
+void
+coalesce_recv(NiceAgent *agent, guint stream_id, guint component_id, guint len,
+    gchar *buf, gpointer data) {
+  NiceSession *session = data;
+  Coalesce *coalesce = session->coalesce;
+  GByteArray *rx = coalesce->rx;
+  gsize offset = 0;
+
+  if(coalesce->rx_skip > 0) {
+    guint skipped = MIN(coalesce->rx_skip, len);
+
+    coalesce->rx_skip -= skipped;
+    buf += skipped;
+    len -= skipped;
+  }
+
+  g_byte_array_append(rx, (guint8*) buf, len);
+
+  while(rx->len - offset >= COALESCE_HEADER_SIZE) {
+    gchar *header = (gchar*) rx->data + offset;
+    guint32 payload_len;
+
+    memcpy(&payload_len, header, sizeof(payload_len));
+    payload_len = g_ntohl(payload_len);
+
+    if(payload_len > COALESCE_MAX_FRAME) {
+      // the peer never sends these, skip it and stay in sync with the stream
+      gsize available = MIN(rx->len - offset - COALESCE_HEADER_SIZE, payload_len);
+
+      g_debug("coalesce: dropping oversized frame (%u bytes)\n", payload_len);
+      metrics.dropped++;
+      coalesce->rx_skip = payload_len - available;
+      offset += COALESCE_HEADER_SIZE + available;
+      continue;
+    }
+
+    // wait for the rest of the frame
+    if(rx->len - offset < COALESCE_HEADER_SIZE + payload_len)
+      break;
+
+    coalesce_split(agent, stream_id, header + COALESCE_HEADER_SIZE, payload_len, data);
+    recv_frames++;
+    offset += COALESCE_HEADER_SIZE + payload_len;
+  }
+
+  g_byte_array_remove_range(rx, 0, offset);
+}
+
+void
+coalesce_report() {
+  g_message("coalesce: sent %" G_GUINT64_FORMAT " packets in %" G_GUINT64_FORMAT
+    " frames (%.1f per frame)\n",
+    sent_packets, sent_frames, sent_frames ? (gdouble) sent_packets/sent_frames : 0.0);
+  g_message("coalesce: received %" G_GUINT64_FORMAT " packets in %" G_GUINT64_FORMAT
+    " frames (%.1f per frame)\n",
+    recv_packets, recv_frames, recv_frames ? (gdouble) recv_packets/recv_frames : 0.0);
+}
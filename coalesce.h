@@ -0,0 +1,22 @@
+#ifndef __COALESCE_H__
+#define __COALESCE_H__
+
+#include <glib.h>
+#include <agent.h>
+
+#include "session.h"
+
+// every frame starts with the length of the IP packets it carries, every
+// packet with its own length so that a bad one can be skipped
+#define COALESCE_HEADER_SIZE 4
+#define COALESCE_PACKET_HEADER_SIZE 2
+#define COALESCE_MAX_FRAME 16384
+#define COALESCE_DEFAULT_DELAY_US 200
+
+void coalesce_init(NiceSession *session, guint delay_us, NiceAgentRecvFunc deliver);
+void coalesce_free(NiceSession *session);
+void coalesce_packet(NiceSession *session, const gchar *packet, gsize len);
+void coalesce_recv(NiceAgent *agent, guint stream_id, guint component_id, guint len, gchar *buf, gpointer data);
+void coalesce_report();
+
+#endif
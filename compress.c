@@ -0,0 +1,255 @@
+#include <glib.h>
+#include <agent.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <lz4.h>
+
+#include "compress.h"
+#include "callbacks.h"
+#include "metrics.h"
+#include "global.h"
+
+// LZ4 compression below TLS (-Z), used once both peers offered it in their
+// credentials. Every block starts with a header:
+//
+//   type (COMPRESS_RAW or COMPRESS_LZ4), stored length, original length
+//
+// Reliable connections compress the stream: a block may refer to the one
+// before it, both sides keep the last two blocks. A raw block starts over
+// on both sides. With -u every datagram is a block of its own.
+//
+// Blocks that do not shrink (compressed or encrypted data) are sent raw,
+// and the following ones are not even tried for a while, up to
+// COMPRESS_MAX_BACKOFF blocks if that keeps happening.
+
+#define COMPRESS_RAW 0
+#define COMPRESS_LZ4 1
+
+static gchar frame[COMPRESS_HEADER_SIZE + LZ4_COMPRESSBOUND(COMPRESS_BLOCK_SIZE)];
+
+struct _Compress {
+  NiceAgentRecvFunc deliver;
+
+  // outgoing
+  LZ4_stream_t *encoder;
+  gchar history[2][COMPRESS_BLOCK_SIZE];
+  guint history_index;
+  guint backoff, skip;
+
+  // incoming
+  LZ4_streamDecode_t *decoder;
+  gchar decoded[2][COMPRESS_BLOCK_SIZE];
+  guint decoded_index;
+  GByteArray *rx;
+};
+
+static guint64 sent_bytes = 0, sent_stored = 0, sent_blocks = 0, sent_raw = 0;
+static guint64 recv_bytes = 0, recv_stored = 0;
+
+void
+compress_init(NiceSession *session, NiceAgentRecvFunc deliver) {
+  Compress *compress = g_new0(Compress, 1);
+
+  compress->deliver = deliver;
+  compress->encoder = LZ4_createStream();
+  compress->decoder = LZ4_createStreamDecode();
+  compress->rx = g_byte_array_new();
+  session->compress = compress;
+}
+
+void
+compress_free(NiceSession *session) {
+  Compress *compress = session->compress;
+
+  if(compress == NULL)
+    return;
+
+  LZ4_freeStream(compress->encoder);
+  LZ4_freeStreamDecode(compress->decoder);
+  g_byte_array_unref(compress->rx);
+  g_free(compress);
+  session->compress = NULL;
+}
+
+// both peers have to agree, a peer without -Z does not offer it
+gboolean
+compress_active(NiceSession *session) {
+  return use_compression && session->remote_compression;
+}
+
+static gint
+compress_block(NiceSession *session, const gchar *data, guint len) {
+  Compress *compress = session->compress;
+  guint8 type = COMPRESS_RAW;
+  gint stored = 0;
+
+  if(compress->skip > 0)
+    compress->skip--;
+  // with -u there is no history that would make tiny blocks worth it
+  else if(!not_reliable || len >= COMPRESS_MIN_SIZE) {
+    if(not_reliable)
+      stored = LZ4_compress_default(data, frame + COMPRESS_HEADER_SIZE, len,
+        sizeof(frame) - COMPRESS_HEADER_SIZE);
+    else {
+      // the previous block has to stay where it is
+      memcpy(compress->history[compress->history_index], data, len);
+      stored = LZ4_compress_fast_continue(compress->encoder, compress->history[compress->history_index],
+        frame + COMPRESS_HEADER_SIZE, len, sizeof(frame) - COMPRESS_HEADER_SIZE, 1);
+      compress->history_index ^= 1;
+    }
+
+    if(stored > 0 && stored <= len - len / COMPRESS_MIN_SAVING) {
+      type = COMPRESS_LZ4;
+      compress->backoff = 0;
+    }
+    else {
+      compress->backoff = compress->backoff ? MIN(2 * compress->backoff, COMPRESS_MAX_BACKOFF) : 1;
+      compress->skip = compress->backoff;
+    }
+  }
+
+  if(type == COMPRESS_RAW) {
+    memcpy(frame + COMPRESS_HEADER_SIZE, data, len);
+    stored = len;
+    sent_raw++;
+
+    if(!not_reliable) {
+      LZ4_resetStream_fast(compress->encoder);
+      compress->history_index = 0;
+    }
+  }
+
+  frame[0] = type;
+  frame[1] = stored >> 8;
+  frame[2] = stored & 0xff;
+  frame[3] = len >> 8;
+  frame[4] = len & 0xff;
+
+  sent_bytes += len;
+  sent_stored += COMPRESS_HEADER_SIZE + stored;
+  sent_blocks++;
+
+  return send_tls(session, COMPRESS_HEADER_SIZE + stored, frame);
+}
+
+gint
+compress_send(NiceSession *session, guint len, const gchar *buf) {
+  guint offset = 0;
+  gint res = 0;
+
+  while(offset < len) {
+    guint chunk = MIN(len - offset, COMPRESS_BLOCK_SIZE);
+
+    res = compress_block(session, buf + offset, chunk);
+    if(res < 0)
+      return not_reliable ? res : offset;
+    offset += chunk;
+  }
+
+  return len;
+}
+
+// FALSE if the block is broken; otherwise delivered
+static gboolean
+compress_unpack(NiceAgent *agent, guint stream_id, guint component_id, const guint8 *header,
+    gpointer session_ptr) {
+  NiceSession *session = session_ptr;
+  Compress *compress = session->compress;
+  guint stored = (header[1] << 8) | header[2];
+  guint len = (header[3] << 8) | header[4];
+  const gchar *payload = (const gchar*) header + COMPRESS_HEADER_SIZE;
+  gchar *out;
+  gint res;
+
+  if(len > COMPRESS_BLOCK_SIZE)
+    return FALSE;
+
+  recv_stored += COMPRESS_HEADER_SIZE + stored;
+  recv_bytes += len;
+
+  if(header[0] == COMPRESS_RAW) {
+    if(stored != len)
+      return FALSE;
+
+    if(!not_reliable) {
+      LZ4_setStreamDecode(compress->decoder, NULL, 0);
+      compress->decoded_index = 0;
+    }
+    compress->deliver(agent, stream_id, component_id, len, (gchar*) payload, session_ptr);
+    return TRUE;
+  }
+
+  if(header[0] != COMPRESS_LZ4)
+    return FALSE;
+
+  out = compress->decoded[compress->decoded_index];
+  if(not_reliable)
+    res = LZ4_decompress_safe(payload, out, stored, COMPRESS_BLOCK_SIZE);
+  else {
+    res = LZ4_decompress_safe_continue(compress->decoder, payload, out, stored, COMPRESS_BLOCK_SIZE);
+    compress->decoded_index ^= 1;
+  }
+  if(res != len)
+    return FALSE;
+
+  compress->deliver(agent, stream_id, component_id, len, out, session_ptr);
+  return TRUE;
+}
+
+void
+compress_recv(NiceAgent *agent, guint stream_id, guint component_id, guint len,
+    gchar *buf, gpointer session_ptr) {
+  NiceSession *session = session_ptr;
+  Compress *compress = session->compress;
+  GByteArray *rx = compress->rx;
+  gsize offset = 0;
+
+  if(!compress_active(session)) {
+    compress->deliver(agent, stream_id, component_id, len, buf, session_ptr);
+    return;
+  }
+
+  // a datagram is one block, lost or broken ones are dropped
+  if(not_reliable) {
+    if(len < COMPRESS_HEADER_SIZE
+        || ((guint8) buf[1] << 8 | (guint8) buf[2]) != len - COMPRESS_HEADER_SIZE
+        || !compress_unpack(agent, stream_id, component_id, (guint8*) buf, session_ptr)) {
+      g_debug("compress: dropping a broken datagram of %u bytes\n", len);
+      metrics.dropped++;
+    }
+    return;
+  }
+
+  g_byte_array_append(rx, (guint8*) buf, len);
+
+  while(rx->len - offset >= COMPRESS_HEADER_SIZE) {
+    const guint8 *header = rx->data + offset;
+    guint stored = (header[1] << 8) | header[2];
+
+    // wait for the rest of the block
+    if(rx->len - offset < COMPRESS_HEADER_SIZE + stored)
+      break;
+
+    if(!compress_unpack(agent, stream_id, component_id, header, session_ptr)) {
+      g_critical("compress: broken block of %u bytes, giving up\n", stored);
+      g_byte_array_set_size(rx, 0);
+      session_end(session_ptr);
+      return;
+    }
+    offset += COMPRESS_HEADER_SIZE + stored;
+  }
+
+  g_byte_array_remove_range(rx, 0, offset);
+}
+
+void
+compress_report() {
+  g_message("compress: sent %" G_GUINT64_FORMAT " bytes as %" G_GUINT64_FORMAT
+    " (%.2fx), %" G_GUINT64_FORMAT " of %" G_GUINT64_FORMAT " blocks raw\n",
+    sent_bytes, sent_stored, sent_stored ? (gdouble) sent_bytes/sent_stored : 0.0,
+    sent_raw, sent_blocks);
+  g_message("compress: received %" G_GUINT64_FORMAT " bytes as %" G_GUINT64_FORMAT " (%.2fx)\n",
+    recv_bytes, recv_stored, recv_stored ? (gdouble) recv_bytes/recv_stored : 0.0);
+}
@@ -0,0 +1,27 @@
+#ifndef __COMPRESS_H__
+#define __COMPRESS_H__
+
+#include <glib.h>
+#include <agent.h>
+
+#include "session.h"
+
+// type, stored length, original length
+#define COMPRESS_HEADER_SIZE 5
+// larger writes are split into blocks of this size
+#define COMPRESS_BLOCK_SIZE 16384
+// blocks smaller than this are sent as they are
+#define COMPRESS_MIN_SIZE 32
+// a block that shrinks less than 1/16 is sent raw ...
+#define COMPRESS_MIN_SAVING 16
+// ... and up to this many blocks after it are not tried at all
+#define COMPRESS_MAX_BACKOFF 64
+
+void compress_init(NiceSession *session, NiceAgentRecvFunc deliver);
+void compress_free(NiceSession *session);
+gboolean compress_active(NiceSession *session);
+gint compress_send(NiceSession *session, guint len, const gchar *buf);
+void compress_recv(NiceAgent *agent, guint stream_id, guint component_id, guint len, gchar *buf, gpointer data);
+void compress_report();
+
+#endif
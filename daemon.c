@@ -0,0 +1,308 @@
+#define _GNU_SOURCE
+#include <glib.h>
+#include <glib-unix.h>
+#include <agent.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "daemon.h"
+#include "nice.h"
+#include "session.h"
+#include "global.h"
+
+// Daemon mode: keeps pool_size agents that gathered their candidates
+// already and waits for requests on a Unix socket, one line each:
+//
+//   connect <hostname> <is_caller> <port>   -> ok <session> | error <reason>
+//   status                                  -> pool <ready>/<size> sessions <n>
+//
+// A connect request starts the session in this process with one of the
+// agents, like the sessions of -N, and the daemon gathers a replacement in
+// the background. Agents that wait too long gather again, their server
+// reflexive and relay candidates would be stale by the time they are used.
+// The STUN server is resolved and the certificate created once for all
+// sessions.
+
+typedef struct {
+  NiceAgent *agent;
+  guint stream_id;
+  gboolean gathered;
+  gint64 gathered_at;
+} PooledAgent;
+
+typedef struct {
+  gint fd;
+  GString *request;
+} ControlClient;
+
+static GQueue pool = G_QUEUE_INIT;
+static guint pool_target = DAEMON_DEFAULT_POOL_SIZE;
+static guint sessions_started = 0;
+static DaemonSessionFunc session_func = NULL;
+static gint listen_fd = -1;
+static gchar *listen_path = NULL;
+
+static void
+pool_gathering_done(NiceAgent *agent, guint stream_id, gpointer pooled_ptr) {
+  PooledAgent *pooled = pooled_ptr;
+
+  pooled->gathered = TRUE;
+  pooled->gathered_at = g_get_monotonic_time();
+  g_debug("daemon: agent %p gathered its candidates\n", agent);
+}
+
+static void
+pool_fill() {
+  while(g_queue_get_length(&pool) < pool_target) {
+    PooledAgent *pooled = g_new0(PooledAgent, 1);
+
+    pooled->agent = setup_libnice(&pooled->stream_id);
+    g_signal_connect(G_OBJECT(pooled->agent), "candidate-gathering-done",
+      G_CALLBACK(pool_gathering_done), pooled);
+    if(!nice_agent_gather_candidates(pooled->agent, pooled->stream_id)) {
+      g_critical("Failed to start candidate gathering\n");
+      exit(1);
+    }
+    g_queue_push_tail(&pool, pooled);
+  }
+}
+
+// the oldest agent that is done, otherwise the oldest one
+static PooledAgent*
+pool_take() {
+  GList *item;
+
+  for(item = pool.head; item; item = item->next) {
+    PooledAgent *pooled = item->data;
+
+    if(pooled->gathered) {
+      g_queue_delete_link(&pool, item);
+      return pooled;
+    }
+  }
+
+  return g_queue_pop_head(&pool);
+}
+
+static void
+pool_free(PooledAgent *pooled) {
+  g_signal_handlers_disconnect_by_func(pooled->agent, pool_gathering_done, pooled);
+  g_object_unref(pooled->agent);
+  g_free(pooled);
+}
+
+// NAT bindings and relay allocations of an idle agent expire
+static gboolean
+pool_refresh(gpointer data) {
+  gint64 now = g_get_monotonic_time();
+  GList *item = pool.head;
+
+  while(item != NULL) {
+    PooledAgent *pooled = item->data;
+    GList *next = item->next;
+
+    if(pooled->gathered && now - pooled->gathered_at > DAEMON_MAX_AGE_S * G_USEC_PER_SEC) {
+      g_debug("daemon: agent %p is stale, gathering again\n", pooled->agent);
+      g_queue_delete_link(&pool, item);
+      pool_free(pooled);
+    }
+    item = next;
+  }
+  pool_fill();
+
+  return TRUE;
+}
+
+static void
+control_reply(ControlClient *client, const gchar *format, ...) {
+  va_list args;
+  gchar *reply;
+
+  va_start(args, format);
+  reply = g_strdup_vprintf(format, args);
+  va_end(args);
+
+  if(send(client->fd, reply, strlen(reply), MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+    g_debug("daemon: cannot reply: errno=%i\n", errno);
+  g_free(reply);
+}
+
+static void
+control_connect(ControlClient *client, gchar **args) {
+  PooledAgent *pooled;
+
+  if(g_strv_length(args) != 4) {
+    control_reply(client, "error usage: connect <hostname> <is_caller> <port>\n");
+    return;
+  }
+
+  pooled = pool_take();
+  if(pooled == NULL) {
+    control_reply(client, "error no agent available\n");
+    return;
+  }
+
+  // the session owns the agent now
+  g_signal_handlers_disconnect_by_func(pooled->agent, pool_gathering_done, pooled);
+  session_func(pooled->agent, pooled->stream_id, args[1], atoi(args[2]),
+    atoi(args[3]), pooled->gathered);
+  g_free(pooled);
+
+  sessions_started++;
+  g_message("Session %u: connecting to %s.\n", sessions_started, args[1]);
+  control_reply(client, "ok %u\n", sessions_started);
+  pool_fill();
+}
+
+static void
+control_handle(ControlClient *client, gchar *line) {
+  gchar **args = g_strsplit_set(g_strstrip(line), " \t", 0);
+
+  if(args[0] != NULL && strcmp(args[0], "connect") == 0)
+    control_connect(client, args);
+  else if(args[0] != NULL && strcmp(args[0], "status") == 0) {
+    GList *item;
+    guint ready = 0;
+
+    for(item = pool.head; item; item = item->next)
+      ready += ((PooledAgent*) item->data)->gathered;
+    control_reply(client, "pool %u/%u sessions %u\n", ready, pool_target, session_count());
+  }
+  else
+    control_reply(client, "error unknown command\n");
+
+  g_strfreev(args);
+}
+
+static gboolean
+control_read(gint fd, GIOCondition cond, gpointer client_ptr) {
+  ControlClient *client = client_ptr;
+  gchar buf[256];
+  gchar *newline;
+  gssize len;
+
+  len = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+  if(len < 0 && (errno == EAGAIN || errno == EINTR))
+    return TRUE;
+  if(len > 0)
+    g_string_append_len(client->request, buf, len);
+
+  newline = memchr(client->request->str, '\n', client->request->len);
+  if(newline == NULL && len > 0 && client->request->len < DAEMON_MAX_REQUEST)
+    return TRUE;
+
+  if(newline != NULL) {
+    *newline = '\0';
+    control_handle(client, client->request->str);
+  }
+
+  close(client->fd);
+  g_string_free(client->request, TRUE);
+  g_free(client);
+
+  return FALSE;
+}
+
+static gboolean
+control_accept(gint fd, GIOCondition cond, gpointer data) {
+  ControlClient *client;
+  gint client_fd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+  if(client_fd < 0)
+    return TRUE;
+
+  client = g_new0(ControlClient, 1);
+  client->fd = client_fd;
+  client->request = g_string_new(NULL);
+  g_unix_fd_add(client_fd, G_IO_IN | G_IO_HUP, control_read, client);
+
+  return TRUE;
+}
+
+static void
+daemon_listen(const gchar *path) {
+  struct sockaddr_un addr;
+
+  if(strlen(path) >= sizeof(addr.sun_path)) {
+    g_critical("Control socket path too long: %s", path);
+    exit(1);
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  unlink(path);
+
+  listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if(listen_fd < 0 || bind(listen_fd, (struct sockaddr*) &addr, sizeof(addr)) < 0
+      || listen(listen_fd, 16) < 0) {
+    g_critical("Cannot listen at %s: %s", path, g_strerror(errno));
+    exit(1);
+  }
+
+  listen_path = g_strdup(path);
+  g_unix_fd_add(listen_fd, G_IO_IN, control_accept, NULL);
+}
+
+// like nicepipe does for every session
+static void
+daemon_create_certificate() {
+  gchar *path, *cmd;
+  gint fd, status;
+  GError *error = NULL;
+
+  if(g_getenv("NICE_LOCAL_CRT") != NULL)
+    return;
+
+  fd = g_file_open_tmp(".nice-XXXXXX.lc", &path, &error);
+  if(fd < 0) {
+    g_critical("Error creating the certificate file: %s", error->message);
+    exit(1);
+  }
+  close(fd);
+
+  cmd = g_strdup_printf("openssl req -new -key %s/.ssh/id_rsa -x509 -days 365 -out %s -subj /",
+    g_get_home_dir(), path);
+  if(!g_spawn_command_line_sync(cmd, NULL, NULL, &status, &error) || status != 0) {
+    g_critical("Error creating a certificate with '%s'", cmd);
+    exit(1);
+  }
+  g_setenv("NICE_LOCAL_CRT", path, TRUE);
+
+  g_free(cmd);
+  g_free(path);
+}
+
+static gboolean
+daemon_terminate(gpointer data) {
+  unlink(listen_path);
+  g_main_loop_quit(gloop);
+
+  return FALSE;
+}
+
+void
+daemon_init(const gchar *socket_path, guint pool_size, DaemonSessionFunc start_session) {
+  session_func = start_session;
+  pool_target = pool_size;
+
+  // the daemon outlives its sessions
+  session_keep_loop(TRUE);
+
+  daemon_create_certificate();
+  daemon_listen(socket_path);
+  g_unix_signal_add(SIGTERM, daemon_terminate, NULL);
+  g_unix_signal_add(SIGINT, daemon_terminate, NULL);
+
+  pool_fill();
+  g_timeout_add_seconds(DAEMON_REFRESH_S, pool_refresh, NULL);
+  g_message("Waiting for requests at %s.\n", socket_path);
+}
@@ -0,0 +1,20 @@
+#ifndef __DAEMON_H__
+#define __DAEMON_H__
+
+#include <glib.h>
+#include <agent.h>
+
+#define DAEMON_DEFAULT_POOL_SIZE 2
+#define DAEMON_MAX_REQUEST 1024
+// a warm agent gathers again after this long
+#define DAEMON_MAX_AGE_S 120
+#define DAEMON_REFRESH_S 15
+
+// starts a session with a warm agent; gathered tells if the agent's
+// candidates are complete already
+typedef void (*DaemonSessionFunc)(NiceAgent *agent, guint stream_id, const gchar *remote_hostname,
+  gint is_caller, guint port, gboolean gathered);
+
+void daemon_init(const gchar *socket_path, guint pool_size, DaemonSessionFunc start_session);
+
+#endif
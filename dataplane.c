@@ -0,0 +1,313 @@
+#include <glib.h>
+#include <glib-unix.h>
+#include <agent.h>
+
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+
+#include "dataplane.h"
+#include "ring.h"
+#include "callbacks.h"
+#include "sendq.h"
+#include "metrics.h"
+#include "global.h"
+
+// Threaded data plane (-x): the main loop keeps the agent (pseudo TCP,
+// STUN, the exchange), a reader thread moves what the local fd delivers
+// into tx and a writer thread writes what arrives through rx to the local
+// fd. Only the main loop touches the agent; the threads never block it.
+//
+//   local fd -> reader -> tx -> main loop -> send_to_peer()
+//   agent -> recv_data2fd() -> rx -> writer -> local fd
+//
+// A read of the local fd fills one slot, an empty slot (len 0) tells the
+// main loop that the local side is done.
+
+struct _Dataplane {
+  Ring *tx, *rx;
+  GThread *reader, *writer;
+  gint in_fd, out_fd;
+  gint stop_fd;
+  gboolean tx_parked;
+  guint tx_watch_id, rx_watch_id;
+
+  // received after the ring filled up, until the paused agent stops
+  // delivering; written into rx before anything else
+  GByteArray *overflow;
+};
+
+// FALSE once the data plane stops and fd is not ready
+static gboolean
+dataplane_wait(Dataplane *dataplane, gint fd, gshort events) {
+  struct pollfd fds[2] = { { fd, events, 0 }, { dataplane->stop_fd, POLLIN, 0 } };
+
+  while(poll(fds, 2, -1) < 0)
+    if(errno != EINTR)
+      return FALSE;
+
+  return fds[0].revents != 0 || !(fds[1].revents & POLLIN);
+}
+
+static gpointer
+dataplane_reader(gpointer data) {
+  Dataplane *dataplane = data;
+  Ring *tx = dataplane->tx;
+
+  for(;;) {
+    RingSlot *slot = ring_reserve(tx);
+    gssize len;
+
+    if(slot == NULL) {
+      // the agent is behind, wait until the main loop took some
+      if(ring_arm_writable(tx, 1) && !dataplane_wait(dataplane, tx->writable_fd, POLLIN))
+        break;
+      ring_clear(tx->writable_fd);
+      continue;
+    }
+
+    if(!dataplane_wait(dataplane, dataplane->in_fd, POLLIN))
+      break;
+
+    len = read(dataplane->in_fd, slot->data, RING_SLOT_SIZE);
+    if(len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+      continue;
+    if(len < 0)
+      g_critical("Error reading from fd %i: errno=%i\n", dataplane->in_fd, errno);
+
+    slot->len = MAX(len, 0);
+    ring_push(tx);
+    if(len <= 0)
+      break;
+  }
+
+  return NULL;
+}
+
+static gpointer
+dataplane_writer(gpointer data) {
+  Dataplane *dataplane = data;
+  Ring *rx = dataplane->rx;
+
+  for(;;) {
+    RingSlot *slot = ring_peek(rx);
+    gsize offset = 0;
+
+    if(slot == NULL) {
+      if(ring_arm_readable(rx) && !dataplane_wait(dataplane, rx->readable_fd, POLLIN))
+        break;
+      ring_clear(rx->readable_fd);
+      continue;
+    }
+
+    while(offset < slot->len) {
+      gssize res = write(dataplane->out_fd, slot->data + offset, slot->len - offset);
+
+      if(res >= 0)
+        offset += res;
+      else if(errno == EAGAIN || errno == EWOULDBLOCK) {
+        if(!dataplane_wait(dataplane, dataplane->out_fd, POLLOUT))
+          return NULL;
+      }
+      else if(errno != EINTR) {
+        g_critical("Error writing to fd %i: errno=%i, dropping %zu bytes\n",
+          dataplane->out_fd, errno, slot->len - offset);
+        break;
+      }
+    }
+    ring_pop(rx);
+  }
+
+  return NULL;
+}
+
+static void dataplane_send(NiceSession *session);
+
+static gboolean
+dataplane_drained(gpointer session_ptr) {
+  NiceSession *session = session_ptr;
+
+  g_debug("send queue drained, sending from the ring again\n");
+  session->dataplane->tx_parked = FALSE;
+  dataplane_send(session);
+
+  return FALSE;
+}
+
+static void
+dataplane_send(NiceSession *session) {
+  Dataplane *dataplane = session->dataplane;
+  Ring *tx = dataplane->tx;
+  RingSlot *slot;
+
+  do {
+    while((slot = ring_peek(tx)) != NULL) {
+      if(slot->len == 0) {
+        session_end(session);
+        return;
+      }
+
+      send_to_peer(session, slot->len, slot->data);
+      ring_pop(tx);
+
+      if(sendq_full(session)) {
+        // the reader fills the ring meanwhile and then waits
+        dataplane->tx_parked = TRUE;
+        sendq_on_drain(session, dataplane_drained, session);
+        return;
+      }
+    }
+  }
+  while(!ring_arm_readable(tx));
+}
+
+static gboolean
+dataplane_tx_ready(gint fd, GIOCondition cond, gpointer session_ptr) {
+  NiceSession *session = session_ptr;
+
+  ring_clear(fd);
+  if(!session->dataplane->tx_parked)
+    dataplane_send(session_ptr);
+
+  return TRUE;
+}
+
+// as much of buf as there are free slots for, returns the bytes taken
+static gsize
+dataplane_fill(Ring *rx, const guint8 *buf, gsize len) {
+  gsize offset = 0;
+  RingSlot *slot;
+
+  while(offset < len && (slot = ring_reserve(rx)) != NULL) {
+    guint chunk = MIN(len - offset, RING_SLOT_SIZE);
+
+    memcpy(slot->data, buf + offset, chunk);
+    slot->len = chunk;
+    ring_push(rx);
+    offset += chunk;
+  }
+
+  return offset;
+}
+
+// receiving stays paused until the writer made room again
+static void
+dataplane_wait_writer(Ring *rx) {
+  if(!ring_arm_writable(rx, DATAPLANE_RESUME_SLOTS))
+    ring_signal(rx->writable_fd);
+}
+
+static gboolean
+dataplane_rx_ready(gint fd, GIOCondition cond, gpointer session_ptr) {
+  NiceSession *session = session_ptr;
+  Dataplane *dataplane = session->dataplane;
+  GByteArray *overflow = dataplane->overflow;
+
+  ring_clear(fd);
+  if(overflow->len > 0) {
+    g_byte_array_remove_range(overflow, 0, dataplane_fill(dataplane->rx, overflow->data, overflow->len));
+    if(overflow->len > 0 || ring_free_slots(dataplane->rx) < DATAPLANE_PAUSE_SLOTS) {
+      dataplane_wait_writer(dataplane->rx);
+      return TRUE;
+    }
+  }
+  resume_receiving(session);
+
+  return TRUE;
+}
+
+// the rings exist before the local fd, data may arrive first
+void
+dataplane_init(NiceSession *session) {
+  Dataplane *dataplane = g_new0(Dataplane, 1);
+
+  dataplane->tx = ring_new();
+  dataplane->rx = ring_new();
+  dataplane->in_fd = -1;
+  dataplane->out_fd = -1;
+  dataplane->stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  dataplane->overflow = g_byte_array_new();
+
+  ring_arm_readable(dataplane->tx);
+  dataplane->tx_watch_id = g_unix_fd_add(dataplane->tx->readable_fd, G_IO_IN, dataplane_tx_ready, session);
+  dataplane->rx_watch_id = g_unix_fd_add(dataplane->rx->writable_fd, G_IO_IN, dataplane_rx_ready, session);
+  session->dataplane = dataplane;
+}
+
+void
+dataplane_start(NiceSession *session, gint in, gint out) {
+  Dataplane *dataplane = session->dataplane;
+
+  dataplane->in_fd = in;
+  dataplane->out_fd = out;
+
+  g_debug("dataplane: reading fd %i and writing fd %i in threads\n", in, out);
+  dataplane->reader = g_thread_new("nice-reader", dataplane_reader, dataplane);
+  dataplane->writer = g_thread_new("nice-writer", dataplane_writer, dataplane);
+}
+
+void
+dataplane_recv(NiceSession *session, guint len, const gchar *buf) {
+  Dataplane *dataplane = session->dataplane;
+  Ring *rx = dataplane->rx;
+  GByteArray *overflow = dataplane->overflow;
+  gsize taken = 0;
+
+  // datagrams are dropped like with a full output queue
+  if(not_reliable && ring_free_slots(rx) < (len + RING_SLOT_SIZE - 1) / RING_SLOT_SIZE) {
+    g_debug("dataplane: ring full, dropping %u bytes\n", len);
+    metrics.dropped++;
+    return;
+  }
+
+  metrics.received_bytes += len;
+  metrics.received_messages++;
+
+  // the stream stays in order: nothing passes what waits already. Before
+  // the writer starts the ring fills up and the rest waits here as well.
+  if(overflow->len == 0)
+    taken = dataplane_fill(rx, (const guint8*) buf, len);
+  if(taken < len) {
+    g_debug("dataplane: ring full, keeping %zu bytes\n", len - taken);
+    g_byte_array_append(overflow, (const guint8*) buf + taken, len - taken);
+  }
+
+  if(overflow->len > 0 || ring_free_slots(rx) < DATAPLANE_PAUSE_SLOTS) {
+    pause_receiving(session);
+    dataplane_wait_writer(rx);
+  }
+}
+
+// the writer writes out what is left in rx first
+void
+dataplane_free(NiceSession *session) {
+  Dataplane *dataplane = session->dataplane;
+
+  if(dataplane == NULL)
+    return;
+
+  // without waiting: other sessions share the main loop
+  g_byte_array_remove_range(dataplane->overflow, 0,
+    dataplane_fill(dataplane->rx, dataplane->overflow->data, dataplane->overflow->len));
+  if(dataplane->overflow->len > 0) {
+    g_debug("dataplane: output blocked, dropping %u bytes\n", dataplane->overflow->len);
+    metrics.dropped++;
+  }
+
+  ring_signal(dataplane->stop_fd);
+  if(dataplane->writer != NULL)
+    g_thread_join(dataplane->writer);
+  if(dataplane->reader != NULL)
+    g_thread_join(dataplane->reader);
+
+  g_source_remove(dataplane->tx_watch_id);
+  g_source_remove(dataplane->rx_watch_id);
+  ring_free(dataplane->tx);
+  ring_free(dataplane->rx);
+  g_byte_array_unref(dataplane->overflow);
+  close(dataplane->stop_fd);
+  g_free(dataplane);
+  session->dataplane = NULL;
+}
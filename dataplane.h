@@ -0,0 +1,20 @@
+#ifndef __DATAPLANE_H__
+#define __DATAPLANE_H__
+
+#include <glib.h>
+
+#include "session.h"
+#include "ring.h"
+
+// a receive callback brings up to 64 KB, pause the agent before the ring
+// cannot take that any more ...
+#define DATAPLANE_PAUSE_SLOTS 8
+// ... and resume once the writer freed this many slots
+#define DATAPLANE_RESUME_SLOTS (RING_SLOTS / 4)
+
+void dataplane_init(NiceSession *session);
+void dataplane_start(NiceSession *session, gint in_fd, gint out_fd);
+void dataplane_recv(NiceSession *session, guint len, const gchar *buf);
+void dataplane_free(NiceSession *session);
+
+#endif
@@ -0,0 +1,391 @@
+#include <glib.h>
+#include <gmodule.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "exchange.h"
+#include "knownhosts.h"
+#include "util.h"
+#include "timing.h"
+#include "global.h"
+
+typedef struct {
+  ExchangeSession *exchange;
+  ExchangeDataFunc func;
+  gpointer user_data;
+} ExchangeRequest;
+
+struct _ExchangeSession {
+  ExchangeContext ctx; // first, providers only get this part
+  gboolean published;
+  gboolean unpublished;         // connected, nothing more to publish
+  gboolean publishing_complete; // the data being published has all candidates
+  gchar *remote_crt;            // the certificate the peer published
+  GHashTable *watches;          // watch id -> ExchangeRequest
+  ExchangeFailFunc fail;
+  gpointer fail_data;
+};
+
+static ExchangeProvider *provider = NULL;
+static gchar *default_options = NULL;
+static gchar *script_name = NULL; // set if niceexchange.sh is used instead of a plugin
+
+/*
+ * compatibility provider: runs the exchange_providers/ shell scripts through
+ * niceexchange.sh, which also appends and checks the certificates
+ */
+
+// how long each niceexchange.sh step may take
+#define SCRIPT_PUBLISH_TIMEOUT_MS 30000
+#define SCRIPT_LOOKUP_TIMEOUT_MS 600000
+
+typedef struct {
+  ExchangeSession *exchange;
+  const gchar *mode;
+  ExchangeDataFunc func;
+  gpointer user_data;
+  GDestroyNotify free_data;  // user_data if func is not called
+} ScriptStep;
+
+static void exchange_fail(ExchangeSession *exchange);
+
+static void
+script_done(gint status, GString *out, GString *err, gpointer step_ptr) {
+  ScriptStep *step = step_ptr;
+
+  if(status != 0) {
+    g_critical("niceexchange %s returned a non-zero return value (%i)!", step->mode, status);
+    if(err->len > 0)
+      g_critical("This was written to stderr:\n%s", err->str);
+
+    // stale data left behind does not keep the connection from working
+    if(strcmp(step->mode, "unpublish") != 0)
+      exchange_fail(step->exchange);
+    if(step->free_data != NULL)
+      step->free_data(step->user_data);
+    g_free(step);
+    return;
+  }
+
+  if(step->func != NULL)
+    step->func(out->str, out->len, step->user_data);
+  g_free(step);
+}
+
+static void
+script_run(const ExchangeContext *ctx, const gchar *mode, const gchar *stdin, guint timeout_ms,
+    ExchangeDataFunc func, gpointer user_data, GDestroyNotify free_data) {
+  ScriptStep *step = g_new(ScriptStep, 1);
+  gchar *cmd;
+
+  // the context comes first in ExchangeSession
+  step->exchange = (ExchangeSession*) ctx;
+  step->mode = mode;
+  step->func = func;
+  step->user_data = user_data;
+  step->free_data = free_data;
+
+  cmd = g_strdup_printf("./niceexchange.sh %i %s %s %s%s%s", ctx->is_caller,
+    ctx->remote_hostname, mode, ctx->options, *ctx->options ? "@" : "", script_name);
+  execute_async(cmd, ctx->remote_hostname, stdin, timeout_ms, script_done, step);
+  g_free(cmd);
+}
+
+static void exchange_published(gboolean complete);
+
+static void
+script_published(const gchar *data, gsize len, gpointer complete) {
+  exchange_published(GPOINTER_TO_INT(complete));
+}
+
+// failures of publish and unpublish are reported when the script finished
+static gboolean
+script_publish(const ExchangeContext *ctx, const gchar *data, gsize len, GError **error) {
+  const ExchangeSession *exchange = (const ExchangeSession*) ctx;
+
+  script_run(ctx, "publish", data, SCRIPT_PUBLISH_TIMEOUT_MS, script_published,
+    GINT_TO_POINTER(exchange->publishing_complete), NULL);
+  return TRUE;
+}
+
+static gboolean
+script_unpublish(const ExchangeContext *ctx, GError **error) {
+  script_run(ctx, "unpublish", NULL, SCRIPT_PUBLISH_TIMEOUT_MS, NULL, NULL, NULL);
+  return TRUE;
+}
+
+static void
+script_lookup(const ExchangeContext *ctx, ExchangeDataFunc func, gpointer user_data) {
+  script_run(ctx, "lookup", NULL, SCRIPT_LOOKUP_TIMEOUT_MS, func, user_data, g_free);
+}
+
+static ExchangeProvider script_provider = {
+  EXCHANGE_API_VERSION, "script",
+  script_publish, script_unpublish, script_lookup, NULL, NULL
+};
+
+void
+exchange_init(const gchar *spec) {
+  const gchar *at = strrchr(spec, '@');
+  gchar *name, *path;
+  GModule *module;
+
+  // "options@provider" like niceexchange.sh
+  name = g_strdup(at ? at + 1 : spec);
+  default_options = at ? g_strndup(spec, at - spec) : g_strdup("");
+
+  path = g_strdup_printf("./exchange_providers/%s.so", name);
+  if(!g_file_test(path, G_FILE_TEST_EXISTS)) {
+    g_debug("exchange: no plugin %s, using niceexchange.sh\n", path);
+    provider = &script_provider;
+    script_name = g_strdup(name);
+  }
+  else {
+    module = g_module_open(path, G_MODULE_BIND_LOCAL);
+    if(module == NULL ||
+        !g_module_symbol(module, EXCHANGE_PROVIDER_SYMBOL, (gpointer*) &provider)) {
+      g_critical("Error loading exchange provider '%s': %s", path, g_module_error());
+      exit(1);
+    }
+    if(provider->api_version != EXCHANGE_API_VERSION) {
+      g_critical("Exchange provider '%s' has API version %u, expected %u!",
+        path, provider->api_version, EXCHANGE_API_VERSION);
+      exit(1);
+    }
+    g_module_make_resident(module);
+    g_debug("exchange: loaded plugin %s\n", provider->name);
+  }
+
+  g_free(path);
+  g_free(name);
+}
+
+// options: NULL for the ones given to exchange_init()
+ExchangeSession*
+exchange_session_new(gint is_caller, const gchar *remote_hostname, const gchar *options,
+    ExchangeFailFunc fail, gpointer user_data) {
+  ExchangeSession *exchange = g_new0(ExchangeSession, 1);
+
+  exchange->ctx.is_caller = is_caller;
+  exchange->ctx.remote_hostname = remote_hostname;
+  exchange->ctx.options = g_strdup(options != NULL ? options : default_options);
+  exchange->ctx.context = g_main_loop_get_context(gloop);
+  exchange->watches = g_hash_table_new_full(NULL, NULL, NULL, g_free);
+  exchange->fail = fail;
+  exchange->fail_data = user_data;
+
+  return exchange;
+}
+
+void
+exchange_session_free(ExchangeSession *exchange) {
+  GHashTableIter iter;
+  gpointer id;
+
+  g_hash_table_iter_init(&iter, exchange->watches);
+  while(g_hash_table_iter_next(&iter, &id, NULL))
+    if(provider->unwatch != NULL)
+      provider->unwatch(GPOINTER_TO_UINT(id));
+  g_hash_table_destroy(exchange->watches);
+
+  if(exchange->remote_crt != NULL) {
+    unlink(exchange->remote_crt);
+    g_free(exchange->remote_crt);
+  }
+  g_free((gchar*) exchange->ctx.options);
+  g_free(exchange);
+}
+
+// the caller returns right away, the session is ending
+static void
+exchange_fail(ExchangeSession *exchange) {
+  exchange->fail(exchange->fail_data);
+}
+
+static void
+exchange_published(gboolean complete) {
+  timing_mark(TIMING_FIRST_PUBLISH);
+  if(complete)
+    timing_mark(TIMING_PUBLISH_DONE);
+}
+
+void
+exchange_publish(ExchangeSession *exchange, const gchar *credentials, gboolean complete) {
+  const gchar *local_crt = g_getenv("NICE_LOCAL_CRT");
+  GString *data;
+  GError *error = NULL;
+
+  // e.g. late relay candidates
+  if(exchange->unpublished)
+    return;
+
+  data = g_string_new(credentials);
+
+  // the script appends the certificate itself
+  if(provider != &script_provider && local_crt != NULL) {
+    gchar *cert;
+    gsize len;
+
+    if(!g_file_get_contents(local_crt, &cert, &len, &error)) {
+      g_critical("Error reading local certificate: %s", error->message);
+      g_error_free(error);
+      g_string_free(data, TRUE);
+      exchange_fail(exchange);
+      return;
+    }
+    g_string_append_len(data, cert, len);
+    g_free(cert);
+  }
+
+  exchange->publishing_complete = complete;
+  if(!provider->publish(&exchange->ctx, data->str, data->len, &error)) {
+    g_critical("Error publishing local credentials: %s", error ? error->message : "failed");
+    g_clear_error(&error);
+    g_string_free(data, TRUE);
+    exchange_fail(exchange);
+    return;
+  }
+  exchange->published = TRUE;
+
+  // the script reports when it is done
+  if(provider != &script_provider)
+    exchange_published(complete);
+
+  g_string_free(data, TRUE);
+}
+
+void
+exchange_unpublish(ExchangeSession *exchange) {
+  GError *error = NULL;
+
+  // called for every received packet, only the first call has to do anything
+  if(!exchange->published)
+    return;
+  exchange->published = FALSE;
+  exchange->unpublished = TRUE;
+
+  // the connection is up, stale data left behind is only logged
+  if(!provider->unpublish(&exchange->ctx, &error)) {
+    g_critical("Error unpublishing local credentials: %s", error ? error->message : "failed");
+    g_clear_error(&error);
+  }
+}
+
+// publish again after an ICE restart
+void
+exchange_restart(ExchangeSession *exchange) {
+  exchange->unpublished = FALSE;
+}
+
+// every session keeps its own copy, peers of one niceport differ; FALSE if
+// the certificate is not the known one or cannot be saved
+static gboolean
+exchange_save_certificate(ExchangeSession *exchange, const gchar *cert, gsize len) {
+  GError *error = NULL;
+
+  if(!known_hosts_check_certificate(exchange->ctx.remote_hostname, cert, len))
+    return FALSE;
+
+  if(exchange->remote_crt == NULL) {
+    gint fd = g_file_open_tmp(".nice-XXXXXX.rc", &exchange->remote_crt, &error);
+
+    if(fd >= 0)
+      close(fd);
+  }
+
+  if(error != NULL || !g_file_set_contents(exchange->remote_crt, cert, len, &error)) {
+    g_critical("Error saving remote certificate: %s", error->message);
+    g_error_free(error);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+// the one received from the peer, or $NICE_REMOTE_CRT for the script provider
+const gchar*
+exchange_remote_certificate(ExchangeSession *exchange) {
+  if(exchange->remote_crt != NULL)
+    return exchange->remote_crt;
+  return g_getenv("NICE_REMOTE_CRT");
+}
+
+// splits the remote data into the credentials line and the certificate
+static void
+exchange_received(const gchar *data, gsize len, gpointer request_ptr) {
+  ExchangeRequest *request = request_ptr;
+  const gchar *newline = memchr(data, '\n', len);
+  gsize line_len = newline ? newline - data + 1 : len;
+
+  // like niceexchange.sh, a peer that cannot be verified is not accepted
+  if(provider != &script_provider) {
+    if(line_len == len) {
+      g_critical("The remote peer did not publish a certificate, %s cannot be verified!",
+        request->exchange->ctx.remote_hostname);
+      exchange_fail(request->exchange);
+      return;
+    }
+    if(!exchange_save_certificate(request->exchange, data + line_len, len - line_len)) {
+      exchange_fail(request->exchange);
+      return;
+    }
+  }
+
+  request->func(data, line_len, request->user_data);
+}
+
+static void
+exchange_lookup_done(const gchar *data, gsize len, gpointer request_ptr) {
+  exchange_received(data, len, request_ptr);
+  g_free(request_ptr);
+}
+
+void
+exchange_lookup(ExchangeSession *exchange, ExchangeDataFunc func, gpointer user_data) {
+  ExchangeRequest *request = g_new(ExchangeRequest, 1);
+
+  request->exchange = exchange;
+  request->func = func;
+  request->user_data = user_data;
+  provider->lookup(&exchange->ctx, exchange_lookup_done, request);
+}
+
+// trickling only helps if the peer is told about updates
+gboolean
+exchange_supports_trickle() {
+  return provider->watch != NULL;
+}
+
+guint
+exchange_watch(ExchangeSession *exchange, ExchangeDataFunc func, gpointer user_data) {
+  ExchangeRequest *request;
+  guint id;
+
+  if(provider->watch == NULL)
+    return 0;
+
+  request = g_new(ExchangeRequest, 1);
+  request->exchange = exchange;
+  request->func = func;
+  request->user_data = user_data;
+
+  id = provider->watch(&exchange->ctx, exchange_received, request);
+  if(id == 0)
+    g_free(request);
+  else
+    g_hash_table_insert(exchange->watches, GUINT_TO_POINTER(id), request);
+
+  return id;
+}
+
+void
+exchange_unwatch(ExchangeSession *exchange, guint id) {
+  if(id == 0)
+    return;
+
+  if(provider->unwatch != NULL)
+    provider->unwatch(id);
+  g_hash_table_remove(exchange->watches, GUINT_TO_POINTER(id));
+}
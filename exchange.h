@@ -0,0 +1,61 @@
+#ifndef __EXCHANGE_H__
+#define __EXCHANGE_H__
+
+#include <glib.h>
+
+// Exchange providers are shared objects in exchange_providers/ exporting an
+// ExchangeProvider named EXCHANGE_PROVIDER_SYMBOL. All functions are called
+// from the agent's main loop and must not block; lookups and watches report
+// the remote data from sources attached to ctx->context.
+//
+// The published data is the credentials line followed by the local
+// certificate (PEM). Lookups return the remote peer's data in the same form.
+
+#define EXCHANGE_API_VERSION 1
+#define EXCHANGE_PROVIDER_SYMBOL "exchange_provider"
+
+typedef struct {
+  gint is_caller;
+  const gchar *remote_hostname;
+  const gchar *options;      // the part before '@' in "options@provider"
+  GMainContext *context;
+} ExchangeContext;
+
+typedef void (*ExchangeDataFunc)(const gchar *data, gsize len, gpointer user_data);
+
+typedef struct {
+  guint api_version;
+  const gchar *name;
+
+  gboolean (*publish)(const ExchangeContext *ctx, const gchar *data, gsize len, GError **error);
+  gboolean (*unpublish)(const ExchangeContext *ctx, GError **error);
+
+  // calls func once as soon as the remote data is available
+  void (*lookup)(const ExchangeContext *ctx, ExchangeDataFunc func, gpointer user_data);
+
+  // calls func whenever the remote data changes, until unwatch(id)
+  guint (*watch)(const ExchangeContext *ctx, ExchangeDataFunc func, gpointer user_data);
+  void (*unwatch)(guint id);
+} ExchangeProvider;
+
+// what is published to and looked up from one peer
+typedef struct _ExchangeSession ExchangeSession;
+
+// publishing failed, or the peer's data cannot be used: its session has to
+// end, the process goes on with the others
+typedef void (*ExchangeFailFunc)(gpointer user_data);
+
+void exchange_init(const gchar *spec);
+ExchangeSession* exchange_session_new(gint is_caller, const gchar *remote_hostname, const gchar *options,
+  ExchangeFailFunc fail, gpointer user_data);
+void exchange_session_free(ExchangeSession *exchange);
+void exchange_publish(ExchangeSession *exchange, const gchar *credentials, gboolean complete);
+void exchange_unpublish(ExchangeSession *exchange);
+void exchange_restart(ExchangeSession *exchange);
+void exchange_lookup(ExchangeSession *exchange, ExchangeDataFunc func, gpointer user_data);
+gboolean exchange_supports_trickle();
+guint exchange_watch(ExchangeSession *exchange, ExchangeDataFunc func, gpointer user_data);
+void exchange_unwatch(ExchangeSession *exchange, guint id);
+const gchar* exchange_remote_certificate(ExchangeSession *exchange);
+
+#endif
@@ -0,0 +1,205 @@
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <glib-unix.h>
+#include <gmodule.h>
+
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/inotify.h>
+
+#include "../exchange.h"
+
+// Reference exchange provider: shares the credentials through a file in
+// the directory given as options (e.g. -e /tmp/peer1@dummy), otherwise
+// $NICE_EXCHANGE_DIR (default: $HOME/Dropbox/), the same way the dummy
+// shell script does.
+
+// only used if the directory cannot be watched with inotify
+#define DUMMY_POLL_INTERVAL_MS 1000
+
+typedef struct {
+  gchar *filename;
+  gchar *basename;
+  ExchangeDataFunc func;
+  gpointer user_data;
+  gboolean once;
+  gchar *last; // contents delivered last time, for watches
+  gint inotify_fd;
+} DummyLookup;
+
+static GMainContext *watch_context = NULL;
+
+static gchar*
+dummy_dirname(const ExchangeContext *ctx) {
+  const gchar *dir = g_getenv("NICE_EXCHANGE_DIR");
+
+  if(ctx->options != NULL && *ctx->options != '\0')
+    return g_strdup(ctx->options);
+  if(dir != NULL)
+    return g_strdup(dir);
+  return g_build_filename(g_get_home_dir(), "Dropbox", NULL);
+}
+
+static gchar*
+dummy_filename(const ExchangeContext *ctx, gint is_caller) {
+  gchar *dirname = dummy_dirname(ctx);
+  gchar *name = g_strdup_printf(".nice%i.cre", is_caller);
+  gchar *filename = g_build_filename(dirname, name, NULL);
+
+  g_free(name);
+  g_free(dirname);
+  return filename;
+}
+
+// g_file_set_contents() writes a temporary file and renames it, so the
+// peer never sees a partially written file
+static gboolean
+dummy_publish(const ExchangeContext *ctx, const gchar *data, gsize len, GError **error) {
+  gchar *filename = dummy_filename(ctx, ctx->is_caller);
+  gboolean ok = g_file_set_contents(filename, data, len, error);
+
+  g_free(filename);
+  return ok;
+}
+
+static gboolean
+dummy_unpublish(const ExchangeContext *ctx, GError **error) {
+  gchar *filename = dummy_filename(ctx, ctx->is_caller);
+
+  g_unlink(filename);
+  g_free(filename);
+  return TRUE;
+}
+
+static void
+dummy_lookup_free(gpointer lookup_ptr) {
+  DummyLookup *lookup = lookup_ptr;
+
+  if(lookup->inotify_fd >= 0)
+    close(lookup->inotify_fd);
+  g_free(lookup->filename);
+  g_free(lookup->basename);
+  g_free(lookup->last);
+  g_free(lookup);
+}
+
+// returns FALSE once a lookup is done
+static gboolean
+dummy_check(DummyLookup *lookup) {
+  gchar *contents;
+  gsize len;
+
+  if(!g_file_get_contents(lookup->filename, &contents, &len, NULL))
+    return TRUE;
+
+  // whatever wrote it in place has not finished yet, wait for the next event
+  if(len == 0 || contents[len - 1] != '\n' ||
+      (lookup->last != NULL && strcmp(lookup->last, contents) == 0)) {
+    g_free(contents);
+    return TRUE;
+  }
+
+  lookup->func(contents, len, lookup->user_data);
+  g_free(lookup->last);
+  lookup->last = contents;
+
+  return !lookup->once;
+}
+
+static gboolean
+dummy_poll(gpointer lookup_ptr) {
+  return dummy_check(lookup_ptr);
+}
+
+static gboolean
+dummy_inotify(gint fd, GIOCondition cond, gpointer lookup_ptr) {
+  DummyLookup *lookup = lookup_ptr;
+  gchar buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  gboolean changed = (cond == 0); // first dispatch, see dummy_start()
+  gssize len;
+  gchar *ptr;
+
+  g_source_set_ready_time(g_main_current_source(), -1);
+
+  while((len = read(fd, buf, sizeof(buf))) > 0) {
+    for(ptr = buf; ptr < buf + len; ptr += sizeof(struct inotify_event) + ((struct inotify_event*) ptr)->len) {
+      struct inotify_event *event = (struct inotify_event*) ptr;
+
+      if(event->len > 0 && strcmp(event->name, lookup->basename) == 0)
+        changed = TRUE;
+    }
+  }
+
+  if(!changed)
+    return TRUE;
+
+  return dummy_check(lookup);
+}
+
+static guint
+dummy_start(const ExchangeContext *ctx, ExchangeDataFunc func, gpointer user_data, gboolean once) {
+  DummyLookup *lookup = g_new0(DummyLookup, 1);
+  gchar *dirname = dummy_dirname(ctx);
+  GSource *source;
+  guint id;
+
+  // the peer's file
+  lookup->filename = dummy_filename(ctx, !ctx->is_caller);
+  lookup->basename = g_path_get_basename(lookup->filename);
+  lookup->func = func;
+  lookup->user_data = user_data;
+  lookup->once = once;
+
+  // a file is complete when it was closed after writing or renamed into
+  // place, never when it was just created
+  lookup->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if(lookup->inotify_fd >= 0 &&
+      inotify_add_watch(lookup->inotify_fd, dirname, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+    g_message("dummy: cannot watch %s (%s), polling instead\n", dirname, g_strerror(errno));
+    close(lookup->inotify_fd);
+    lookup->inotify_fd = -1;
+  }
+  g_free(dirname);
+
+  if(lookup->inotify_fd >= 0) {
+    source = g_unix_fd_source_new(lookup->inotify_fd, G_IO_IN);
+    g_source_set_callback(source, (GSourceFunc) dummy_inotify, lookup, dummy_lookup_free);
+  }
+  else {
+    source = g_timeout_source_new(DUMMY_POLL_INTERVAL_MS);
+    g_source_set_callback(source, dummy_poll, lookup, dummy_lookup_free);
+  }
+
+  // the file may be there already: check right away, but from the main
+  // loop, so the caller never gets called back before this returns
+  g_source_set_ready_time(source, 0);
+  id = g_source_attach(source, ctx->context);
+  g_source_unref(source);
+
+  return id;
+}
+
+static void
+dummy_lookup(const ExchangeContext *ctx, ExchangeDataFunc func, gpointer user_data) {
+  dummy_start(ctx, func, user_data, TRUE);
+}
+
+static guint
+dummy_watch(const ExchangeContext *ctx, ExchangeDataFunc func, gpointer user_data) {
+  watch_context = ctx->context;
+  return dummy_start(ctx, func, user_data, FALSE);
+}
+
+static void
+dummy_unwatch(guint id) {
+  GSource *source = g_main_context_find_source_by_id(watch_context, id);
+
+  if(source != NULL)
+    g_source_destroy(source);
+}
+
+G_MODULE_EXPORT ExchangeProvider exchange_provider = {
+  EXCHANGE_API_VERSION, "dummy",
+  dummy_publish, dummy_unpublish, dummy_lookup, dummy_watch, dummy_unwatch
+};
@@ -0,0 +1,473 @@
+#include <glib.h>
+#include <agent.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "fec.h"
+#include "gf256.h"
+#include "callbacks.h"
+#include "metrics.h"
+#include "global.h"
+
+// Forward error correction for -u (-F k:m, both peers): every k datagrams
+// are followed by m parity datagrams, any k of the k + m recover the
+// group. Data datagrams are sent and delivered right away, parity only
+// matters if one of them got lost.
+//
+// The code is a systematic Reed-Solomon code with a Cauchy matrix: parity
+// shard i is the sum of coefficient(i, j) * data shard j, where shards are
+// padded with zeros to the longest one of the group. Every square part of
+// a Cauchy matrix can be inverted, so any m lost shards can be solved for.
+//
+// With -F k:auto the receiver reports the datagrams it lost every
+// FEC_REPORT_MS and the sender adjusts m for the next groups; groups carry
+// their k and m, so nothing else has to change on the way.
+
+#define FEC_DATA 0
+#define FEC_PARITY 1
+#define FEC_REPORT 2
+
+typedef struct {
+  guint32 id;
+  gboolean used;
+  guint k;
+  gboolean k_final;     // k of a parity datagram, the group may have closed early
+  guint shard_len;
+  guint8 *shards;       // data shards, then parity shards
+  guint32 have_data;
+  guint32 have_parity;
+  guint received;
+  guint recovered;
+  gboolean done;
+} FecGroup;
+
+static guint data_shards = 8, parity_shards = 2;
+static gboolean adaptive = FALSE;
+static guint8 tx_packet[FEC_HEADER_SIZE + FEC_SHARD_SIZE];
+
+struct _Fec {
+  NiceAgentRecvFunc deliver;
+  guint parity_shards;      // adapted to the peer's loss with k:auto
+
+  // outgoing
+  guint8 *tx_shards;
+  guint32 tx_group;
+  guint tx_k, tx_count, tx_shard_len;
+  guint flush_id;
+  guint report_id;
+
+  // incoming
+  FecGroup groups[FEC_WINDOW];
+  guint64 report_expected, report_lost;
+};
+
+static guint64 sent_groups = 0, sent_data = 0, sent_parity = 0;
+static guint64 recv_expected = 0, recv_lost = 0, recv_recovered = 0;
+
+static guint8
+fec_coefficient(guint parity, guint data) {
+  // the rows and columns of a Cauchy matrix need distinct elements
+  return gf256_inv((FEC_MAX_DATA + parity) ^ data);
+}
+
+static guint8*
+fec_shard(guint8 *shards, guint index) {
+  return shards + (gsize) index * FEC_SHARD_SIZE;
+}
+
+// "k:m" or "k:auto"
+gboolean
+fec_parse(const gchar *spec) {
+  gchar **fields = g_strsplit(spec, ":", 2);
+  gboolean ok = FALSE;
+
+  if(fields[0] == NULL || fields[1] == NULL)
+    goto end;
+
+  data_shards = atoi(fields[0]);
+  adaptive = (strcmp(fields[1], "auto") == 0);
+  parity_shards = adaptive ? 1 : atoi(fields[1]);
+
+  ok = data_shards >= 1 && data_shards <= FEC_MAX_DATA && parity_shards <= FEC_MAX_PARITY
+    && (adaptive || strspn(fields[1], "0123456789") == strlen(fields[1]));
+
+ end:
+  g_strfreev(fields);
+  return ok;
+}
+
+static void
+fec_header(guint8 *packet, guint8 type, guint k, guint m, guint index, guint32 group) {
+  guint32 net_group = g_htonl(group);
+
+  packet[0] = type;
+  packet[1] = k;
+  packet[2] = m;
+  packet[3] = index;
+  memcpy(packet + 4, &net_group, sizeof(net_group));
+}
+
+static void
+fec_close_group(NiceSession *session) {
+  Fec *fec = session->fec;
+  guint m = fec->parity_shards, i, j;
+
+  if(fec->flush_id != 0) {
+    g_source_remove(fec->flush_id);
+    fec->flush_id = 0;
+  }
+  if(fec->tx_count == 0)
+    return;
+
+  // the parity covers the shards as long as the longest one
+  for(j = 0; j < fec->tx_count; j++) {
+    guint8 *shard = fec_shard(fec->tx_shards, j);
+    guint len = 2 + ((shard[0] << 8) | shard[1]);
+
+    memset(shard + len, 0, fec->tx_shard_len - len);
+  }
+
+  for(i = 0; i < m; i++) {
+    guint8 *parity = tx_packet + FEC_HEADER_SIZE;
+
+    memset(parity, 0, fec->tx_shard_len);
+    for(j = 0; j < fec->tx_count; j++)
+      gf256_mul_add(parity, fec_shard(fec->tx_shards, j), fec_coefficient(i, j), fec->tx_shard_len);
+
+    fec_header(tx_packet, FEC_PARITY, fec->tx_count, m, i, fec->tx_group);
+    send_components(session, FEC_HEADER_SIZE + fec->tx_shard_len, (gchar*) tx_packet);
+  }
+
+  metrics.fec_parity_sent += m;
+  sent_parity += m;
+  sent_groups++;
+
+  fec->tx_group++;
+  fec->tx_count = 0;
+  fec->tx_shard_len = 0;
+}
+
+static gboolean
+fec_flush(gpointer session_ptr) {
+  NiceSession *session = session_ptr;
+
+  session->fec->flush_id = 0;
+  fec_close_group(session_ptr);
+
+  return FALSE;
+}
+
+gint
+fec_send(NiceSession *session, guint len, const gchar *buf) {
+  Fec *fec = session->fec;
+  guint8 *shard;
+  gint res;
+
+  // FEC_MAX_PAYLOAD covers what the layers above send, a larger datagram
+  // is a bug there: drop it rather than sending a part of it
+  if(len > FEC_MAX_PAYLOAD) {
+    g_critical("fec: datagram of %u bytes exceeds %u, dropping it\n", len, FEC_MAX_PAYLOAD);
+    metrics.dropped++;
+    return -1;
+  }
+
+  // k may have changed, it applies from the next group on
+  if(fec->tx_count == 0)
+    fec->tx_k = data_shards;
+
+  shard = fec_shard(fec->tx_shards, fec->tx_count);
+  shard[0] = len >> 8;
+  shard[1] = len & 0xff;
+  memcpy(shard + 2, buf, len);
+  fec->tx_shard_len = MAX(fec->tx_shard_len, 2 + len);
+
+  fec_header(tx_packet, FEC_DATA, fec->tx_k, fec->parity_shards, fec->tx_count, fec->tx_group);
+  memcpy(tx_packet + FEC_HEADER_SIZE, buf, len);
+  res = send_components(session, FEC_HEADER_SIZE + len, (gchar*) tx_packet);
+  sent_data++;
+
+  if(++fec->tx_count == fec->tx_k)
+    fec_close_group(session);
+  else if(fec->flush_id == 0)
+    fec->flush_id = g_timeout_add(FEC_FLUSH_MS, fec_flush, session);
+
+  return res < 0 ? res : len;
+}
+
+// the peer lost lost of the expected datagrams since its last report
+static void
+fec_adapt(Fec *fec, guint32 expected, guint32 lost) {
+  guint target;
+
+  if(!adaptive || expected == 0)
+    return;
+
+  // twice the loss rate leaves room for bursts; up quickly, down slowly
+  target = (2 * data_shards * (guint64) lost + expected - 1) / expected + (lost > 0);
+  target = CLAMP(target, 1, FEC_MAX_PARITY);
+
+  if(target > fec->parity_shards)
+    fec->parity_shards = target;
+  else if(target < fec->parity_shards)
+    fec->parity_shards--;
+
+  g_debug("fec: peer lost %u of %u datagrams, sending %u parity per %u\n",
+    lost, expected, fec->parity_shards, data_shards);
+}
+
+static gboolean
+fec_send_report(gpointer session_ptr) {
+  NiceSession *session = session_ptr;
+  Fec *fec = session->fec;
+  guint32 values[2] = { g_htonl(fec->report_expected), g_htonl(fec->report_lost) };
+
+  if(fec->report_expected == 0)
+    return TRUE;
+
+  fec_header(tx_packet, FEC_REPORT, 0, 0, 0, 0);
+  memcpy(tx_packet + FEC_HEADER_SIZE, values, sizeof(values));
+  send_components(session, FEC_HEADER_SIZE + sizeof(values), (gchar*) tx_packet);
+
+  fec->report_expected = 0;
+  fec->report_lost = 0;
+
+  return TRUE;
+}
+
+// a group leaves the window: what was not recovered by now is lost
+static void
+fec_account(Fec *fec, FecGroup *group) {
+  guint missing = group->k - MIN(group->k, group->received);
+  guint lost = missing - MIN(missing, group->recovered);
+
+  fec->report_expected += group->k;
+  fec->report_lost += missing;
+  recv_expected += group->k;
+  recv_lost += lost;
+  metrics.fec_lost += lost;
+}
+
+static FecGroup*
+fec_group(Fec *fec, guint32 id) {
+  FecGroup *group = &fec->groups[id % FEC_WINDOW];
+
+  if(group->used && group->id == id)
+    return group;
+
+  // older than the group that took its place
+  if(group->used && (gint32) (id - group->id) < 0)
+    return NULL;
+
+  if(group->used)
+    fec_account(fec, group);
+
+  group->id = id;
+  group->used = TRUE;
+  group->k = 0;
+  group->k_final = FALSE;
+  group->shard_len = 0;
+  group->have_data = 0;
+  group->have_parity = 0;
+  group->received = 0;
+  group->recovered = 0;
+  group->done = FALSE;
+
+  return group;
+}
+
+static void
+fec_recover(NiceAgent *agent, guint stream_id, FecGroup *group, gpointer data) {
+  NiceSession *session = data;
+  guint missing[FEC_MAX_PARITY], rows[FEC_MAX_PARITY];
+  guint8 matrix[FEC_MAX_PARITY * FEC_MAX_PARITY];
+  guint n_missing = 0, n_rows = 0, i, j, r;
+
+  if(group->done || !group->k_final)
+    return;
+
+  for(j = 0; j < group->k; j++) {
+    if(group->have_data & (1u << j))
+      continue;
+    if(n_missing == FEC_MAX_PARITY)
+      return;
+    missing[n_missing++] = j;
+  }
+  if(n_missing == 0) {
+    group->done = TRUE;
+    return;
+  }
+
+  for(i = 0; i < FEC_MAX_PARITY && n_rows < n_missing; i++)
+    if(group->have_parity & (1u << i))
+      rows[n_rows++] = i;
+  if(n_rows < n_missing)
+    return;
+  group->done = TRUE;
+
+  // take the shards that arrived out of the parity shards ...
+  for(j = 0; j < group->k; j++) {
+    guint8 *shard = fec_shard(group->shards, j);
+    guint len;
+
+    if(!(group->have_data & (1u << j)))
+      continue;
+
+    len = 2 + ((shard[0] << 8) | shard[1]);
+    if(len > group->shard_len)
+      return;
+    memset(shard + len, 0, group->shard_len - len);
+
+    for(r = 0; r < n_rows; r++)
+      gf256_mul_add(fec_shard(group->shards, FEC_MAX_DATA + rows[r]), shard,
+        fec_coefficient(rows[r], j), group->shard_len);
+  }
+
+  // ... and solve for the missing ones
+  for(r = 0; r < n_rows; r++)
+    for(i = 0; i < n_missing; i++)
+      matrix[r * n_missing + i] = fec_coefficient(rows[r], missing[i]);
+  if(!gf256_invert(matrix, n_missing))
+    return;
+
+  for(i = 0; i < n_missing; i++) {
+    guint8 *shard = fec_shard(group->shards, missing[i]);
+    guint len;
+
+    memset(shard, 0, group->shard_len);
+    for(r = 0; r < n_rows; r++)
+      gf256_mul_add(shard, fec_shard(group->shards, FEC_MAX_DATA + rows[r]),
+        matrix[i * n_missing + r], group->shard_len);
+
+    len = (shard[0] << 8) | shard[1];
+    if(len + 2 > group->shard_len)
+      continue;
+
+    group->have_data |= 1u << missing[i];
+    group->recovered++;
+    recv_recovered++;
+    metrics.fec_recovered++;
+    session->fec->deliver(agent, stream_id, 1, len, (gchar*) shard + 2, data);
+  }
+  g_debug("fec: recovered %u datagrams of group %u\n", n_missing, group->id);
+}
+
+void
+fec_recv(NiceAgent *agent, guint stream_id, guint component_id, guint len,
+    gchar *buf, gpointer data) {
+  NiceSession *session = data;
+  Fec *fec = session->fec;
+  guint8 *packet = (guint8*) buf;
+  guint payload_len = len - FEC_HEADER_SIZE;
+  guint32 id;
+  FecGroup *group;
+
+  if(len < FEC_HEADER_SIZE || payload_len > FEC_SHARD_SIZE)
+    goto drop;
+
+  if(packet[0] == FEC_REPORT) {
+    guint32 values[2];
+
+    if(payload_len < sizeof(values))
+      goto drop;
+    memcpy(values, packet + FEC_HEADER_SIZE, sizeof(values));
+    fec_adapt(fec, g_ntohl(values[0]), g_ntohl(values[1]));
+    return;
+  }
+
+  memcpy(&id, packet + 4, sizeof(id));
+  group = fec_group(fec, g_ntohl(id));
+  if(group == NULL || packet[1] == 0 || packet[1] > FEC_MAX_DATA)
+    goto drop;
+
+  if(packet[0] == FEC_DATA) {
+    guint8 *shard;
+    guint index = packet[3];
+
+    if(index >= FEC_MAX_DATA || payload_len > FEC_MAX_PAYLOAD)
+      goto drop;
+    // recovered already, or a duplicate
+    if(group->have_data & (1u << index))
+      return;
+
+    if(!group->k_final)
+      group->k = packet[1];
+    shard = fec_shard(group->shards, index);
+    shard[0] = payload_len >> 8;
+    shard[1] = payload_len & 0xff;
+    memcpy(shard + 2, packet + FEC_HEADER_SIZE, payload_len);
+    group->have_data |= 1u << index;
+    group->received++;
+
+    fec->deliver(agent, stream_id, component_id, payload_len, buf + FEC_HEADER_SIZE, data);
+  }
+  else if(packet[0] == FEC_PARITY) {
+    guint index = packet[3];
+
+    if(index >= FEC_MAX_PARITY || (group->k_final && payload_len != group->shard_len))
+      goto drop;
+    if(group->have_parity & (1u << index))
+      return;
+
+    group->k = packet[1];
+    group->k_final = TRUE;
+    group->shard_len = payload_len;
+    memcpy(fec_shard(group->shards, FEC_MAX_DATA + index), packet + FEC_HEADER_SIZE, payload_len);
+    group->have_parity |= 1u << index;
+  }
+  else
+    goto drop;
+
+  fec_recover(agent, stream_id, group, data);
+  return;
+
+ drop:
+  g_debug("fec: dropping a datagram of %u bytes\n", len);
+  metrics.dropped++;
+}
+
+void
+fec_init(NiceSession *session, NiceAgentRecvFunc deliver) {
+  Fec *fec = g_new0(Fec, 1);
+  guint i;
+
+  fec->deliver = deliver;
+  fec->parity_shards = parity_shards;
+  gf256_init();
+
+  fec->tx_shards = g_malloc((gsize) FEC_MAX_DATA * FEC_SHARD_SIZE);
+  for(i = 0; i < FEC_WINDOW; i++)
+    fec->groups[i].shards = g_malloc((gsize) (FEC_MAX_DATA + FEC_MAX_PARITY) * FEC_SHARD_SIZE);
+
+  fec->report_id = g_timeout_add(FEC_REPORT_MS, fec_send_report, session);
+  session->fec = fec;
+  g_debug("fec: %u data and %u%s parity datagrams per group (%s)\n", data_shards, fec->parity_shards,
+    adaptive ? " or more" : "", gf256_implementation());
+}
+
+void
+fec_free(NiceSession *session) {
+  Fec *fec = session->fec;
+  guint i;
+
+  if(fec == NULL)
+    return;
+
+  if(fec->flush_id != 0)
+    g_source_remove(fec->flush_id);
+  g_source_remove(fec->report_id);
+  g_free(fec->tx_shards);
+  for(i = 0; i < FEC_WINDOW; i++)
+    g_free(fec->groups[i].shards);
+  g_free(fec);
+  session->fec = NULL;
+}
+
+void
+fec_report() {
+  g_message("fec: sent %" G_GUINT64_FORMAT " datagrams and %" G_GUINT64_FORMAT
+    " parity datagrams in %" G_GUINT64_FORMAT " groups (%.0f%% overhead)\n",
+    sent_data, sent_parity, sent_groups, sent_data ? 100.0 * sent_parity / sent_data : 0.0);
+  g_message("fec: lost %" G_GUINT64_FORMAT " of %" G_GUINT64_FORMAT " received datagrams after recovering %"
+    G_GUINT64_FORMAT "\n", recv_lost, recv_expected, recv_recovered);
+}
@@ -0,0 +1,36 @@
+#ifndef __FEC_H__
+#define __FEC_H__
+
+#include <glib.h>
+#include <agent.h>
+
+#include "session.h"
+#include "callbacks.h"
+#include "compress.h"
+#include "tls.h"
+
+// type, data shards, parity shards, index, group number
+#define FEC_HEADER_SIZE 8
+#define FEC_MAX_DATA 32
+#define FEC_MAX_PARITY 16
+// the largest datagram send_data() reads with -u, after -Z and -t
+#define FEC_MAX_PAYLOAD (SEND_DATA_MAX_DATAGRAM + COMPRESS_HEADER_SIZE + TLS_DATAGRAM_OVERHEAD)
+// a shard is the datagram's length followed by the datagram
+#define FEC_SHARD_SIZE (2 + FEC_MAX_PAYLOAD)
+// a datagram in a parity datagram is this much larger than on its own
+#define FEC_OVERHEAD (FEC_HEADER_SIZE + 2)
+// groups kept by the receiver, older datagrams are dropped
+#define FEC_WINDOW 8
+// a group that did not fill up by then is protected as it is
+#define FEC_FLUSH_MS 20
+// how often the receiver tells the sender how many datagrams were lost
+#define FEC_REPORT_MS 1000
+
+gboolean fec_parse(const gchar *spec);
+void fec_init(NiceSession *session, NiceAgentRecvFunc deliver);
+void fec_free(NiceSession *session);
+gint fec_send(NiceSession *session, guint len, const gchar *buf);
+void fec_recv(NiceAgent *agent, guint stream_id, guint component_id, guint len, gchar *buf, gpointer data);
+void fec_report();
+
+#endif
@@ -0,0 +1,199 @@
+#include <glib.h>
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <tmmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include "gf256.h"
+
+#define GF256_POLYNOMIAL 0x11d
+
+static guint8 gf_exp[512];
+static guint8 gf_log[256];
+// gf_mul_table[c][x] = c * x, 64 KB
+static guint8 gf_mul_table[256][256];
+
+static void gf256_mul_add_scalar(guint8 *dst, const guint8 *src, guint8 c, gsize len);
+
+static void (*mul_add)(guint8 *dst, const guint8 *src, guint8 c, gsize len) = gf256_mul_add_scalar;
+static const gchar *implementation = "scalar";
+
+static void
+gf256_mul_add_scalar(guint8 *dst, const guint8 *src, guint8 c, gsize len) {
+  const guint8 *row = gf_mul_table[c];
+  gsize i;
+
+  for(i = 0; i < len; i++)
+    dst[i] ^= row[src[i]];
+}
+
+// c * x = c * (x & 0x0f) ^ c * (x & 0xf0): two 16 entry tables, looked up
+// 16 bytes at a time with a byte shuffle
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("ssse3")))
+static void
+gf256_mul_add_ssse3(guint8 *dst, const guint8 *src, guint8 c, gsize len) {
+  const guint8 *row = gf_mul_table[c];
+  guint8 lo[16], hi[16];
+  __m128i table_lo, table_hi, mask = _mm_set1_epi8(0x0f);
+  gsize i;
+
+  for(i = 0; i < 16; i++) {
+    lo[i] = row[i];
+    hi[i] = row[i << 4];
+  }
+  table_lo = _mm_loadu_si128((const __m128i*) lo);
+  table_hi = _mm_loadu_si128((const __m128i*) hi);
+
+  for(i = 0; i + 16 <= len; i += 16) {
+    __m128i s = _mm_loadu_si128((const __m128i*) (src + i));
+    __m128i l = _mm_shuffle_epi8(table_lo, _mm_and_si128(s, mask));
+    __m128i h = _mm_shuffle_epi8(table_hi, _mm_and_si128(_mm_srli_epi64(s, 4), mask));
+    __m128i d = _mm_loadu_si128((const __m128i*) (dst + i));
+
+    _mm_storeu_si128((__m128i*) (dst + i), _mm_xor_si128(d, _mm_xor_si128(l, h)));
+  }
+
+  gf256_mul_add_scalar(dst + i, src + i, c, len - i);
+}
+#elif defined(__aarch64__)
+static void
+gf256_mul_add_neon(guint8 *dst, const guint8 *src, guint8 c, gsize len) {
+  const guint8 *row = gf_mul_table[c];
+  guint8 lo[16], hi[16];
+  uint8x16_t table_lo, table_hi, mask = vdupq_n_u8(0x0f);
+  gsize i;
+
+  for(i = 0; i < 16; i++) {
+    lo[i] = row[i];
+    hi[i] = row[i << 4];
+  }
+  table_lo = vld1q_u8(lo);
+  table_hi = vld1q_u8(hi);
+
+  for(i = 0; i + 16 <= len; i += 16) {
+    uint8x16_t s = vld1q_u8(src + i);
+    uint8x16_t l = vqtbl1q_u8(table_lo, vandq_u8(s, mask));
+    uint8x16_t h = vqtbl1q_u8(table_hi, vshrq_n_u8(s, 4));
+
+    vst1q_u8(dst + i, veorq_u8(vld1q_u8(dst + i), veorq_u8(l, h)));
+  }
+
+  gf256_mul_add_scalar(dst + i, src + i, c, len - i);
+}
+#endif
+
+void
+gf256_init() {
+  guint x = 1, i, j;
+
+  for(i = 0; i < 255; i++) {
+    gf_exp[i] = x;
+    gf_log[x] = i;
+    x <<= 1;
+    if(x & 0x100)
+      x ^= GF256_POLYNOMIAL;
+  }
+  // no modulo needed when adding two logarithms
+  for(i = 255; i < 512; i++)
+    gf_exp[i] = gf_exp[i - 255];
+
+  for(i = 0; i < 256; i++)
+    for(j = 0; j < 256; j++)
+      gf_mul_table[i][j] = (i && j) ? gf_exp[gf_log[i] + gf_log[j]] : 0;
+
+#if defined(__x86_64__) || defined(__i386__)
+  if(__builtin_cpu_supports("ssse3")) {
+    mul_add = gf256_mul_add_ssse3;
+    implementation = "ssse3";
+  }
+#elif defined(__aarch64__)
+  mul_add = gf256_mul_add_neon;
+  implementation = "neon";
+#endif
+}
+
+guint8
+gf256_mul(guint8 a, guint8 b) {
+  return gf_mul_table[a][b];
+}
+
+guint8
+gf256_inv(guint8 a) {
+  return gf_exp[255 - gf_log[a]];
+}
+
+void
+gf256_mul_add(guint8 *dst, const guint8 *src, guint8 c, gsize len) {
+  gsize i;
+
+  if(c == 0)
+    return;
+  if(c == 1) {
+    for(i = 0; i < len; i++)
+      dst[i] ^= src[i];
+    return;
+  }
+
+  mul_add(dst, src, c, len);
+}
+
+// Gauss-Jordan elimination next to an identity matrix
+gboolean
+gf256_invert(guint8 *matrix, guint n) {
+  guint8 inverse[n * n];
+  guint row, col, i;
+
+  memset(inverse, 0, n * n);
+  for(i = 0; i < n; i++)
+    inverse[i * n + i] = 1;
+
+  for(col = 0; col < n; col++) {
+    guint8 factor;
+
+    for(row = col; row < n && matrix[row * n + col] == 0; row++);
+    if(row == n)
+      return FALSE;
+
+    if(row != col) {
+      for(i = 0; i < n; i++) {
+        guint8 tmp = matrix[row * n + i];
+        matrix[row * n + i] = matrix[col * n + i];
+        matrix[col * n + i] = tmp;
+        tmp = inverse[row * n + i];
+        inverse[row * n + i] = inverse[col * n + i];
+        inverse[col * n + i] = tmp;
+      }
+    }
+
+    factor = gf256_inv(matrix[col * n + col]);
+    for(i = 0; i < n; i++) {
+      matrix[col * n + i] = gf256_mul(matrix[col * n + i], factor);
+      inverse[col * n + i] = gf256_mul(inverse[col * n + i], factor);
+    }
+
+    for(row = 0; row < n; row++) {
+      guint8 scale = matrix[row * n + col];
+
+      if(row == col || scale == 0)
+        continue;
+      for(i = 0; i < n; i++) {
+        matrix[row * n + i] ^= gf256_mul(matrix[col * n + i], scale);
+        inverse[row * n + i] ^= gf256_mul(inverse[col * n + i], scale);
+      }
+    }
+  }
+
+  memcpy(matrix, inverse, n * n);
+  return TRUE;
+}
+
+const gchar*
+gf256_implementation() {
+  return implementation;
+}
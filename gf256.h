@@ -0,0 +1,21 @@
+#ifndef __GF256_H__
+#define __GF256_H__
+
+#include <glib.h>
+
+// Arithmetic in GF(2^8) with the polynomial x^8 + x^4 + x^3 + x^2 + 1
+// (0x11d). Addition is XOR.
+
+void gf256_init();
+guint8 gf256_mul(guint8 a, guint8 b);
+guint8 gf256_inv(guint8 a);
+
+// dst ^= c * src over len bytes, with SSSE3 or NEON where available
+void gf256_mul_add(guint8 *dst, const guint8 *src, guint8 c, gsize len);
+
+// inverts the n x n matrix in place (row major), FALSE if it is singular
+gboolean gf256_invert(guint8 *matrix, guint n);
+
+const gchar* gf256_implementation();
+
+#endif
@@ -2,13 +2,21 @@
 #define __GLOBAL_H__
 
 extern GMainLoop *gloop;
-extern guint nice_stream_id;
 
 extern gboolean not_reliable;
 extern guint stun_port;
 extern gchar* stun_host;
-extern gint* is_caller;
-extern guint output_fd;
 extern gboolean verbose;
-extern gchar* remote_hostname;
+extern gboolean multiplex;
+extern guint n_components;
+extern guint batch_size;
+extern gboolean use_tls;
+extern gchar* tun_address;
+extern gboolean resume_session;
+extern gboolean auto_reconnect;
+extern gboolean threaded;
+extern gboolean use_compression;
+extern gchar* fec_spec;
+extern gboolean udp_transport;
+extern guint transport_window;
 #endif
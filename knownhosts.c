@@ -0,0 +1,187 @@
+#include <glib.h>
+
+#include <string.h>
+
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+#include <openssl/rsa.h>
+#include <openssl/hmac.h>
+
+#include "knownhosts.h"
+
+static void
+append_ssh_string(GByteArray *blob, const guint8 *data, guint32 len) {
+  guint32 net_len = g_htonl(len);
+
+  g_byte_array_append(blob, (guint8*) &net_len, sizeof(net_len));
+  g_byte_array_append(blob, data, len);
+}
+
+static void
+append_ssh_mpint(GByteArray *blob, const BIGNUM *bn) {
+  gint len = BN_num_bytes(bn);
+  guint8 *buf = g_malloc(len + 1);
+
+  // positive numbers with the high bit set get a leading zero byte
+  buf[0] = 0;
+  BN_bn2bin(bn, buf + 1);
+  if(len > 0 && (buf[1] & 0x80))
+    append_ssh_string(blob, buf, len + 1);
+  else
+    append_ssh_string(blob, buf + 1, len);
+
+  g_free(buf);
+}
+
+// the certificate's RSA key in ssh-rsa wire format, as in id_rsa.pub
+static GByteArray*
+certificate_to_ssh_key(const gchar *pem, gsize len) {
+  BIO *bio = BIO_new_mem_buf(pem, len);
+  X509 *cert = PEM_read_bio_X509(bio, NULL, NULL, NULL);
+  EVP_PKEY *pkey = NULL;
+  RSA *rsa = NULL;
+  const BIGNUM *n, *e;
+  GByteArray *blob = NULL;
+
+  BIO_free(bio);
+  if(cert == NULL)
+    return NULL;
+
+  pkey = X509_get_pubkey(cert);
+  if(pkey != NULL)
+    rsa = EVP_PKEY_get1_RSA(pkey);
+
+  if(rsa != NULL) {
+    RSA_get0_key(rsa, &n, &e, NULL);
+
+    blob = g_byte_array_new();
+    append_ssh_string(blob, (const guint8*) "ssh-rsa", 7);
+    append_ssh_mpint(blob, e);
+    append_ssh_mpint(blob, n);
+    RSA_free(rsa);
+  }
+
+  EVP_PKEY_free(pkey);
+  X509_free(cert);
+
+  return blob;
+}
+
+static gchar*
+ssh_fingerprint(const guint8 *key, gsize len) {
+  guint8 digest[32];
+  gsize digest_len = sizeof(digest);
+  GChecksum *checksum = g_checksum_new(G_CHECKSUM_SHA256);
+  gchar *encoded, *fingerprint;
+
+  g_checksum_update(checksum, key, len);
+  g_checksum_get_digest(checksum, digest, &digest_len);
+  g_checksum_free(checksum);
+
+  encoded = g_base64_encode(digest, digest_len);
+  g_strdelimit(encoded, "=", '\0');
+  fingerprint = g_strconcat("SHA256:", encoded, NULL);
+  g_free(encoded);
+
+  return fingerprint;
+}
+
+// plain (comma separated) or hashed ("|1|salt|hash") host patterns
+static gboolean
+host_matches(const gchar *pattern, const gchar *hostname) {
+  gboolean match = FALSE;
+
+  if(g_str_has_prefix(pattern, "|1|")) {
+    gchar **parts = g_strsplit(pattern + 3, "|", 2);
+
+    if(parts[0] && parts[1]) {
+      gsize salt_len, hash_len;
+      guint8 *salt = g_base64_decode(parts[0], &salt_len);
+      guint8 *hash = g_base64_decode(parts[1], &hash_len);
+      guint8 mac[EVP_MAX_MD_SIZE];
+      guint mac_len;
+
+      HMAC(EVP_sha1(), salt, salt_len, (const guint8*) hostname, strlen(hostname), mac, &mac_len);
+      match = (mac_len == hash_len && memcmp(mac, hash, mac_len) == 0);
+
+      g_free(salt);
+      g_free(hash);
+    }
+    g_strfreev(parts);
+  }
+  else {
+    gchar **hosts = g_strsplit(pattern, ",", 0);
+    gint i;
+
+    for(i = 0; hosts[i] && !match; i++)
+      match = (g_ascii_strcasecmp(hosts[i], hostname) == 0);
+    g_strfreev(hosts);
+  }
+
+  return match;
+}
+
+gboolean
+known_hosts_check_certificate(const gchar *hostname, const gchar *pem, gsize len) {
+  gchar *filename = g_build_filename(g_get_home_dir(), NICE_KNOWN_HOSTS, NULL);
+  gchar *contents = NULL, *fingerprint, *encoded;
+  gchar **lines;
+  GByteArray *key;
+  gboolean known = FALSE, ok = FALSE;
+  gint i;
+
+  key = certificate_to_ssh_key(pem, len);
+  if(key == NULL) {
+    g_critical("Received certificate does not contain an RSA public key!");
+    g_free(filename);
+    return FALSE;
+  }
+
+  if(!g_file_get_contents(filename, &contents, NULL, NULL)) {
+    g_file_set_contents(filename,
+      "# This is nicepipe's known_hosts file\n"
+      "# It has the same format as ssh's $HOME/.ssh/known_hosts (see sshd(8) manpage for details)\n", -1, NULL);
+    contents = g_strdup("");
+  }
+
+  lines = g_strsplit(contents, "\n", 0);
+  for(i = 0; lines[i] && !ok; i++) {
+    gchar **fields;
+
+    if(lines[i][0] == '#' || lines[i][0] == '\0')
+      continue;
+
+    fields = g_strsplit_set(lines[i], " \t", 4);
+    if(fields[0] && fields[1] && fields[2] &&
+        strcmp(fields[1], "ssh-rsa") == 0 && host_matches(fields[0], hostname)) {
+      gsize known_len;
+      guint8 *known_key = g_base64_decode(fields[2], &known_len);
+
+      known = TRUE;
+      ok = (known_len == key->len && memcmp(known_key, key->data, known_len) == 0);
+      g_free(known_key);
+    }
+    g_strfreev(fields);
+  }
+  g_strfreev(lines);
+
+  fingerprint = ssh_fingerprint(key->data, key->len);
+  if(!known) {
+    encoded = g_base64_encode(key->data, key->len);
+    g_critical("This seems to be a new public key: %s\n"
+      "Maybe you want to add it to your ~/.ssh/known_hosts?\n\n"
+      "If so, execute this command:\n"
+      "  echo %s ssh-rsa %s >> %s\n"
+      "and run nicepipe again.", fingerprint, hostname, encoded, filename);
+    g_free(encoded);
+  }
+  else if(!ok)
+    g_critical("Received certificate was not signed by the correct public key (%s)!", fingerprint);
+
+  g_free(fingerprint);
+  g_free(contents);
+  g_free(filename);
+  g_byte_array_unref(key);
+
+  return ok;
+}
@@ -0,0 +1,11 @@
+#ifndef __KNOWNHOSTS_H__
+#define __KNOWNHOSTS_H__
+
+#include <glib.h>
+
+// same format as ssh's $HOME/.ssh/known_hosts (see sshd(8))
+#define NICE_KNOWN_HOSTS ".nice_known_hosts"
+
+gboolean known_hosts_check_certificate(const gchar *hostname, const gchar *pem, gsize len);
+
+#endif
@@ -0,0 +1,190 @@
+#include <glib.h>
+#include <glib-unix.h>
+#include <agent.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "metrics.h"
+#include "callbacks.h"
+#include "sendq.h"
+#include "util.h"
+#include "global.h"
+
+#define METRICS_MAX_COMPONENTS 16
+
+MetricsCounters metrics;
+
+static NiceSession *metrics_session = NULL;
+static NiceComponentState component_state[METRICS_MAX_COMPONENTS];
+static gint listen_fd = -1;
+static gchar *listen_path = NULL;
+
+static gboolean
+metrics_signal(gpointer data) {
+  GString *text = metrics_to_string();
+
+  fputs(text->str, stderr);
+  fflush(stderr);
+  g_string_free(text, TRUE);
+
+  return TRUE;
+}
+
+// one connection gets one snapshot, the text is small enough for the
+// socket buffer so this never blocks the main loop
+static gboolean
+metrics_accept(gint fd, GIOCondition cond, gpointer data) {
+  GString *text;
+  gint client = accept(fd, NULL, NULL);
+
+  if(client < 0)
+    return TRUE;
+
+  text = metrics_to_string();
+  if(send(client, text->str, text->len, MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+    g_debug("metrics: send() failed: errno=%i\n", errno);
+  close(client);
+  g_string_free(text, TRUE);
+
+  return TRUE;
+}
+
+static void
+metrics_listen(const gchar *path) {
+  struct sockaddr_un addr;
+
+  if(strlen(path) >= sizeof(addr.sun_path)) {
+    g_critical("Metrics socket path too long: %s", path);
+    exit(1);
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+
+  // a previous session may have left its socket behind
+  unlink(path);
+
+  listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if(listen_fd < 0 || bind(listen_fd, (struct sockaddr*) &addr, sizeof(addr)) < 0
+      || listen(listen_fd, 4) < 0) {
+    g_critical("Cannot listen for metrics at %s: %s", path, g_strerror(errno));
+    exit(1);
+  }
+
+  listen_path = g_strdup(path);
+  g_unix_fd_add(listen_fd, G_IO_IN, metrics_accept, NULL);
+}
+
+void
+metrics_init(const gchar *socket_path) {
+  memset(&metrics, 0, sizeof(metrics));
+  g_unix_signal_add(SIGUSR1, metrics_signal, NULL);
+
+  if(socket_path != NULL)
+    metrics_listen(socket_path);
+}
+
+static void
+metrics_state_changed(NiceAgent *agent, guint stream_id, guint component_id,
+    guint state, gpointer data) {
+  if(component_id >= 1 && component_id <= METRICS_MAX_COMPONENTS)
+    component_state[component_id - 1] = state;
+}
+
+// the gauges of the session; the counters are shared by all sessions
+void
+metrics_attach(NiceSession *session) {
+  metrics_session = session;
+  g_signal_connect(G_OBJECT(session->agent), "component-state-changed", G_CALLBACK(metrics_state_changed), session);
+}
+
+static void
+append_counter(GString *text, const gchar *name, const gchar *help, guint64 value) {
+  g_string_append_printf(text, "# HELP %s %s\n# TYPE %s counter\n%s %" G_GUINT64_FORMAT "\n",
+    name, help, name, name, value);
+}
+
+static void
+append_pair(GString *text, guint component_id) {
+  NiceCandidate *local, *remote;
+  gchar local_addr[NICE_ADDRESS_STRING_LEN], remote_addr[NICE_ADDRESS_STRING_LEN];
+
+  if(!nice_agent_get_selected_pair(metrics_session->agent, metrics_session->stream_id, component_id,
+      &local, &remote))
+    return;
+
+  nice_address_to_string(&local->addr, local_addr);
+  nice_address_to_string(&remote->addr, remote_addr);
+  g_string_append_printf(text, "nice_selected_pair{component=\"%u\",local_type=\"%s\",remote_type=\"%s\","
+    "local_address=\"%s:%u\",remote_address=\"%s:%u\"} 1\n",
+    component_id, candidate_type_to_string(local->type), candidate_type_to_string(remote->type),
+    local_addr, nice_address_get_port(&local->addr), remote_addr, nice_address_get_port(&remote->addr));
+}
+
+// Prometheus text format
+GString*
+metrics_to_string() {
+  GString *text = g_string_sized_new(2048);
+  guint i;
+
+  append_counter(text, "nice_sent_bytes_total", "Bytes handed to the agent", metrics.sent_bytes);
+  append_counter(text, "nice_sent_messages_total", "Reads handed to the agent", metrics.sent_messages);
+  append_counter(text, "nice_received_bytes_total", "Bytes delivered locally", metrics.received_bytes);
+  append_counter(text, "nice_received_messages_total", "Receive callbacks delivered locally", metrics.received_messages);
+  append_counter(text, "nice_send_short_total", "nice_agent_send() calls that took part of the data", metrics.send_short);
+  append_counter(text, "nice_send_failed_total", "nice_agent_send() calls that took nothing", metrics.send_failed);
+  append_counter(text, "nice_dropped_total", "Messages given up on", metrics.dropped);
+  append_counter(text, "nice_reconnects_total", "Successful ICE restarts", metrics.reconnects);
+  append_counter(text, "nice_fec_parity_sent_total", "Parity datagrams sent", metrics.fec_parity_sent);
+  append_counter(text, "nice_fec_recovered_total", "Datagrams rebuilt from parity", metrics.fec_recovered);
+  append_counter(text, "nice_fec_lost_total", "Datagrams lost despite parity", metrics.fec_lost);
+  append_counter(text, "nice_retransmitted_packets_total", "Packets sent again", metrics.retransmits);
+  g_string_append_printf(text, "# HELP nice_outage_seconds_total Time without connection before ICE restarts succeeded\n"
+    "# TYPE nice_outage_seconds_total counter\nnice_outage_seconds_total %.3f\n", metrics.outage_us / 1e6);
+
+  if(metrics_session == NULL)
+    return text;
+
+  g_string_append(text, "# HELP nice_send_queue_bytes Bytes the agent did not accept yet\n"
+    "# TYPE nice_send_queue_bytes gauge\n");
+  for(i = 1; i <= n_components; i++)
+    g_string_append_printf(text, "nice_send_queue_bytes{component=\"%u\"} %zu\n", i,
+      sendq_pending(metrics_session, i));
+
+  g_string_append_printf(text, "# HELP nice_output_queue_bytes Bytes not written to the local fd yet\n"
+    "# TYPE nice_output_queue_bytes gauge\nnice_output_queue_bytes %zu\n",
+    output_queue_pending(metrics_session));
+
+  g_string_append(text, "# HELP nice_component_state ICE state of each component\n"
+    "# TYPE nice_component_state gauge\n");
+  for(i = 1; i <= n_components && i <= METRICS_MAX_COMPONENTS; i++)
+    g_string_append_printf(text, "nice_component_state{component=\"%u\",state=\"%s\"} %u\n",
+      i, nice_component_state_to_string(component_state[i - 1]), component_state[i - 1]);
+
+  g_string_append(text, "# HELP nice_selected_pair Candidate pair in use\n"
+    "# TYPE nice_selected_pair gauge\n");
+  for(i = 1; i <= n_components; i++)
+    append_pair(text, i);
+
+  return text;
+}
+
+void
+metrics_shutdown() {
+  if(listen_path == NULL)
+    return;
+
+  close(listen_fd);
+  unlink(listen_path);
+  g_free(listen_path);
+  listen_path = NULL;
+}
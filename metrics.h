@@ -0,0 +1,34 @@
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <glib.h>
+#include <agent.h>
+
+#include "session.h"
+
+// counters are incremented directly on the data path, everything else is
+// collected when the metrics are read
+typedef struct {
+  guint64 sent_bytes;       // handed to the agent
+  guint64 sent_messages;
+  guint64 received_bytes;   // delivered to the local fd, tun device or channel
+  guint64 received_messages;
+  guint64 send_short;       // nice_agent_send() took only part of the data
+  guint64 send_failed;      // nice_agent_send() took nothing
+  guint64 dropped;          // data given up on (full queues with -u, oversized datagrams)
+  guint64 reconnects;       // ICE restarts that succeeded (-r)
+  guint64 outage_us;        // time without connection until then
+  guint64 fec_parity_sent;  // parity datagrams (-F)
+  guint64 fec_recovered;    // datagrams rebuilt from parity
+  guint64 fec_lost;         // datagrams lost despite parity
+  guint64 retransmits;      // packets sent again (-U)
+} MetricsCounters;
+
+extern MetricsCounters metrics;
+
+void metrics_init(const gchar *socket_path);
+void metrics_attach(NiceSession *session);
+GString* metrics_to_string();
+void metrics_shutdown();
+
+#endif
@@ -0,0 +1,501 @@
+#include <glib.h>
+#include <gio/gio.h>
+#include <agent.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+
+#include "mux.h"
+#include "util.h"
+#include "callbacks.h"
+#include "sendq.h"
+#include "outq.h"
+#include "metrics.h"
+#include "global.h"
+
+#define MUX_MAX_PAYLOAD 16384
+
+// A channel is closed in both directions on its own, like TCP: CLOSE
+// tells the peer that the local connection shut down writing. The
+// channel is freed once both sides sent CLOSE and everything was written.
+typedef struct {
+  Mux *mux;
+  guint16 id;
+  gint fd;                  // -1 while connecting
+  GSocketConnection *conn;
+  GCancellable *connecting; // set until the local connection is made
+  GByteArray *early;        // data of the peer that arrived meanwhile
+  guint watch_id;
+  gsize send_credit;  // bytes we may still send before the peer grants more
+  gsize recv_unacked; // bytes written locally but not yet granted back
+  OutputQueue *output;
+  gboolean local_closed;    // read EOF, CLOSE sent
+  gboolean peer_closed;     // CLOSE received, shut down writing once drained
+  gboolean write_shut;
+  gboolean abandoned;       // removed while connecting
+} MuxChannel;
+
+struct _Mux {
+  NiceSession *session;
+  guint port;
+  GHashTable *channels;
+  guint16 next_channel_id;
+  GByteArray *rx_buffer;
+  gsize rx_skip;        // rest of an oversized frame
+  gboolean waiting;     // for the send queue to drain
+  gboolean unpublished;
+};
+
+static gboolean mux_channel_read(GIOChannel *source, GIOCondition cond, gpointer channel_ptr);
+static gboolean mux_resume_channels(gpointer data);
+
+static void
+mux_write_header(gchar *frame, guint8 type, guint16 id, guint32 length) {
+  guint16 net_id = g_htons(id);
+  guint32 net_length = g_htonl(length);
+
+  frame[0] = type;
+  frame[1] = 0;
+  memcpy(frame + 2, &net_id, sizeof(net_id));
+  memcpy(frame + 4, &net_length, sizeof(net_length));
+}
+
+static void
+mux_send_frame(Mux *mux, gchar *frame, gsize payload_len) {
+  gint res;
+
+  res = send_to_peer(mux->session, MUX_HEADER_SIZE + payload_len, frame);
+  if(res != MUX_HEADER_SIZE + payload_len)
+    g_debug("mux: send_to_peer() = %i (expected %u)\n", res, MUX_HEADER_SIZE + payload_len);
+}
+
+static void
+mux_send_control(Mux *mux, guint8 type, guint16 id, guint32 value) {
+  gchar frame[MUX_HEADER_SIZE];
+
+  mux_write_header(frame, type, id, value);
+  mux_send_frame(mux, frame, 0);
+}
+
+static void
+mux_channel_destroy(MuxChannel *channel) {
+  if(channel->watch_id != 0)
+    g_source_remove(channel->watch_id);
+  if(channel->output != NULL)
+    outq_free(channel->output);
+  if(channel->conn != NULL)
+    g_object_unref(channel->conn);
+  if(channel->early != NULL)
+    g_byte_array_unref(channel->early);
+  g_free(channel);
+}
+
+static void
+mux_channel_free(gpointer channel_ptr) {
+  MuxChannel *channel = channel_ptr;
+
+  g_debug("mux: closing channel %u\n", channel->id);
+
+  // the connect callback frees it
+  if(channel->connecting != NULL) {
+    channel->abandoned = TRUE;
+    g_cancellable_cancel(channel->connecting);
+    return;
+  }
+  mux_channel_destroy(channel);
+}
+
+static void
+mux_channel_remove(MuxChannel *channel) {
+  g_hash_table_remove(channel->mux->channels, GUINT_TO_POINTER(channel->id));
+}
+
+// the connection failed, the peer drops the channel as well
+static void
+mux_channel_reset(MuxChannel *channel) {
+  mux_send_control(channel->mux, MUX_FRAME_RESET, channel->id, 0);
+  mux_channel_remove(channel);
+}
+
+// once the peer closed and everything was written, the local connection
+// gets its EOF; the channel is freed if it was closed locally as well
+static void
+mux_channel_finish(MuxChannel *channel) {
+  if(!channel->peer_closed || channel->output == NULL || outq_pending(channel->output) > 0)
+    return;
+
+  if(!channel->write_shut) {
+    shutdown(channel->fd, SHUT_WR);
+    channel->write_shut = TRUE;
+  }
+  if(channel->local_closed)
+    mux_channel_remove(channel);
+}
+
+static gboolean
+mux_channel_readable(MuxChannel *channel) {
+  return channel->watch_id == 0 && channel->connecting == NULL && !channel->local_closed
+    && channel->send_credit > 0;
+}
+
+static void
+mux_channel_watch(MuxChannel *channel) {
+  GIOChannel* io_channel = g_io_channel_unix_new(channel->fd);
+
+  channel->watch_id = g_io_add_watch(io_channel, G_IO_IN, mux_channel_read, channel);
+  g_io_channel_unref(io_channel);
+}
+
+static void
+mux_channel_written(OutputQueue *queue, gsize written, gpointer channel_ptr) {
+  MuxChannel *channel = channel_ptr;
+
+  if(channel->peer_closed) {
+    mux_channel_finish(channel);
+    return;
+  }
+
+  // grant the window back in batches to keep the control traffic low
+  channel->recv_unacked += written;
+  if(channel->recv_unacked >= MUX_WINDOW_SIZE/2) {
+    mux_send_control(channel->mux, MUX_FRAME_WINDOW, channel->id, channel->recv_unacked);
+    channel->recv_unacked = 0;
+  }
+}
+
+static MuxChannel*
+mux_channel_new(Mux *mux, guint16 id) {
+  MuxChannel *channel = g_new0(MuxChannel, 1);
+
+  channel->mux = mux;
+  channel->id = id;
+  channel->fd = -1;
+  channel->send_credit = MUX_WINDOW_SIZE;
+  g_hash_table_insert(mux->channels, GUINT_TO_POINTER(id), channel);
+
+  return channel;
+}
+
+static void
+mux_channel_attach(MuxChannel *channel, GSocketConnection *conn) {
+  channel->conn = conn;
+  channel->fd = g_socket_get_fd(g_socket_connection_get_socket(conn));
+  // the window is only granted back once written, so this never grows
+  channel->output = outq_new(channel->fd, MUX_WINDOW_SIZE, mux_channel_written, channel);
+  if(mux_channel_readable(channel))
+    mux_channel_watch(channel);
+
+  if(channel->early != NULL) {
+    GByteArray *early = channel->early;
+
+    channel->early = NULL;
+    if(!outq_write(channel->output, (gchar*) early->data, early->len)) {
+      g_byte_array_unref(early);
+      mux_channel_reset(channel);
+      return;
+    }
+    g_byte_array_unref(early);
+  }
+
+  mux_channel_finish(channel);
+}
+
+static void
+mux_wait_for_drain(Mux *mux) {
+  if(mux->waiting)
+    return;
+  mux->waiting = TRUE;
+  sendq_on_drain(mux->session, mux_resume_channels, mux);
+}
+
+static gboolean
+mux_resume_channels(gpointer mux_ptr) {
+  Mux *mux = mux_ptr;
+  GHashTableIter iter;
+  gpointer channel_ptr;
+
+  mux->waiting = FALSE;
+
+  g_hash_table_iter_init(&iter, mux->channels);
+  while(g_hash_table_iter_next(&iter, NULL, &channel_ptr)) {
+    MuxChannel *channel = channel_ptr;
+    if(mux_channel_readable(channel))
+      mux_channel_watch(channel);
+  }
+
+  return FALSE;
+}
+
+static gboolean
+mux_channel_read(GIOChannel *source, GIOCondition cond, gpointer channel_ptr) {
+  static gchar frame[MUX_HEADER_SIZE + MUX_MAX_PAYLOAD];
+  MuxChannel *channel = channel_ptr;
+  gssize res;
+
+  do {
+    res = read(channel->fd, frame + MUX_HEADER_SIZE,
+      MIN(channel->send_credit, MUX_MAX_PAYLOAD));
+
+    if(res > 0) {
+      mux_write_header(frame, MUX_FRAME_DATA, channel->id, res);
+      mux_send_frame(channel->mux, frame, res);
+      channel->send_credit -= res;
+    }
+    else if(res == 0) {
+      // the local side shut down writing, it may still read the answer
+      g_debug("mux: channel %u closed locally\n", channel->id);
+      mux_send_control(channel->mux, MUX_FRAME_CLOSE, channel->id, 0);
+      channel->local_closed = TRUE;
+      channel->watch_id = 0;
+      mux_channel_finish(channel);
+      return FALSE;
+    }
+    else if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+      g_debug("mux: reading channel %u failed, errno=%i\n", channel->id, errno);
+      channel->watch_id = 0;
+      mux_channel_reset(channel);
+      return FALSE;
+    }
+    else
+      break;
+
+    if(sendq_full(channel->mux->session)) {
+      // stop reading until the agent accepted the queued data
+      mux_wait_for_drain(channel->mux);
+      channel->watch_id = 0;
+      return FALSE;
+    }
+  }
+  while(channel->send_credit > 0);
+
+  if(channel->send_credit == 0) {
+    // stop reading until the peer grants more window
+    g_debug("mux: channel %u window exhausted\n", channel->id);
+    channel->watch_id = 0;
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+static void
+mux_channel_connected(GObject *client, GAsyncResult *result, gpointer channel_ptr) {
+  MuxChannel *channel = channel_ptr;
+  GError *error = NULL;
+  GSocketConnection *conn;
+
+  conn = g_socket_client_connect_to_host_finish(G_SOCKET_CLIENT(client), result, &error);
+  g_object_unref(channel->connecting);
+  channel->connecting = NULL;
+
+  if(channel->abandoned) {
+    if(conn != NULL)
+      g_object_unref(conn);
+    if(error != NULL)
+      g_error_free(error);
+    mux_channel_destroy(channel);
+    return;
+  }
+
+  if(error != NULL) {
+    g_critical("Error connecting to localhost:%i for channel %u! (%s)",
+                channel->mux->port, channel->id, error->message);
+    g_error_free(error);
+
+    mux_channel_reset(channel);
+    return;
+  }
+
+  mux_channel_attach(channel, conn);
+}
+
+// the peer's frames for the channel are kept until it is connected
+static void
+mux_handle_open(Mux *mux, guint16 id) {
+  GSocketClient* client = g_socket_client_new();
+  MuxChannel *channel = mux_channel_new(mux, id);
+
+  g_debug("mux: opening channel %u\n", id);
+  channel->connecting = g_cancellable_new();
+  g_socket_client_connect_to_host_async(client, "localhost", mux->port, channel->connecting,
+    mux_channel_connected, channel);
+  g_object_unref(client);
+}
+
+static void
+mux_handle_data(MuxChannel *channel, const gchar *payload, gsize len) {
+  if(channel->peer_closed)
+    return;
+
+  metrics.received_bytes += len;
+  metrics.received_messages++;
+
+  // bounded by the window
+  if(channel->output == NULL) {
+    if(channel->early == NULL)
+      channel->early = g_byte_array_new();
+    g_byte_array_append(channel->early, (guint8*) payload, len);
+    return;
+  }
+
+  if(!outq_write(channel->output, payload, len))
+    mux_channel_reset(channel);
+}
+
+static void
+mux_handle_close(MuxChannel *channel) {
+  g_debug("mux: channel %u closed by the peer\n", channel->id);
+  channel->peer_closed = TRUE;
+
+  // deliver what is still queued before shutting down writing
+  mux_channel_finish(channel);
+}
+
+static void
+mux_handle_window(MuxChannel *channel, guint32 credit) {
+  channel->send_credit += credit;
+
+  if(mux_channel_readable(channel) && !sendq_full(channel->mux->session))
+    mux_channel_watch(channel);
+}
+
+static void
+mux_handle_frame(Mux *mux, guint8 type, guint16 id, guint32 length, const gchar *payload) {
+  MuxChannel *channel = g_hash_table_lookup(mux->channels, GUINT_TO_POINTER(id));
+
+  if(type == MUX_FRAME_OPEN) {
+    if(channel != NULL) {
+      g_critical("mux: channel %u opened twice", id);
+      return;
+    }
+    mux_handle_open(mux, id);
+    return;
+  }
+
+  // frames for channels we already closed are dropped
+  if(channel == NULL)
+    return;
+
+  switch(type) {
+    case MUX_FRAME_DATA:
+      mux_handle_data(channel, payload, length);
+    break;
+    case MUX_FRAME_CLOSE:
+      mux_handle_close(channel);
+    break;
+    case MUX_FRAME_WINDOW:
+      mux_handle_window(channel, length);
+    break;
+    case MUX_FRAME_RESET:
+      g_debug("mux: channel %u reset by the peer\n", id);
+      mux_channel_remove(channel);
+    break;
+    default:
+      g_critical("mux: unknown frame type %u", type);
+  }
+}
+
+void
+mux_init(NiceSession *session, guint port) {
+  Mux *mux = g_new0(Mux, 1);
+
+  mux->session = session;
+  mux->port = port;
+  mux->channels = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, mux_channel_free);
+  mux->next_channel_id = 1;
+  mux->rx_buffer = g_byte_array_new();
+  session->mux = mux;
+}
+
+void
+mux_free(NiceSession *session) {
+  Mux *mux = session->mux;
+
+  if(mux == NULL)
+    return;
+
+  g_hash_table_destroy(mux->channels);
+  g_byte_array_unref(mux->rx_buffer);
+  g_free(mux);
+  session->mux = NULL;
+}
+
+void
+mux_open_channel(NiceSession *session, GSocketConnection *conn) {
+  Mux *mux = session->mux;
+  guint16 id = mux->next_channel_id;
+
+  // channel 0 is never used, skip ids that are still in use after wrapping
+  while(id == 0 || g_hash_table_contains(mux->channels, GUINT_TO_POINTER(id)))
+    id++;
+  mux->next_channel_id = id + 1;
+
+  g_debug("mux: new connection on channel %u\n", id);
+  mux_send_control(mux, MUX_FRAME_OPEN, id, 0);
+  mux_channel_attach(mux_channel_new(mux, id), conn);
+}
+
+void
+mux_recv(NiceAgent *agent, guint stream_id, guint component_id, guint len,
+    gchar *buf, gpointer data) {
+  NiceSession *session = data;
+  Mux *mux = session->mux;
+  GByteArray *rx_buffer = mux->rx_buffer;
+  gsize offset = 0;
+
+  if(!mux->unpublished) {
+    unpublish_local_credentials(session);
+    mux->unpublished = TRUE;
+  }
+
+  if(mux->rx_skip > 0) {
+    gsize skip = MIN(mux->rx_skip, len);
+
+    buf += skip;
+    len -= skip;
+    mux->rx_skip -= skip;
+  }
+  g_byte_array_append(rx_buffer, (guint8*) buf, len);
+
+  while(rx_buffer->len - offset >= MUX_HEADER_SIZE) {
+    gchar *frame = (gchar*) rx_buffer->data + offset;
+    guint16 id;
+    guint32 length;
+    gsize payload_len;
+
+    memcpy(&id, frame + 2, sizeof(id));
+    memcpy(&length, frame + 4, sizeof(length));
+    id = g_ntohs(id);
+    length = g_ntohl(length);
+
+    payload_len = (frame[0] == MUX_FRAME_DATA) ? length : 0;
+    if(payload_len > MUX_MAX_PAYLOAD) {
+      MuxChannel *channel = g_hash_table_lookup(mux->channels, GUINT_TO_POINTER(id));
+      gsize skip;
+
+      // the stream stays in sync, only this channel is lost
+      g_critical("mux: frame too large (%u bytes), resetting channel %u", length, id);
+      metrics.dropped++;
+      if(channel != NULL)
+        mux_channel_reset(channel);
+
+      offset += MUX_HEADER_SIZE;
+      skip = MIN(payload_len, rx_buffer->len - offset);
+      offset += skip;
+      mux->rx_skip = payload_len - skip;
+      continue;
+    }
+
+    // wait for the rest of the frame
+    if(rx_buffer->len - offset < MUX_HEADER_SIZE + payload_len)
+      break;
+
+    mux_handle_frame(mux, frame[0], id, length, frame + MUX_HEADER_SIZE);
+    offset += MUX_HEADER_SIZE + payload_len;
+  }
+
+  g_byte_array_remove_range(rx_buffer, 0, offset);
+}
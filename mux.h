@@ -0,0 +1,30 @@
+#ifndef __MUX_H__
+#define __MUX_H__
+
+#include <glib.h>
+#include <gio/gio.h>
+#include <agent.h>
+
+#include "session.h"
+
+// frame types of the multiplexing protocol
+enum {
+  MUX_FRAME_OPEN   = 1,
+  MUX_FRAME_DATA   = 2,
+  MUX_FRAME_CLOSE  = 3,   // no more data in this direction (half-close)
+  MUX_FRAME_WINDOW = 4,
+  MUX_FRAME_RESET  = 5    // the channel is gone, drop what is queued
+};
+
+// every frame starts with this header (all fields in network byte order)
+#define MUX_HEADER_SIZE 8
+
+// bytes a channel may have in flight before the peer has to grant more
+#define MUX_WINDOW_SIZE (256*1024)
+
+void mux_init(NiceSession *session, guint port);
+void mux_free(NiceSession *session);
+void mux_open_channel(NiceSession *session, GSocketConnection *conn);
+void mux_recv(NiceAgent *agent, guint stream_id, guint component_id, guint len, gchar *buf, gpointer data);
+
+#endif
@@ -4,11 +4,11 @@
 #include "global.h"
 
 NiceAgent*
-setup_libnice() {
+setup_libnice(guint *stream_id) {
   NiceAgent *agent;
 
-  // create new agent
-  if(not_reliable)
+  // create new agent; with -U a plain one, rudp.c makes the stream reliable
+  if(not_reliable || udp_transport)
     agent = nice_agent_new(g_main_loop_get_context(gloop),
       NICE_COMPATIBILITY_RFC5245);    
   else
@@ -19,16 +19,14 @@ setup_libnice() {
     exit(1);
   }
 
-  // setup STUN server
+  // setup STUN server, resolved once for all agents of a daemon
   if(stun_host != NULL) {
-    gchar* stun_addr;
+    static gchar* stun_addr = NULL;
 
-    if(resolve_hostname(stun_host, &stun_addr)) {
+    if(stun_addr != NULL || resolve_hostname(stun_host, &stun_addr)) {
       g_object_set(G_OBJECT(agent), "stun-server", stun_addr, NULL);
       g_object_set(G_OBJECT(agent), "stun-server-port", stun_port, NULL);
       g_debug("Using STUN server %s(%s):%i\n", stun_host, stun_addr, stun_port);
-
-      g_free(stun_addr);
     }
     else {
       g_critical("Error resolving stun hostname '%s'\n", stun_host);
@@ -38,16 +36,13 @@ setup_libnice() {
     }
   }
 
-  // setup who's caller and callee
-  if(is_caller)
-    g_debug("This instance is the caller\n");
-  else
-    g_debug("This instance is the callee\n");
-  g_object_set(G_OBJECT(agent), "controlling-mode", is_caller, NULL);
+  // remote candidates may arrive after the first checks failed, the agent
+  // only gives up once the peer sent its end-of-candidates
+  g_object_set(G_OBJECT(agent), "ice-trickle", TRUE, NULL);
 
   // add a communication stream
-  nice_stream_id = nice_agent_add_stream(agent, 1);
-  if (nice_stream_id == 0) {
+  *stream_id = nice_agent_add_stream(agent, n_components);
+  if (*stream_id == 0) {
     g_critical("Error adding NICE stream!\n");
     g_object_unref(agent);
 
@@ -1,3 +1,3 @@
 #include <agent.h>
 
-NiceAgent* setup_libnice();
+NiceAgent* setup_libnice(guint *stream_id);
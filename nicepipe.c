@@ -12,18 +12,50 @@
 #include "callbacks.h"
 #include "util.h"
 #include "nice.h"
+#include "batch.h"
+#include "zerocopy.h"
+#include "sendq.h"
+#include "exchange.h"
+#include "timing.h"
+#include "metrics.h"
+#include "resume.h"
+#include "reconnect.h"
+#include "dataplane.h"
+#include "compress.h"
+#include "fec.h"
+#include "rudp.h"
 
 guint stun_port = 3478;
 gchar* stun_host = NULL;
-gint* is_caller = NULL;
+static gint is_caller = 0;
 gboolean not_reliable = FALSE;
-gchar* remote_hostname = NULL;
+static gchar* remote_hostname = NULL;
+gboolean multiplex = FALSE;
+guint n_components = 1;
+guint batch_size = 1;
+gboolean use_tls = FALSE;
+gchar* tun_address = NULL;
+
+gchar* exchange_spec = "dummy";
+gchar* metrics_socket = NULL;
+gboolean resume_session = FALSE;
+gboolean auto_reconnect = FALSE;
+gboolean threaded = FALSE;
+gboolean use_compression = FALSE;
+gchar* fec_spec = NULL;
+gboolean udp_transport = FALSE;
+guint transport_window = RUDP_DEFAULT_WINDOW;
 
 gint max_size = 8;
 gboolean verbose = FALSE;
 gboolean beep = FALSE;
+gboolean zero_copy = FALSE;
 GOptionEntry all_options[] =
 {
+  { "hostname", 'H', 0, G_OPTION_ARG_STRING, &remote_hostname,
+    "remote hostname (as mentioned in $HOME/.ssh/known_hosts", NULL },
+  { "exchange", 'e', 0, G_OPTION_ARG_STRING, &exchange_spec,
+    "exchange provider, optionally with options (options@provider, default: dummy)", "e" },
   { "stun_port", 'p', 0, G_OPTION_ARG_INT, &stun_port,
     "STUN server port (default: 3478)", "p" },
   { "stun_host", 's', 0, G_OPTION_ARG_STRING, &stun_host,
@@ -32,6 +64,26 @@ GOptionEntry all_options[] =
     "1: is caller, 0 if not", "c" },
   { "not-reliable", 'u', 0, G_OPTION_ARG_INT, &not_reliable,
     "do not use pseudo TCP connection", "NULL" },
+  { "batch", 'b', 0, G_OPTION_ARG_INT, &batch_size,
+    "with -u: move up to b datagrams per syscall (default: 1)", "b" },
+  { "compress", 'Z', 0, G_OPTION_ARG_NONE, &use_compression,
+    "compress with LZ4 if the peer does as well, incompressible blocks are sent as they are", NULL },
+  { "fec", 'F', 0, G_OPTION_ARG_STRING, &fec_spec,
+    "with -u: send m parity datagrams per k datagrams, m adapting to the loss with k:auto (both peers)", "k:m" },
+  { "udp-transport", 'U', 0, G_OPTION_ARG_NONE, &udp_transport,
+    "reliable transport with selective ACKs and BBR congestion control over datagrams instead of pseudo TCP (both peers)", NULL },
+  { "window", 'w', 0, G_OPTION_ARG_INT, &transport_window,
+    "with -U: receive and send window in KB (default: 32768)", "KB" },
+  { "zero-copy", 'z', 0, G_OPTION_ARG_NONE, &zero_copy,
+    "splice received data into stdout if it is a pipe", NULL },
+  { "metrics", 'M', 0, G_OPTION_ARG_STRING, &metrics_socket,
+    "serve metrics in Prometheus text format at this Unix socket (also dumped to stderr on SIGUSR1)", "path" },
+  { "resume", 'R', 0, G_OPTION_ARG_NONE, &resume_session,
+    "try the pair cached from the last session with this host first (both peers)", NULL },
+  { "reconnect", 'r', 0, G_OPTION_ARG_NONE, &auto_reconnect,
+    "restart ICE when the connection fails instead of exiting (both peers)", NULL },
+  { "threads", 'x', 0, G_OPTION_ARG_NONE, &threaded,
+    "read stdin and write stdout in threads of their own, apart from the agent", NULL },
   { NULL }
 };
 
@@ -40,51 +92,103 @@ GOptionEntry all_options[] =
 GMainLoop *gloop;
 GTimer* keepalive_timer = NULL;
 
-guint output_fd;
-guint nice_stream_id;
-
 void parse_argv(int argc, char *argv[]);
 void setup_glib();
-NiceAgent* setup_libnice();
 
 int
 main(int argc, char *argv[]) {
+  timing_init();
   parse_argv(argc, argv);
-  g_log_set_handler(G_LOG_DOMAIN, G_LOG_LEVEL_DEBUG, log_stderr, NULL);
+  g_log_set_handler(G_LOG_DOMAIN, G_LOG_LEVEL_DEBUG, log_stderr, GINT_TO_POINTER(is_caller));
 
   setup_glib();
-  
+  metrics_init(metrics_socket);
+  exchange_init(exchange_spec);
+
   NiceAgent *agent;
-  agent = setup_libnice();
+  NiceSession *session;
+  guint stream_id;
+  agent = setup_libnice(&stream_id);
+  session = session_new(agent, stream_id, remote_hostname, is_caller, 0, NULL);
   keepalive_timer = g_timer_new();
   g_timer_stop(keepalive_timer);
 
   // Connect to signals
-  g_signal_connect(G_OBJECT(agent), "candidate-gathering-done", G_CALLBACK(exchange_credentials), NULL);
+  timing_attach(session);
+  metrics_attach(session);
+  g_signal_connect(G_OBJECT(agent), "candidate-gathering-done", G_CALLBACK(exchange_credentials), session);
+  g_signal_connect(G_OBJECT(agent), "new-candidate-full", G_CALLBACK(new_candidate_gathered), session);
 
   if(not_reliable)
-    g_signal_connect(G_OBJECT(agent), "component-state-changed",  G_CALLBACK(attach_stdin2send_callback), keepalive_timer);
+    g_signal_connect(G_OBJECT(agent), "component-state-changed",  G_CALLBACK(attach_stdin2send_callback), session);
+  else
+    g_signal_connect(G_OBJECT(agent), "reliable-transport-writable",  G_CALLBACK(attach_stdin2send_callback_reliable), session);
+
+  sendq_init(session);
+  if(udp_transport)
+    rudp_init(session);
+
+  session->output_fd = 1;
+  if(threaded)
+    dataplane_init(session);
+
+  NiceAgentRecvFunc recv_func = recv_data2fd;
+  if(use_compression) {
+    compress_init(session, recv_func);
+    recv_func = compress_recv;
+  }
+  if(auto_reconnect)
+    reconnect_init(session, not_reliable ? NULL : recv_func);
+  if(fec_spec != NULL) {
+    fec_init(session, recv_func);
+    recv_func = fec_recv;
+  }
+
+  if(zero_copy && !not_reliable && zerocopy_init(session->output_fd))
+    zerocopy_attach(session);
+  else if(not_reliable && batch_size > 1) {
+    batch_init(session);
+    attach_recv_callbacks(session, batch_recv);
+  }
+  else if(auto_reconnect && !not_reliable)
+    attach_recv_callbacks(session, reconnect_recv);
   else
-    g_signal_connect(G_OBJECT(agent), "reliable-transport-writable",  G_CALLBACK(attach_stdin2send_callback_reliable), keepalive_timer);
+    attach_recv_callbacks(session, recv_func);
+
+  if(resume_session)
+    resume_init(session);
 
-  output_fd = 1;
-  nice_agent_attach_recv(agent, nice_stream_id, 1, g_main_loop_get_context(gloop), recv_data2fd, keepalive_timer);
+  // the remote peer's data does not depend on ours, so look it up while
+  // gathering instead of afterwards
+  lookup_remote_credentials(session);
 
   g_debug("Starting to gather candidates...\n");
-  if (!nice_agent_gather_candidates(agent, nice_stream_id)) {
+  timing_mark(TIMING_GATHER_START);
+  if (!nice_agent_gather_candidates(agent, session->stream_id)) {
     g_critical("Failed to start candidate gathering\n");
     
     g_main_loop_unref(gloop);
-    g_object_unref(agent);
+    session_free(session);
 
     exit(1);
   }
 
   // run async task using main loop
   g_main_loop_run(gloop);
+  timing_report();
+  metrics_shutdown();
+
+  if(not_reliable && batch_size > 1)
+    batch_report();
+  if(use_compression)
+    compress_report();
+  if(fec_spec != NULL)
+    fec_report();
+  if(udp_transport)
+    rudp_report();
 
+  session_free_all();
   g_main_loop_unref(gloop);
-  g_object_unref(agent);
 
   return EXIT_SUCCESS;
 }
@@ -108,6 +212,52 @@ parse_argv(int argc, char *argv[]) {
     exit(1);
   }
 
+  if(zero_copy && auto_reconnect) {
+    g_critical("Zero copy cannot be combined with reconnecting!");
+    exit(1);
+  }
+
+  if(batch_size < 1 || batch_size > BATCH_MAX) {
+    g_critical("Batch size must be between 1 and %i!", BATCH_MAX);
+    exit(1);
+  }
+
+  // the cached pair may be used before the peer's offer arrived
+  if(use_compression && (zero_copy || batch_size > 1 || resume_session)) {
+    g_critical("Compression cannot be combined with -z, -b or -R!");
+    exit(1);
+  }
+
+  if(fec_spec != NULL && !not_reliable) {
+    g_critical("Forward error correction requires -u!");
+    exit(1);
+  }
+
+  if(fec_spec != NULL && !fec_parse(fec_spec)) {
+    g_critical("FEC must be k:m or k:auto with k between 1 and %i and m up to %i!", FEC_MAX_DATA, FEC_MAX_PARITY);
+    exit(1);
+  }
+
+  if(fec_spec != NULL && batch_size > 1) {
+    g_critical("Forward error correction cannot be combined with -b!");
+    exit(1);
+  }
+
+  if(udp_transport && (not_reliable || auto_reconnect || zero_copy)) {
+    g_critical("The UDP transport cannot be combined with -u, -r or -z!");
+    exit(1);
+  }
+
+  if(transport_window < 64) {
+    g_critical("The window must be at least 64 KB!");
+    exit(1);
+  }
+
+  if(threaded && (zero_copy || batch_size > 1)) {
+    g_critical("The threaded data plane cannot be combined with -z or -b!");
+    exit(1);
+  }
+
   g_option_context_free(context);
 }
 
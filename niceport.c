@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
+#include <unistd.h>
 
 #include <glib.h>
 #include <gio/gio.h>
@@ -12,14 +13,51 @@
 #include "callbacks.h"
 #include "util.h"
 #include "nice.h"
+#include "batch.h"
+#include "mux.h"
+#include "stripe.h"
+#include "sendq.h"
+#include "exchange.h"
+#include "timing.h"
+#include "metrics.h"
+#include "resume.h"
+#include "reconnect.h"
+#include "tls.h"
+#include "tun.h"
+#include "coalesce.h"
+#include "daemon.h"
+#include "session.h"
+#include "dataplane.h"
+#include "compress.h"
+#include "fec.h"
+#include "rudp.h"
 
 guint forward_port = 1500;
 guint stun_port = 3478;
 gchar* stun_host = NULL;
-gchar* remote_hostname = NULL;
-gint* is_caller = NULL;
+static gchar* remote_hostname = NULL;
+static gint is_caller = 0;
 gboolean not_reliable = FALSE;
 gboolean verbose = TRUE;
+gboolean multiplex = FALSE;
+guint n_components = 1;
+guint batch_size = 1;
+gboolean use_tls = FALSE;
+gchar* tun_address = NULL;
+guint coalesce_delay = COALESCE_DEFAULT_DELAY_US;
+
+gchar* exchange_spec = "dummy";
+gchar* metrics_socket = NULL;
+gboolean resume_session = FALSE;
+gboolean auto_reconnect = FALSE;
+gchar* daemon_socket = NULL;
+guint pool_size = DAEMON_DEFAULT_POOL_SIZE;
+gchar* peers_file = NULL;
+gboolean threaded = FALSE;
+gboolean use_compression = FALSE;
+gchar* fec_spec = NULL;
+gboolean udp_transport = FALSE;
+guint transport_window = RUDP_DEFAULT_WINDOW;
 
 gint max_size = 8;
 gboolean beep = FALSE;
@@ -29,6 +67,8 @@ GOptionEntry all_options[] =
     "Port to listen at (for caller) or to forward to (for callee)", NULL },
   { "hostname", 'H', 0, G_OPTION_ARG_STRING, &remote_hostname,
     "remote hostname (as mentioned in $HOME/.ssh/known_hosts", NULL },
+  { "exchange", 'e', 0, G_OPTION_ARG_STRING, &exchange_spec,
+    "exchange provider, optionally with options (options@provider, default: dummy)", "e" },
   { "stun_port", 'p', 0, G_OPTION_ARG_INT, &stun_port,
     "STUN server port (default: 3478)", "p" },
   { "stun_host", 's', 0, G_OPTION_ARG_STRING, &stun_host,
@@ -37,8 +77,42 @@ GOptionEntry all_options[] =
     "c=1: is caller, c=0 if not", "c" },
   { "not-reliable", 'u', 0, G_OPTION_ARG_NONE, &not_reliable,
     "do not use pseudo TCP connection", NULL },
+  { "batch", 'b', 0, G_OPTION_ARG_INT, &batch_size,
+    "with -u: move up to b datagrams per syscall (default: 1)", "b" },
+  { "tls", 't', 0, G_OPTION_ARG_NONE, &use_tls,
+    "encrypt with TLS (DTLS with -u) using ~/.ssh/id_rsa, $NICE_LOCAL_CRT and $NICE_REMOTE_CRT", NULL },
+  { "compress", 'Z', 0, G_OPTION_ARG_NONE, &use_compression,
+    "compress with LZ4 if the peer does as well, incompressible blocks are sent as they are", NULL },
+  { "fec", 'F', 0, G_OPTION_ARG_STRING, &fec_spec,
+    "with -u: send m parity datagrams per k datagrams, m adapting to the loss with k:auto (both peers)", "k:m" },
+  { "udp-transport", 'U', 0, G_OPTION_ARG_NONE, &udp_transport,
+    "reliable transport with selective ACKs and BBR congestion control over datagrams instead of pseudo TCP (both peers)", NULL },
+  { "window", 'w', 0, G_OPTION_ARG_INT, &transport_window,
+    "with -U: receive and send window in KB (default: 32768)", "KB" },
+  { "tun", 'T', 0, G_OPTION_ARG_STRING, &tun_address,
+    "forward IP packets of a new tun device with these addresses (e.g. 10.0.1.2/24,fd00:1::2/64)", "a" },
+  { "coalesce", 'C', 0, G_OPTION_ARG_INT, &coalesce_delay,
+    "without -u: hold tun packets up to C microseconds to send them together (default: 200)", "C" },
   { "verbose", 'v', 0, G_OPTION_ARG_NONE, &verbose,
     "Be verbose", NULL },
+  { "multiplex", 'm', 0, G_OPTION_ARG_NONE, &multiplex,
+    "forward many concurrent connections over one ICE session (both peers)", NULL },
+  { "components", 'k', 0, G_OPTION_ARG_INT, &n_components,
+    "stripe traffic across k ICE components (both peers, default: 1)", "k" },
+  { "metrics", 'M', 0, G_OPTION_ARG_STRING, &metrics_socket,
+    "serve metrics in Prometheus text format at this Unix socket (also dumped to stderr on SIGUSR1)", "path" },
+  { "resume", 'R', 0, G_OPTION_ARG_NONE, &resume_session,
+    "try the pair cached from the last session with this host first (both peers)", NULL },
+  { "reconnect", 'r', 0, G_OPTION_ARG_NONE, &auto_reconnect,
+    "restart ICE when the connection fails instead of exiting (both peers)", NULL },
+  { "daemon", 'D', 0, G_OPTION_ARG_STRING, &daemon_socket,
+    "keep agents gathered in advance and start sessions on requests at this Unix socket", "path" },
+  { "warm", 'W', 0, G_OPTION_ARG_INT, &pool_size,
+    "with -D: number of agents kept gathered (default: 2)", "n" },
+  { "threads", 'x', 0, G_OPTION_ARG_NONE, &threaded,
+    "read and write the local connection in threads of their own, apart from the agent", NULL },
+  { "peers", 'N', 0, G_OPTION_ARG_STRING, &peers_file,
+    "connect to every peer in this file at once, one '<hostname> <port> [exchange options]' per line", "file" },
   { NULL }
 };
 
@@ -46,67 +120,231 @@ GOptionEntry all_options[] =
 
 GMainLoop *gloop;
 
-guint output_fd;
-guint nice_stream_id;
-
 void parse_argv(int argc, char *argv[]);
 void setup_glib();
-NiceAgent* setup_libnice();
-GSocketService* setup_server(NiceAgent* agent);
-GSocketClient* setup_client(NiceAgent* agent);
+GSocketService* setup_server(NiceSession *session);
+void setup_client(NiceSession *session);
 gboolean handle_incoming_connection(GSocketService *service, GSocketConnection *conn, GObject *source_object, gpointer user_data);
 
-int
-main(int argc, char *argv[]) {
-  parse_argv(argc, argv);
-  g_log_set_handler(G_LOG_DOMAIN, G_LOG_LEVEL_DEBUG, log_stderr, NULL);
+// everything up to gathering, for a new agent or one of the daemon's
+static NiceSession*
+start_session_with(NiceAgent *agent, guint stream_id, const gchar *hostname, gint caller,
+    guint port, gboolean gathered, const gchar *exchange_options) {
+  NiceSession *session = session_new(agent, stream_id, hostname, caller, port, exchange_options);
 
-  setup_glib();
-  
-  NiceAgent *agent;
-  agent = setup_libnice();
-
-  // Connect to signals
-  g_signal_connect(G_OBJECT(agent), "candidate-gathering-done", G_CALLBACK(exchange_credentials), NULL);
-
-  if(is_caller) {
-    GSocketService* server;
-    server = setup_server(agent);
-  
-    if(not_reliable)
-      g_signal_connect(G_OBJECT(agent), "component-state-changed",  G_CALLBACK(start_server), server);
-    else
-      g_signal_connect(G_OBJECT(agent), "reliable-transport-writable",  G_CALLBACK(start_server_reliable), server);
+  // Connect to signals; one session per process reports its timing and gauges
+  if(peers_file == NULL && daemon_socket == NULL) {
+    timing_attach(session);
+    metrics_attach(session);
   }
-  else {
-    if(not_reliable)
-      g_signal_connect(G_OBJECT(agent), "component-state-changed",  G_CALLBACK(start_server), NULL);
-    else
-      g_signal_connect(G_OBJECT(agent), "reliable-transport-writable",  G_CALLBACK(start_server_reliable), NULL);
+  g_signal_connect(G_OBJECT(agent), "candidate-gathering-done", G_CALLBACK(exchange_credentials), session);
+  g_signal_connect(G_OBJECT(agent), "new-candidate-full", G_CALLBACK(new_candidate_gathered), session);
+
+  if(tun_address != NULL)
+    session->output_fd = tun_open(session, tun_address);
+
+  if(caller && tun_address == NULL)
+    session->server = setup_server(session);
+
+  if(not_reliable)
+    g_signal_connect(G_OBJECT(agent), "component-state-changed",  G_CALLBACK(start_server), session);
+  else
+    g_signal_connect(G_OBJECT(agent), "reliable-transport-writable",  G_CALLBACK(start_server_reliable), session);
+
+  sendq_init(session);
+  if(udp_transport)
+    rudp_init(session);
+  if(threaded)
+    dataplane_init(session);
+
+  NiceAgentRecvFunc recv_func = recv_data2fd;
+  if(tun_address != NULL)
+    recv_func = tun_recv;
+  if(tun_address != NULL && !not_reliable) {
+    coalesce_init(session, coalesce_delay, recv_func);
+    recv_func = coalesce_recv;
+  }
+  if(not_reliable && batch_size > 1) {
+    batch_init(session);
+    recv_func = batch_recv;
+  }
+  if(multiplex) {
+    mux_init(session, port);
+    recv_func = mux_recv;
   }
 
-  nice_agent_attach_recv(agent, nice_stream_id, 1, g_main_loop_get_context(gloop), recv_data2fd, NULL);
+  if(use_compression) {
+    compress_init(session, recv_func);
+    recv_func = compress_recv;
+  }
+
+  if(use_tls) {
+    tls_init(session, recv_func);
+    recv_func = tls_recv;
+  }
+
+  if(auto_reconnect) {
+    reconnect_init(session, not_reliable ? NULL : recv_func);
+    if(!not_reliable)
+      recv_func = reconnect_recv;
+  }
+
+  if(fec_spec != NULL) {
+    fec_init(session, recv_func);
+    recv_func = fec_recv;
+  }
+
+  if(n_components > 1) {
+    stripe_init(session, recv_func);
+    recv_func = stripe_recv;
+  }
+  attach_recv_callbacks(session, recv_func);
 
-  g_debug("Starting to gather candidates...\n");
-  if (!nice_agent_gather_candidates(agent, nice_stream_id)) {
+  if(resume_session)
+    resume_init(session);
+
+  // the remote peer's data does not depend on ours, so look it up while
+  // gathering instead of afterwards
+  lookup_remote_credentials(session);
+
+  // a warm agent of the daemon: publish right away
+  if(gathered)
+    exchange_credentials(agent, stream_id, session);
+
+  return session;
+}
+
+void
+start_session(NiceAgent *agent, guint stream_id, const gchar *hostname, gint caller,
+    guint port, gboolean gathered) {
+  start_session_with(agent, stream_id, hostname, caller, port, gathered, NULL);
+}
+
+static void
+gather_or_exit(NiceSession *session) {
+  g_debug("Starting to gather candidates for %s...\n", session->remote_hostname);
+  timing_mark(TIMING_GATHER_START);
+  if (!nice_agent_gather_candidates(session->agent, session->stream_id)) {
     g_critical("Failed to start candidate gathering\n");
-    
+
     g_main_loop_unref(gloop);
-    g_object_unref(agent);
+    session_free_all();
 
     exit(1);
   }
+}
+
+static gsize
+resident_bytes() {
+  gsize size = 0, resident = 0;
+  FILE *statm = fopen("/proc/self/statm", "r");
+
+  if(statm == NULL)
+    return 0;
+  if(fscanf(statm, "%zu %zu", &size, &resident) != 2)
+    resident = 0;
+  fclose(statm);
+
+  return resident * sysconf(_SC_PAGESIZE);
+}
+
+// Hub mode: one session per line of the peers file, all driven by this
+// process' main loop with the role given with -c.
+static void
+start_hub(const gchar *filename) {
+  gchar *contents = NULL;
+  gchar **lines;
+  gsize before = resident_bytes(), after;
+  guint i, started = 0;
+  GError *error = NULL;
+
+  if(!g_file_get_contents(filename, &contents, NULL, &error)) {
+    g_critical("Cannot read the peers file: %s", error->message);
+    exit(1);
+  }
+
+  lines = g_strsplit(contents, "\n", 0);
+  for(i = 0; lines[i] != NULL; i++) {
+    gchar **fields = g_strsplit_set(g_strstrip(lines[i]), " \t", 3);
+    NiceAgent *agent;
+    guint stream_id;
+
+    if(fields[0] == NULL || *fields[0] == '\0' || *fields[0] == '#') {
+      g_strfreev(fields);
+      continue;
+    }
+    if(fields[1] == NULL) {
+      g_critical("%s:%u: expected '<hostname> <port> [exchange options]'", filename, i + 1);
+      exit(1);
+    }
+
+    agent = setup_libnice(&stream_id);
+    gather_or_exit(start_session_with(agent, stream_id, fields[0], is_caller,
+      atoi(fields[1]), FALSE, fields[2]));
+    started++;
+    g_strfreev(fields);
+  }
+  g_strfreev(lines);
+  g_free(contents);
+
+  if(started == 0) {
+    g_critical("No peers in %s!", filename);
+    exit(1);
+  }
+
+  // the agents' sockets and the exchange state; the read buffers are shared
+  after = resident_bytes();
+  g_message("%u sessions, about %zu KB each.\n", started,
+    (after - MIN(before, after)) / 1024 / started);
+}
+
+int
+main(int argc, char *argv[]) {
+  timing_init();
+  parse_argv(argc, argv);
+  g_log_set_handler(G_LOG_DOMAIN, G_LOG_LEVEL_DEBUG, log_stderr, GINT_TO_POINTER(is_caller));
+
+  setup_glib();
+  metrics_init(metrics_socket);
+  exchange_init(exchange_spec);
+
+  if(daemon_socket != NULL)
+    daemon_init(daemon_socket, pool_size, start_session);
+  else if(peers_file != NULL)
+    start_hub(peers_file);
+  else {
+    NiceAgent *agent;
+    guint stream_id;
+    agent = setup_libnice(&stream_id);
+    gather_or_exit(start_session_with(agent, stream_id, remote_hostname, is_caller,
+      forward_port, FALSE, NULL));
+  }
 
   // run async task using main loop
   g_main_loop_run(gloop);
-
-  g_object_unref(agent);
+  metrics_shutdown();
+
+  if(session_count() > 0) {
+    timing_report();
+
+    if(not_reliable && batch_size > 1)
+      batch_report();
+    if(tun_address != NULL && !not_reliable)
+      coalesce_report();
+    if(use_compression)
+      compress_report();
+    if(fec_spec != NULL)
+      fec_report();
+    if(udp_transport)
+      rudp_report();
+
+    session_free_all();
+  }
   g_main_loop_unref(gloop);
 
   return EXIT_SUCCESS;
 }
 
-
 void
 parse_argv(int argc, char *argv[]) {
   GOptionContext *context;
@@ -120,11 +358,105 @@ parse_argv(int argc, char *argv[]) {
     exit(1);
   }
 
-  if(remote_hostname == NULL) {
+  if(remote_hostname == NULL && daemon_socket == NULL && peers_file == NULL) {
     g_critical("No remote hostname given! (Please use -h)");
     exit(1);
   }
 
+  if(multiplex && not_reliable) {
+    g_critical("Multiplexing requires a reliable connection! (Please do not use -u)");
+    exit(1);
+  }
+
+  if(n_components < 1 || n_components > 16) {
+    g_critical("Number of components must be between 1 and 16!");
+    exit(1);
+  }
+
+  if(n_components > 1 && not_reliable) {
+    g_critical("Striping requires a reliable connection! (Please do not use -u)");
+    exit(1);
+  }
+
+  if(batch_size < 1 || batch_size > BATCH_MAX) {
+    g_critical("Batch size must be between 1 and %i!", BATCH_MAX);
+    exit(1);
+  }
+
+  if(tun_address != NULL && multiplex) {
+    g_critical("The tun device cannot be combined with multiplexing!");
+    exit(1);
+  }
+
+  if(batch_size > 1 && use_tls) {
+    g_critical("Batching cannot be combined with TLS!");
+    exit(1);
+  }
+
+  // the pooled agents have gathered already, there is no cached pair to use
+  if(daemon_socket != NULL && (resume_session || metrics_socket != NULL)) {
+    g_critical("The daemon cannot be combined with -R or -M!");
+    exit(1);
+  }
+
+  if(daemon_socket != NULL && pool_size < 1) {
+    g_critical("The daemon needs at least one warm agent! (Please use -W 1 or more)");
+    exit(1);
+  }
+
+  if(peers_file != NULL && daemon_socket != NULL) {
+    g_critical("Many peers cannot be combined with the daemon!");
+    exit(1);
+  }
+
+  // the gauges and timing are only tracked for a single session
+  if(peers_file != NULL && metrics_socket != NULL) {
+    g_critical("Many peers cannot be combined with -M!");
+    exit(1);
+  }
+
+  // there is a single tun address for all the sessions of the process
+  if((peers_file != NULL || daemon_socket != NULL) && tun_address != NULL) {
+    g_critical("Many peers and the daemon cannot be combined with -T!");
+    exit(1);
+  }
+
+  // the cached pair may be used before the peer's offer arrived
+  if(use_compression && (batch_size > 1 || resume_session)) {
+    g_critical("Compression cannot be combined with -b or -R!");
+    exit(1);
+  }
+
+  if(fec_spec != NULL && !not_reliable) {
+    g_critical("Forward error correction requires -u!");
+    exit(1);
+  }
+
+  if(fec_spec != NULL && !fec_parse(fec_spec)) {
+    g_critical("FEC must be k:m or k:auto with k between 1 and %i and m up to %i!", FEC_MAX_DATA, FEC_MAX_PARITY);
+    exit(1);
+  }
+
+  if(fec_spec != NULL && batch_size > 1) {
+    g_critical("Forward error correction cannot be combined with -b!");
+    exit(1);
+  }
+
+  if(udp_transport && (not_reliable || auto_reconnect || n_components > 1)) {
+    g_critical("The UDP transport cannot be combined with -u, -r or -k!");
+    exit(1);
+  }
+
+  if(transport_window < 64) {
+    g_critical("The window must be at least 64 KB!");
+    exit(1);
+  }
+
+  if(threaded && (multiplex || tun_address != NULL || batch_size > 1)) {
+    g_critical("The threaded data plane cannot be combined with -m, -T or -b!");
+    exit(1);
+  }
+
   g_option_context_free(context);
 }
 
@@ -137,73 +469,105 @@ setup_glib() {
 }
 
 GSocketService*
-setup_server(NiceAgent* agent) {
+setup_server(NiceSession *session) {
   GError* error = NULL;
   GSocketService* server = g_socket_service_new();
 
   g_socket_listener_add_inet_port((GSocketListener*)server,
-                                  forward_port,
+                                  session->forward_port,
                                   NULL,
                                   &error);
   if(error != NULL) {
     g_critical("Error starting to listen on port %i! (%s)",
-                forward_port, error->message);
+                session->forward_port, error->message);
     g_error_free(error);
-    g_object_unref(agent);
     g_object_unref(server);
-    g_main_loop_unref(gloop);
-   
-   exit(1);
+    session_end(session);
+    return NULL;
   }
 
-  g_signal_connect(server, "incoming", G_CALLBACK(handle_incoming_connection), agent);
+  g_signal_connect(server, "incoming", G_CALLBACK(handle_incoming_connection), session);
   return server;
 }
 
 
 gboolean
 handle_incoming_connection(GSocketService *service, GSocketConnection *conn,
-    GObject *source_object, gpointer agent_ptr) {
+    GObject *source_object, gpointer session_ptr) {
   g_debug("New connection\n");
   g_object_ref(conn);
 
-  NiceAgent *agent = agent_ptr;
+  NiceSession *session = session_ptr;
+
+  if(multiplex) {
+    mux_open_channel(session, conn);
+    return TRUE;
+  }
 
+  session->connection = conn;
   GSocket *socket = g_socket_connection_get_socket(conn);
-  output_fd = g_socket_get_fd(socket);
-  GIOChannel* server_channel = g_io_channel_unix_new(output_fd);
-  g_io_add_watch(server_channel, G_IO_IN, send_data, agent);
+  session->output_fd = g_socket_get_fd(socket);
+  if(threaded) {
+    dataplane_start(session, session->output_fd, session->output_fd);
+    return FALSE;
+  }
+
+  GIOChannel* server_channel = g_io_channel_unix_new(session->output_fd);
+  g_io_add_watch(server_channel, G_IO_IN, send_data, session);
 
   return FALSE; // only allow one connection
 }
 
 
-GSocketClient*
-setup_client(NiceAgent* agent) {
-  g_debug("setup_client()\n");
-  GError* error = NULL;
-  GSocketClient* client = g_socket_client_new();
-
+static void
+client_connected(GObject *client, GAsyncResult *result, gpointer session_ptr) {
+  NiceSession *session = session_ptr;
+  GError *error = NULL;
   GSocketConnection *conn;
-  conn = g_socket_client_connect_to_host(client,
-    "localhost", forward_port, NULL, &error);
+
+  conn = g_socket_client_connect_to_host_finish(G_SOCKET_CLIENT(client), result, &error);
+
+  // the session was freed meanwhile
+  if(g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+    g_error_free(error);
+    return;
+  }
+  g_object_unref(session->connecting);
+  session->connecting = NULL;
 
   if(error != NULL) {
     g_critical("Error starting to connecting on service localhost:%i! (%s)",
-                forward_port, error->message);
+                session->forward_port, error->message);
     g_error_free(error);
-    g_object_unref(agent);
-    g_object_unref(client);
-    g_main_loop_unref(gloop);
-   
-   exit(1);
+    session_end(session);
+    return;
   }
 
+  session->connection = conn;
   GSocket *socket = g_socket_connection_get_socket(conn);
-  output_fd = g_socket_get_fd(socket);
+  session->output_fd = g_socket_get_fd(socket);
+  resume_receiving(session);
+  if(threaded) {
+    dataplane_start(session, session->output_fd, session->output_fd);
+    return;
+  }
+
+  GIOChannel* channel = g_io_channel_unix_new(session->output_fd);
+  g_io_add_watch(channel, G_IO_IN, send_data, session);
+}
+
+// without blocking the main loop, the other sessions keep going meanwhile
+void
+setup_client(NiceSession *session) {
+  g_debug("setup_client()\n");
+  GSocketClient* client = g_socket_client_new();
+
+  // the peer's data waits in the agent until there is somewhere to write it
+  pause_receiving(session);
 
-  GIOChannel* channel = g_io_channel_unix_new(output_fd);
-  g_io_add_watch(channel, G_IO_IN, send_data, agent);
-  return client;
+  session->connecting = g_cancellable_new();
+  g_socket_client_connect_to_host_async(client, "localhost", session->forward_port,
+    session->connecting, client_connected, session);
+  g_object_unref(client);
 }
 
@@ -0,0 +1,229 @@
+#include <glib.h>
+
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "outq.h"
+
+struct _OutputQueue {
+  gint fd;
+  gint fd_flags;  // to restore, -1 if the fd was non-blocking already
+  dev_t fd_dev;   // the fd still refers to the same file when freed?
+  ino_t fd_ino;
+  gchar *data;
+  gsize capacity; // size of data, grows if a write does not fit
+  gsize limit;    // capacity the queue was created with
+  gsize head;     // offset of the next byte to write out
+  gsize length;   // bytes queued
+  guint watch_id;
+  OutputQueueFunc func;
+  gpointer user_data;
+};
+
+static gboolean outq_writable(GIOChannel *source, GIOCondition cond, gpointer queue_ptr);
+
+static void
+outq_grow(OutputQueue *queue, gsize needed) {
+  gsize capacity = queue->capacity;
+  gsize first = MIN(queue->length, queue->capacity - queue->head);
+  gchar *data;
+
+  while(capacity < needed)
+    capacity *= 2;
+
+  // linearize the ring into the new buffer
+  data = g_malloc(capacity);
+  memcpy(data, queue->data + queue->head, first);
+  memcpy(data + first, queue->data, queue->length - first);
+
+  g_free(queue->data);
+  queue->data = data;
+  queue->capacity = capacity;
+  queue->head = 0;
+}
+
+static void
+outq_append(OutputQueue *queue, const gchar *buf, gsize len) {
+  gsize tail, first;
+
+  if(queue->length + len > queue->capacity)
+    outq_grow(queue, queue->length + len);
+
+  tail = (queue->head + queue->length) % queue->capacity;
+  first = MIN(len, queue->capacity - tail);
+  memcpy(queue->data + tail, buf, first);
+  memcpy(queue->data, buf + first, len - first);
+  queue->length += len;
+
+  if(queue->watch_id == 0) {
+    GIOChannel *channel = g_io_channel_unix_new(queue->fd);
+    queue->watch_id = g_io_add_watch(channel, G_IO_OUT, outq_writable, queue);
+    g_io_channel_unref(channel);
+  }
+}
+
+static gboolean
+outq_writable(GIOChannel *source, GIOCondition cond, gpointer queue_ptr) {
+  OutputQueue *queue = queue_ptr;
+  gsize written = 0;
+  gboolean keep_watching;
+
+  while(queue->length > 0) {
+    gsize chunk = MIN(queue->length, queue->capacity - queue->head);
+    gssize res = write(queue->fd, queue->data + queue->head, chunk);
+
+    if(res < 0) {
+      if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+        break;
+
+      g_critical("Error writing to fd %i: errno=%i, dropping %zu bytes\n",
+        queue->fd, errno, queue->length);
+      queue->length = 0;
+      break;
+    }
+
+    queue->head = (queue->head + res) % queue->capacity;
+    queue->length -= res;
+    written += res;
+
+    if(res < chunk)
+      break;
+  }
+
+  keep_watching = (queue->length > 0);
+  if(!keep_watching)
+    queue->watch_id = 0;
+
+  // the callback may free the queue, so it must not be touched afterwards
+  if(written > 0 && queue->func != NULL)
+    queue->func(queue, written, queue->user_data);
+
+  return keep_watching;
+}
+
+// writes must not block the main loop, e.g. on a slow reader of stdout
+static void
+outq_set_nonblocking(OutputQueue *queue) {
+  gint flags = fcntl(queue->fd, F_GETFL);
+  struct stat st;
+
+  queue->fd_flags = -1;
+  if(flags < 0 || (flags & O_NONBLOCK) || fstat(queue->fd, &st) != 0)
+    return;
+
+  if(fcntl(queue->fd, F_SETFL, flags | O_NONBLOCK) != 0) {
+    g_critical("Cannot make fd %i non-blocking: errno=%i\n", queue->fd, errno);
+    return;
+  }
+  queue->fd_flags = flags;
+  queue->fd_dev = st.st_dev;
+  queue->fd_ino = st.st_ino;
+}
+
+// others may share the file description, e.g. a terminal; what is still
+// queued is written then, blocking like before the queue existed
+static void
+outq_restore_flags(OutputQueue *queue) {
+  struct stat st;
+
+  if(queue->fd_flags < 0 || fstat(queue->fd, &st) != 0
+      || st.st_dev != queue->fd_dev || st.st_ino != queue->fd_ino)
+    return;
+
+  fcntl(queue->fd, F_SETFL, queue->fd_flags);
+  while(queue->length > 0) {
+    gsize chunk = MIN(queue->length, queue->capacity - queue->head);
+    gssize res = write(queue->fd, queue->data + queue->head, chunk);
+
+    if(res < 0 && errno == EINTR)
+      continue;
+    if(res <= 0)
+      break;
+    queue->head = (queue->head + res) % queue->capacity;
+    queue->length -= res;
+  }
+}
+
+OutputQueue*
+outq_new(gint fd, gsize capacity, OutputQueueFunc func, gpointer data) {
+  OutputQueue *queue = g_new0(OutputQueue, 1);
+
+  queue->fd = fd;
+  outq_set_nonblocking(queue);
+  queue->capacity = capacity;
+  queue->limit = capacity;
+  queue->data = g_malloc(capacity);
+  queue->func = func;
+  queue->user_data = data;
+
+  return queue;
+}
+
+void
+outq_free(OutputQueue *queue) {
+  if(queue->watch_id != 0)
+    g_source_remove(queue->watch_id);
+  outq_restore_flags(queue);
+  g_free(queue->data);
+  g_free(queue);
+}
+
+gboolean
+outq_write(OutputQueue *queue, const gchar *buf, gsize len) {
+  struct iovec iov = { (gchar*) buf, len };
+
+  return outq_writev(queue, &iov, 1);
+}
+
+// several buffers with one syscall, what does not fit is queued
+gboolean
+outq_writev(OutputQueue *queue, const struct iovec *iov, gint n_iov) {
+  gssize res = 0;
+  gsize done;
+  gint i;
+
+  // keep the byte order: only write directly if nothing is waiting
+  if(queue->length == 0) {
+    res = writev(queue->fd, iov, n_iov);
+    if(res < 0) {
+      if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        g_debug("outq: writev(fd=%i) failed, errno=%i\n", queue->fd, errno);
+        return FALSE;
+      }
+      res = 0;
+    }
+  }
+
+  for(i = 0, done = res; i < n_iov; i++) {
+    if(done >= iov[i].iov_len) {
+      done -= iov[i].iov_len;
+      continue;
+    }
+    outq_append(queue, (gchar*) iov[i].iov_base + done, iov[i].iov_len - done);
+    done = 0;
+  }
+
+  if(res > 0 && queue->func != NULL)
+    queue->func(queue, res, queue->user_data);
+
+  return TRUE;
+}
+
+gint
+outq_get_fd(OutputQueue *queue) {
+  return queue->fd;
+}
+
+gsize
+outq_pending(OutputQueue *queue) {
+  return queue->length;
+}
+
+gboolean
+outq_full(OutputQueue *queue) {
+  return queue->length >= queue->limit;
+}
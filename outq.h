@@ -0,0 +1,25 @@
+#ifndef __OUTQ_H__
+#define __OUTQ_H__
+
+#include <glib.h>
+#include <sys/uio.h>
+
+// pause delivery from the agent above this many queued bytes ...
+#define OUTQ_CAPACITY (256*1024)
+// ... and resume once the queue drained below this
+#define OUTQ_LOW_WATER (64*1024)
+
+typedef struct _OutputQueue OutputQueue;
+
+// called whenever bytes left the queue, i.e. were written to the fd
+typedef void (*OutputQueueFunc)(OutputQueue *queue, gsize written, gpointer data);
+
+OutputQueue* outq_new(gint fd, gsize capacity, OutputQueueFunc func, gpointer data);
+void outq_free(OutputQueue *queue);
+gboolean outq_write(OutputQueue *queue, const gchar *buf, gsize len);
+gboolean outq_writev(OutputQueue *queue, const struct iovec *iov, gint n_iov);
+gint outq_get_fd(OutputQueue *queue);
+gsize outq_pending(OutputQueue *queue);
+gboolean outq_full(OutputQueue *queue);
+
+#endif
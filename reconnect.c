@@ -0,0 +1,385 @@
+#include <glib.h>
+#include <agent.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "reconnect.h"
+#include "callbacks.h"
+#include "exchange.h"
+#include "sendq.h"
+#include "stripe.h"
+#include "metrics.h"
+#include "util.h"
+#include "global.h"
+
+// ICE restart: once a connection was established, a failed component
+// makes this peer gather again on a new stream with new credentials and
+// publish them. The peer notices the new credentials through its watch
+// of the exchange and restarts as well. Local sources are paused in the
+// meantime; with a reliable agent the payload the peer did not receive
+// is replayed once both sides told each other what they have (RESUME).
+
+struct _Reconnect {
+  NiceAgentRecvFunc deliver; // NULL with -u: no framing
+
+  guint32 ready_components;
+  guint32 writable_components;
+  gboolean connected;        // in the current generation
+  gboolean connected_once;
+  gboolean restarting;
+  gboolean resume_sent;
+  gint64 outage_start;
+  guint restart_id;
+
+  // remote data of the current generation, and credentials of generations
+  // that were connected once and are stale now
+  gchar *remote_ufrag;
+  gchar *remote_line;
+  GHashTable *old_remote_ufrags;
+
+  GByteArray *replay;        // payload sent from acked_offset on
+  guint64 send_offset;
+  guint64 acked_offset;
+  guint64 recv_offset;
+  guint64 recv_acked;
+  GByteArray *rx_buffer;
+  gboolean peer_resumed;
+};
+
+static void
+reconnect_send_frame(NiceSession *session, guint8 type, const gchar *payload, guint16 len) {
+  static gchar frame[RECONNECT_HEADER_SIZE + RECONNECT_MAX_PAYLOAD];
+  guint16 net_len = g_htons(len);
+
+  frame[0] = type;
+  memcpy(frame + 1, &net_len, sizeof(net_len));
+  memcpy(frame + RECONNECT_HEADER_SIZE, payload, len);
+
+  send_components(session, RECONNECT_HEADER_SIZE + len, frame);
+}
+
+static void
+reconnect_send_offset(NiceSession *session, guint8 type, guint64 offset) {
+  guint64 net_offset = GUINT64_TO_BE(offset);
+
+  reconnect_send_frame(session, type, (const gchar*) &net_offset, sizeof(net_offset));
+}
+
+static void
+reconnect_send_payload(NiceSession *session, const gchar *buf, gsize len) {
+  gsize offset, chunk;
+
+  for(offset = 0; offset < len; offset += chunk) {
+    chunk = MIN(len - offset, RECONNECT_MAX_PAYLOAD);
+    reconnect_send_frame(session, RECONNECT_FRAME_DATA, buf + offset, chunk);
+  }
+}
+
+gint
+reconnect_send(NiceSession *session, guint len, const gchar *buf) {
+  Reconnect *reconnect = session->reconnect;
+
+  g_byte_array_append(reconnect->replay, (const guint8*) buf, len);
+  reconnect->send_offset += len;
+
+  // otherwise it is sent once the peer told from where on
+  if(reconnect->peer_resumed)
+    reconnect_send_payload(session, buf, len);
+
+  return len;
+}
+
+// the peer has everything up to offset
+static void
+reconnect_acked(Reconnect *reconnect, guint64 offset) {
+  if(offset <= reconnect->acked_offset || offset > reconnect->send_offset)
+    return;
+
+  g_byte_array_remove_range(reconnect->replay, 0, offset - reconnect->acked_offset);
+  reconnect->acked_offset = offset;
+}
+
+static void
+reconnect_done(NiceSession *session) {
+  Reconnect *reconnect = session->reconnect;
+  gint64 outage_us = g_get_monotonic_time() - reconnect->outage_start;
+
+  reconnect->restarting = FALSE;
+  metrics.reconnects++;
+  metrics.outage_us += outage_us;
+  g_message("Reconnected to %s after %.1f s (%u bytes replayed).\n",
+    session->remote_hostname, outage_us / 1e6, reconnect->replay != NULL ? reconnect->replay->len : 0);
+
+  unpublish_local_credentials(session);
+  sendq_hold(session, FALSE);
+}
+
+// FALSE if the peer asks for what is gone, the session ends then
+static gboolean
+reconnect_resumed(NiceSession *session, guint64 offset) {
+  Reconnect *reconnect = session->reconnect;
+
+  if(offset < reconnect->acked_offset || offset > reconnect->send_offset) {
+    g_critical("reconnect: peer resumes at %" G_GUINT64_FORMAT ", only %" G_GUINT64_FORMAT
+      " to %" G_GUINT64_FORMAT " can be replayed", offset, reconnect->acked_offset, reconnect->send_offset);
+    session_end(session);
+    return FALSE;
+  }
+
+  reconnect_acked(reconnect, offset);
+  reconnect->peer_resumed = TRUE;
+  reconnect_send_payload(session, (const gchar*) reconnect->replay->data, reconnect->replay->len);
+
+  if(reconnect->restarting)
+    reconnect_done(session);
+  return TRUE;
+}
+
+void
+reconnect_recv(NiceAgent *agent, guint stream_id, guint component_id, guint len,
+    gchar *buf, gpointer session_ptr) {
+  NiceSession *session = session_ptr;
+  Reconnect *reconnect = session->reconnect;
+  gsize offset = 0;
+
+  g_byte_array_append(reconnect->rx_buffer, (guint8*) buf, len);
+
+  while(reconnect->rx_buffer->len - offset >= RECONNECT_HEADER_SIZE) {
+    gchar *frame = (gchar*) reconnect->rx_buffer->data + offset;
+    gchar *payload = frame + RECONNECT_HEADER_SIZE;
+    guint16 payload_len;
+    guint64 frame_offset;
+
+    memcpy(&payload_len, frame + 1, sizeof(payload_len));
+    payload_len = g_ntohs(payload_len);
+
+    // wait for the rest of the frame
+    if(reconnect->rx_buffer->len - offset < RECONNECT_HEADER_SIZE + payload_len)
+      break;
+    offset += RECONNECT_HEADER_SIZE + payload_len;
+
+    if(frame[0] == RECONNECT_FRAME_DATA) {
+      reconnect->deliver(agent, stream_id, 1, payload_len, payload, session);
+      reconnect->recv_offset += payload_len;
+
+      if(reconnect->recv_offset - reconnect->recv_acked >= RECONNECT_ACK_BYTES) {
+        reconnect_send_offset(session, RECONNECT_FRAME_ACK, reconnect->recv_offset);
+        reconnect->recv_acked = reconnect->recv_offset;
+      }
+      continue;
+    }
+
+    if(payload_len != sizeof(frame_offset)) {
+      g_critical("reconnect: malformed frame (type %i, %u bytes)", frame[0], payload_len);
+      g_byte_array_set_size(reconnect->rx_buffer, 0);
+      session_end(session);
+      return;
+    }
+    memcpy(&frame_offset, payload, sizeof(frame_offset));
+    frame_offset = GUINT64_FROM_BE(frame_offset);
+
+    if(frame[0] == RECONNECT_FRAME_ACK)
+      reconnect_acked(reconnect, frame_offset);
+    else if(frame[0] == RECONNECT_FRAME_RESUME && !reconnect_resumed(session, frame_offset)) {
+      g_byte_array_set_size(reconnect->rx_buffer, 0);
+      return;
+    }
+  }
+
+  g_byte_array_remove_range(reconnect->rx_buffer, 0, offset);
+}
+
+static void
+reconnect_restart(NiceSession *session) {
+  Reconnect *reconnect = session->reconnect;
+
+  if(!reconnect->restarting) {
+    reconnect->outage_start = g_get_monotonic_time();
+    g_message("Connection to %s lost, restarting ICE.\n", session->remote_hostname);
+  }
+  else
+    g_message("Restarting ICE with %s again.\n", session->remote_hostname);
+
+  if(reconnect->restart_id != 0) {
+    g_source_remove(reconnect->restart_id);
+    reconnect->restart_id = 0;
+  }
+
+  // the peer's credentials of a connected generation are stale from now
+  // on, otherwise they are used again for the new stream
+  if(reconnect->connected && reconnect->remote_ufrag != NULL) {
+    g_hash_table_add(reconnect->old_remote_ufrags, reconnect->remote_ufrag);
+    reconnect->remote_ufrag = NULL;
+    g_free(reconnect->remote_line);
+    reconnect->remote_line = NULL;
+  }
+
+  reconnect->restarting = TRUE;
+  reconnect->connected = FALSE;
+  reconnect->resume_sent = FALSE;
+  reconnect->ready_components = 0;
+  reconnect->writable_components = 0;
+  forget_remote_data(session);
+
+  // pause local sources, whatever they still send is kept for the replay
+  sendq_hold(session, TRUE);
+
+  // a new stream gathers the candidates of the current network and comes
+  // with new pseudo TCP connections
+  nice_agent_remove_stream(session->agent, session->stream_id);
+  session->stream_id = nice_agent_add_stream(session->agent, n_components);
+  if(session->stream_id == 0) {
+    g_critical("Error adding NICE stream!\n");
+    session_end(session);
+    return;
+  }
+
+  sendq_reset(session);
+  if(n_components > 1)
+    stripe_reset(session);
+  if(reconnect->deliver != NULL) {
+    g_byte_array_set_size(reconnect->rx_buffer, 0);
+    reconnect->peer_resumed = FALSE;
+  }
+  reattach_recv_callbacks(session);
+
+  exchange_restart(session->exchange);
+  lookup_remote_credentials(session);
+  if(reconnect->remote_line != NULL
+      && !parse_remote_data(session, reconnect->remote_line, strlen(reconnect->remote_line)))
+    return;
+
+  if(!nice_agent_gather_candidates(session->agent, session->stream_id)) {
+    g_critical("Failed to start candidate gathering\n");
+    session_end(session);
+  }
+}
+
+static gboolean
+reconnect_restart_source(gpointer session_ptr) {
+  NiceSession *session = session_ptr;
+
+  session->reconnect->restart_id = 0;
+  reconnect_restart(session_ptr);
+
+  return FALSE;
+}
+
+static void
+reconnect_state_changed(NiceAgent *agent, guint stream_id, guint component_id,
+    guint state, gpointer session_ptr) {
+  NiceSession *session = session_ptr;
+  Reconnect *reconnect = session->reconnect;
+  guint32 all = (1 << n_components) - 1;
+
+  if(stream_id != session->stream_id)
+    return;
+
+  if(state == NICE_COMPONENT_STATE_READY) {
+    reconnect->ready_components |= 1 << (component_id - 1);
+    if(reconnect->ready_components != all || reconnect->connected)
+      return;
+
+    reconnect->connected = TRUE;
+    reconnect->connected_once = TRUE;
+
+    // datagrams are not replayed, so this is it
+    if(reconnect->restarting && reconnect->deliver == NULL)
+      reconnect_done(session);
+  }
+  else if(state == NICE_COMPONENT_STATE_FAILED && reconnect->connected_once && reconnect->restart_id == 0) {
+    // not from within the stream's own signal; give a failed restart
+    // some time before trying again
+    if(reconnect->restarting && !reconnect->connected)
+      reconnect->restart_id = g_timeout_add(RECONNECT_RETRY_MS, reconnect_restart_source, session);
+    else
+      reconnect->restart_id = g_idle_add(reconnect_restart_source, session);
+  }
+}
+
+static void
+reconnect_writable(NiceAgent *agent, guint stream_id, guint component_id, gpointer session_ptr) {
+  NiceSession *session = session_ptr;
+  Reconnect *reconnect = session->reconnect;
+
+  if(stream_id != session->stream_id)
+    return;
+
+  reconnect->writable_components |= 1 << (component_id - 1);
+  if(reconnect->writable_components != (1 << n_components) - 1 || !reconnect->restarting || reconnect->resume_sent)
+    return;
+
+  // tell the peer from where on to replay
+  reconnect_send_offset(session, RECONNECT_FRAME_RESUME, reconnect->recv_offset);
+  reconnect->recv_acked = reconnect->recv_offset;
+  reconnect->resume_sent = TRUE;
+}
+
+// Decides whether remote data (the credentials line) is applied. New
+// credentials after the connection was up mean that the peer restarted.
+gboolean
+reconnect_remote_data(NiceSession *session, const gchar *line) {
+  Reconnect *reconnect = session->reconnect;
+  gchar **tokens = g_strsplit(line, " ", 2);
+  gboolean apply = TRUE;
+
+  if(tokens[0] == NULL)
+    goto end;
+
+  if(g_hash_table_contains(reconnect->old_remote_ufrags, tokens[0])) {
+    // published before the peer noticed the failure
+    apply = FALSE;
+    goto end;
+  }
+
+  if(reconnect->remote_ufrag != NULL && strcmp(reconnect->remote_ufrag, tokens[0]) != 0) {
+    if(reconnect->connected)
+      reconnect_restart(session);
+    else
+      forget_remote_data(session);
+  }
+
+  g_free(reconnect->remote_ufrag);
+  reconnect->remote_ufrag = g_strdup(tokens[0]);
+  g_free(reconnect->remote_line);
+  reconnect->remote_line = g_strdup(line);
+
+ end:
+  g_strfreev(tokens);
+  return apply;
+}
+
+void
+reconnect_init(NiceSession *session, NiceAgentRecvFunc deliver) {
+  Reconnect *reconnect = g_new0(Reconnect, 1);
+
+  reconnect->deliver = deliver;
+  reconnect->old_remote_ufrags = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+  reconnect->replay = g_byte_array_new();
+  reconnect->rx_buffer = g_byte_array_new();
+  reconnect->peer_resumed = TRUE;
+  session->reconnect = reconnect;
+
+  g_signal_connect(G_OBJECT(session->agent), "component-state-changed", G_CALLBACK(reconnect_state_changed), session);
+  if(deliver != NULL)
+    g_signal_connect(G_OBJECT(session->agent), "reliable-transport-writable", G_CALLBACK(reconnect_writable), session);
+}
+
+void
+reconnect_free(NiceSession *session) {
+  Reconnect *reconnect = session->reconnect;
+
+  if(reconnect == NULL)
+    return;
+
+  if(reconnect->restart_id != 0)
+    g_source_remove(reconnect->restart_id);
+  g_free(reconnect->remote_ufrag);
+  g_free(reconnect->remote_line);
+  g_hash_table_destroy(reconnect->old_remote_ufrags);
+  g_byte_array_unref(reconnect->replay);
+  g_byte_array_unref(reconnect->rx_buffer);
+  g_free(reconnect);
+  session->reconnect = NULL;
+}
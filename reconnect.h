@@ -0,0 +1,29 @@
+#ifndef __RECONNECT_H__
+#define __RECONNECT_H__
+
+#include <glib.h>
+#include <agent.h>
+
+#include "session.h"
+
+// With a reliable agent every chunk is framed, so the bytes the peer did
+// not receive before the connection failed can be sent again afterwards:
+// DATA carries payload, ACK and RESUME the number of payload bytes received.
+#define RECONNECT_HEADER_SIZE 3
+#define RECONNECT_FRAME_DATA 0
+#define RECONNECT_FRAME_ACK 1
+#define RECONNECT_FRAME_RESUME 2
+#define RECONNECT_MAX_PAYLOAD 65535
+
+// acknowledge received data in steps of this many bytes
+#define RECONNECT_ACK_BYTES (64*1024)
+// restart again if the new connection failed as well
+#define RECONNECT_RETRY_MS 5000
+
+void reconnect_init(NiceSession *session, NiceAgentRecvFunc deliver);
+void reconnect_free(NiceSession *session);
+gint reconnect_send(NiceSession *session, guint len, const gchar *buf);
+void reconnect_recv(NiceAgent *agent, guint stream_id, guint component_id, guint len, gchar *buf, gpointer session_ptr);
+gboolean reconnect_remote_data(NiceSession *session, const gchar *line);
+
+#endif
@@ -0,0 +1,271 @@
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <agent.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "resume.h"
+#include "util.h"
+#include "global.h"
+
+// Caches the last selected pair per remote host in ~/.nice_resume/<host>:
+//
+//   <local ufrag> <local password> <local port of component 1> [...]
+//   <remote ufrag> <remote password> <remote candidate> [...]
+//
+// The second line has the format of the published credentials. A new
+// session binds to the same local ports, reuses its credentials and adds
+// the cached remote candidates before anything was exchanged, so if the
+// peer does the same the checks succeed after one round trip. Gathering
+// and the exchange run as usual and take over if the peer does not answer.
+
+#define RESUME_DIR ".nice_resume"
+
+struct _Resume {
+  gchar *remote_ufrag;
+  gchar *remote_password;
+  gboolean resumed;
+  guint32 ready_components;
+  guint deadline_id;
+};
+
+static gchar*
+resume_filename(const gchar *remote_hostname) {
+  gchar *dirname = g_build_filename(g_get_home_dir(), RESUME_DIR, NULL);
+  gchar *hostname = g_strdelimit(g_strdup(remote_hostname), "/", '_');
+  gchar *filename = g_build_filename(dirname, hostname, NULL);
+
+  g_mkdir_with_parents(dirname, 0700);
+  g_free(hostname);
+  g_free(dirname);
+
+  return filename;
+}
+
+void
+resume_remote_credentials(NiceSession *session, const gchar *ufrag, const gchar *password) {
+  Resume *resume = session->resume;
+
+  if(resume == NULL)
+    return;
+
+  g_free(resume->remote_ufrag);
+  g_free(resume->remote_password);
+  resume->remote_ufrag = g_strdup(ufrag);
+  resume->remote_password = g_strdup(password);
+}
+
+static gboolean
+resume_port_available_v4(guint port) {
+  struct sockaddr_in addr;
+  gint fd = socket(AF_INET, SOCK_DGRAM, 0);
+  gboolean available;
+
+  if(fd < 0)
+    return TRUE;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+  available = bind(fd, (struct sockaddr*) &addr, sizeof(addr)) == 0;
+  close(fd);
+
+  return available;
+}
+
+static gboolean
+resume_port_available_v6(guint port) {
+  struct sockaddr_in6 addr;
+  gint fd = socket(AF_INET6, SOCK_DGRAM, 0);
+  gint v6only = 1;
+  gboolean available;
+
+  // no IPv6 on this host, the agent will not gather it either
+  if(fd < 0)
+    return TRUE;
+
+  setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only));
+  memset(&addr, 0, sizeof(addr));
+  addr.sin6_family = AF_INET6;
+  addr.sin6_port = htons(port);
+  addr.sin6_addr = in6addr_any;
+
+  available = bind(fd, (struct sockaddr*) &addr, sizeof(addr)) == 0;
+  close(fd);
+
+  return available;
+}
+
+// the agent binds the port for its IPv4 and IPv6 host candidates
+static gboolean
+resume_port_available(guint port) {
+  return resume_port_available_v4(port) && resume_port_available_v6(port);
+}
+
+static void
+resume_save(NiceSession *session) {
+  NiceAgent *agent = session->agent;
+  GString *buf = g_string_new(NULL);
+  gchar *local_ufrag = NULL, *local_password = NULL;
+  gchar *filename;
+  gchar ipaddr[INET6_ADDRSTRLEN];
+  guint component_id;
+  GError *error = NULL;
+
+  if(session->resume->remote_ufrag == NULL || !nice_agent_get_local_credentials(agent, session->stream_id,
+      &local_ufrag, &local_password))
+    return;
+
+  g_string_append_printf(buf, "%s %s", local_ufrag, local_password);
+  for(component_id = 1; component_id <= n_components; component_id++) {
+    NiceCandidate *local, *remote;
+
+    if(!nice_agent_get_selected_pair(agent, session->stream_id, component_id, &local, &remote))
+      goto end;
+    g_string_append_printf(buf, " %u", nice_address_get_port(&local->base_addr));
+  }
+
+  g_string_append_printf(buf, "\n%s %s", session->resume->remote_ufrag, session->resume->remote_password);
+  for(component_id = 1; component_id <= n_components; component_id++) {
+    NiceCandidate *local, *remote;
+
+    nice_agent_get_selected_pair(agent, session->stream_id, component_id, &local, &remote);
+    nice_address_to_string(&remote->addr, ipaddr);
+    g_string_append_printf(buf, " %s,%u,%s,%u,%s,%u", remote->foundation, remote->priority,
+      ipaddr, nice_address_get_port(&remote->addr), candidate_type_to_string(remote->type), component_id);
+  }
+  g_string_append(buf, "\n");
+
+  filename = resume_filename(session->remote_hostname);
+  if(!g_file_set_contents(filename, buf->str, buf->len, &error)) {
+    g_debug("resume: cannot write %s: %s\n", filename, error->message);
+    g_error_free(error);
+  }
+  else {
+    g_chmod(filename, 0600);
+    g_debug("resume: cached the selected pair in %s\n", filename);
+  }
+  g_free(filename);
+
+ end:
+  g_free(local_ufrag);
+  g_free(local_password);
+  g_string_free(buf, TRUE);
+}
+
+static void
+resume_state_changed(NiceAgent *agent, guint stream_id, guint component_id,
+    guint state, gpointer session_ptr) {
+  NiceSession *session = session_ptr;
+  Resume *resume = session->resume;
+  guint32 all = (1 << n_components) - 1;
+
+  if(stream_id != session->stream_id)
+    return;
+  if(state != NICE_COMPONENT_STATE_READY || resume->ready_components == all)
+    return;
+
+  resume->ready_components |= 1 << (component_id - 1);
+  if(resume->ready_components != all)
+    return;
+
+  if(resume->resumed)
+    g_message("Resumed the cached connection to %s.\n", session->remote_hostname);
+  resume_save(session);
+}
+
+static gboolean
+resume_deadline(gpointer session_ptr) {
+  NiceSession *session = session_ptr;
+  gchar *filename;
+
+  session->resume->deadline_id = 0;
+  if(session->resume->ready_components == (1 << n_components) - 1)
+    return FALSE;
+
+  // the peer did not resume (or moved), do not try this pair again
+  g_message("Cached pair to %s did not answer, waiting for the exchange.\n", session->remote_hostname);
+  filename = resume_filename(session->remote_hostname);
+  g_unlink(filename);
+  g_free(filename);
+
+  return FALSE;
+}
+
+// has to run before the candidates are gathered
+void
+resume_init(NiceSession *session) {
+  NiceAgent *agent = session->agent;
+  gchar *filename = resume_filename(session->remote_hostname);
+  gchar *contents = NULL;
+  gchar **lines = NULL, **local = NULL;
+  GStatBuf st;
+  guint component_id;
+
+  session->resume = g_new0(Resume, 1);
+  g_signal_connect(G_OBJECT(agent), "component-state-changed", G_CALLBACK(resume_state_changed), session);
+
+  if(g_stat(filename, &st) != 0 || time(NULL) - st.st_mtime > RESUME_MAX_AGE_S
+      || !g_file_get_contents(filename, &contents, NULL, NULL))
+    goto end;
+
+  lines = g_strsplit(contents, "\n", 3);
+  if(lines[0] == NULL || lines[1] == NULL)
+    goto end;
+
+  local = g_strsplit(lines[0], " ", 0);
+  if(g_strv_length(local) != 2 + n_components)
+    goto end;
+
+  for(component_id = 1; component_id <= n_components; component_id++) {
+    guint port = atoi(local[1 + component_id]);
+
+    // somebody else took the port, the cached pair cannot work
+    if(!resume_port_available(port))
+      goto end;
+  }
+
+  for(component_id = 1; component_id <= n_components; component_id++) {
+    guint port = atoi(local[1 + component_id]);
+    nice_agent_set_port_range(agent, session->stream_id, component_id, port, port);
+  }
+  if(!nice_agent_set_local_credentials(agent, session->stream_id, local[0], local[1]))
+    goto end;
+
+  // checks start as soon as the host candidates are gathered
+  g_debug("resume: trying the cached pair from %s\n", filename);
+  if(!parse_remote_data(session, lines[1], strlen(lines[1])))
+    goto end;
+  session->resume->resumed = TRUE;
+  session->resume->deadline_id = g_timeout_add(RESUME_DEADLINE_MS, resume_deadline, session);
+
+ end:
+  g_strfreev(local);
+  g_strfreev(lines);
+  g_free(contents);
+  g_free(filename);
+}
+
+void
+resume_free(NiceSession *session) {
+  Resume *resume = session->resume;
+
+  if(resume == NULL)
+    return;
+
+  if(resume->deadline_id != 0)
+    g_source_remove(resume->deadline_id);
+  g_free(resume->remote_ufrag);
+  g_free(resume->remote_password);
+  g_free(resume);
+  session->resume = NULL;
+}
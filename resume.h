@@ -0,0 +1,18 @@
+#ifndef __RESUME_H__
+#define __RESUME_H__
+
+#include <glib.h>
+#include <agent.h>
+
+#include "session.h"
+
+// cached pairs older than this are not tried any more
+#define RESUME_MAX_AGE_S (15*60)
+// the cached pair is given up on if it did not answer by then
+#define RESUME_DEADLINE_MS 1000
+
+void resume_init(NiceSession *session);
+void resume_remote_credentials(NiceSession *session, const gchar *ufrag, const gchar *password);
+void resume_free(NiceSession *session);
+
+#endif
@@ -0,0 +1,119 @@
+#include <glib.h>
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+
+#include "ring.h"
+
+// head and tail only grow (modulo 2^32), the slot is their value modulo
+// RING_SLOTS; the atomics order the slot contents against them
+
+Ring*
+ring_new() {
+  Ring *ring = g_new0(Ring, 1);
+
+  ring->slots = g_new(RingSlot, RING_SLOTS);
+  ring->readable_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  ring->writable_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if(ring->readable_fd < 0 || ring->writable_fd < 0) {
+    g_critical("Error creating an eventfd: errno=%i\n", errno);
+    exit(1);
+  }
+
+  return ring;
+}
+
+void
+ring_free(Ring *ring) {
+  close(ring->readable_fd);
+  close(ring->writable_fd);
+  g_free(ring->slots);
+  g_free(ring);
+}
+
+guint
+ring_used(Ring *ring) {
+  return g_atomic_int_get(&ring->tail) - g_atomic_int_get(&ring->head);
+}
+
+guint
+ring_free_slots(Ring *ring) {
+  return RING_SLOTS - ring_used(ring);
+}
+
+RingSlot*
+ring_reserve(Ring *ring) {
+  if(ring_used(ring) == RING_SLOTS)
+    return NULL;
+
+  return &ring->slots[ring->tail % RING_SLOTS];
+}
+
+void
+ring_push(Ring *ring) {
+  g_atomic_int_set(&ring->tail, ring->tail + 1);
+
+  if(g_atomic_int_compare_and_exchange(&ring->want_readable, 1, 0))
+    ring_signal(ring->readable_fd);
+}
+
+RingSlot*
+ring_peek(Ring *ring) {
+  if(ring_used(ring) == 0)
+    return NULL;
+
+  return &ring->slots[ring->head % RING_SLOTS];
+}
+
+void
+ring_pop(Ring *ring) {
+  gint want;
+
+  g_atomic_int_set(&ring->head, ring->head + 1);
+
+  want = g_atomic_int_get(&ring->want_writable);
+  if(want != 0 && ring_free_slots(ring) >= want
+      && g_atomic_int_compare_and_exchange(&ring->want_writable, want, 0))
+    ring_signal(ring->writable_fd);
+}
+
+// Arming and checking again closes the race with the other side: either
+// it sees the flag after its push or pop, or we see what it did.
+gboolean
+ring_arm_readable(Ring *ring) {
+  g_atomic_int_set(&ring->want_readable, 1);
+  if(ring_used(ring) == 0)
+    return TRUE;
+
+  g_atomic_int_set(&ring->want_readable, 0);
+  return FALSE;
+}
+
+gboolean
+ring_arm_writable(Ring *ring, guint slots) {
+  g_atomic_int_set(&ring->want_writable, slots);
+  if(ring_free_slots(ring) < slots)
+    return TRUE;
+
+  g_atomic_int_set(&ring->want_writable, 0);
+  return FALSE;
+}
+
+void
+ring_signal(gint fd) {
+  uint64_t one = 1;
+
+  if(write(fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+    g_debug("ring: cannot signal: errno=%i\n", errno);
+}
+
+void
+ring_clear(gint fd) {
+  uint64_t count;
+
+  if(read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+    g_debug("ring: cannot clear: errno=%i\n", errno);
+}
@@ -0,0 +1,51 @@
+#ifndef __RING_H__
+#define __RING_H__
+
+#include <glib.h>
+
+// slots per ring, a power of two
+#define RING_SLOTS 256
+// the largest message a slot takes, as much as send_data() reads at once
+#define RING_SLOT_SIZE 10240
+
+typedef struct {
+  guint len;
+  gchar data[RING_SLOT_SIZE];
+} RingSlot;
+
+// Bounded single-producer/single-consumer ring. One thread pushes, another
+// pops, neither takes a lock. A side that finds nothing to do arms the
+// ring and waits for the matching eventfd, the other side signals it with
+// the next push or pop.
+typedef struct {
+  RingSlot *slots;
+  volatile guint head;        // next slot to pop, only moved by the consumer
+  volatile guint tail;        // next slot to push, only moved by the producer
+  volatile gint want_readable;
+  volatile gint want_writable; // free slots the producer waits for, 0: none
+  gint readable_fd;           // eventfd, signalled when armed and pushed
+  gint writable_fd;           // eventfd, signalled when armed and enough popped
+} Ring;
+
+Ring* ring_new();
+void ring_free(Ring *ring);
+
+guint ring_used(Ring *ring);
+guint ring_free_slots(Ring *ring);
+
+// producer: a slot to fill (NULL if full), then publish it
+RingSlot* ring_reserve(Ring *ring);
+void ring_push(Ring *ring);
+
+// consumer: the oldest slot (NULL if empty), then release it
+RingSlot* ring_peek(Ring *ring);
+void ring_pop(Ring *ring);
+
+// FALSE if there is something to do already, no need to wait
+gboolean ring_arm_readable(Ring *ring);
+gboolean ring_arm_writable(Ring *ring, guint slots);
+
+void ring_signal(gint fd);
+void ring_clear(gint fd);
+
+#endif
@@ -0,0 +1,880 @@
+#include <glib.h>
+#include <glib-object.h>
+#include <agent.h>
+
+#include <string.h>
+
+#include "rudp.h"
+#include "metrics.h"
+#include "global.h"
+
+// A reliable stream over the datagrams of a plain agent (-U), in place of
+// the agent's pseudo TCP with its small window and Reno congestion control.
+//
+// Every datagram gets a new packet number, also when it carries data again,
+// and acknowledgments list the ranges of packet numbers that arrived. So an
+// ACK is never ambiguous, and everything missing between the ranges is seen
+// at once (selective ACK). The receiver puts the data back in order by its
+// stream offset. A packet is lost once 3 later ones were acknowledged or it
+// is 9/8 RTT older than one that was; if nothing is acknowledged for a while,
+// the oldest one is sent again (probe timeout).
+//
+// Congestion control follows BBR: the bottleneck bandwidth (the largest
+// delivery rate of the last 10 round trips) times the smallest RTT (of the
+// last 10 s) is the path's BDP. Packets are paced at the bandwidth, with a
+// gain that probes for more now and then, and up to two BDPs are in flight.
+// Loss does not slow the sender down. There is no PROBE_RTT phase; the
+// receiver's window (-w) bounds the queue the sender can build up.
+
+#define RUDP_DATA 0
+#define RUDP_ACK 1
+
+// type, number of ranges, ACK delay, window (highest offset accepted)
+#define RUDP_ACK_HEADER_SIZE 16
+#define RUDP_MAX_RANGES 32
+#define RUDP_ACK_EVERY 2
+#define RUDP_ACK_DELAY_US 5000
+
+#define RUDP_REORDER_PACKETS 3
+#define RUDP_INITIAL_RTT_US 100000
+#define RUDP_PERSIST_US 200000
+#define RUDP_MAX_PTO_BACKOFF 6
+
+#define RUDP_INITIAL_CWND (32 * RUDP_MSS)
+#define RUDP_MIN_CWND (4 * RUDP_MSS)
+// bursts the pacing allows, the main loop's timers have 1 ms resolution
+#define RUDP_PACING_BURST_US 2000
+#define RUDP_BW_ROUNDS 10
+#define RUDP_MIN_RTT_WINDOW_US (10 * G_USEC_PER_SEC)
+#define RUDP_STARTUP_GAIN 2.885
+#define RUDP_STARTUP_ROUNDS 3
+#define RUDP_PROBE_CYCLE 8
+
+#define RUDP_AFTER(a, b) ((gint32) ((a) - (b)) > 0)
+
+enum { RUDP_STARTUP, RUDP_DRAIN, RUDP_PROBE_BW };
+
+static const gdouble probe_gains[RUDP_PROBE_CYCLE] = { 1.25, 0.75, 1, 1, 1, 1, 1, 1 };
+
+typedef struct {
+  guint64 offset;
+  guint len;
+  guint32 pn;           // of the last transmission
+  gint64 sent_us;
+  guint64 delivered;    // when it was sent, for the delivery rate
+  gint64 delivered_us;
+  gint64 first_sent_us;
+  gboolean acked;
+  GList link;           // in sent or unsent, or in the spare segments
+  GList lost_link;
+  guint8 data[RUDP_MSS];
+} RudpSegment;
+
+typedef struct {
+  guint32 hi, lo;
+} RudpRange;
+
+struct _Rudp {
+  NiceSession *session;
+  NiceAgentRecvFunc deliver;
+  gboolean announced;
+  guint64 window;
+
+  // outgoing
+  GQueue sent;              // by offset, until acknowledged
+  GQueue unsent;
+  GQueue lost;
+  GQueue spare;             // reused, so forwarding does not allocate
+  guint64 next_offset;      // of the next byte rudp_send() takes
+  guint64 acked_offset;     // everything before was acknowledged
+  guint64 peer_max_offset;
+  RudpSegment **flight;     // by packet number
+  guint32 flight_mask;
+  guint32 next_pn, floor_pn, largest_acked;
+  guint64 in_flight;
+  gboolean blocked;
+  guint timer_id;
+  gint64 timer_deadline;
+  guint pace_id;
+  guint pto_count;
+  gint64 progress_us;       // last time something new was acknowledged
+  gdouble tokens;
+  gint64 tokens_us;
+
+  // path model
+  gint64 srtt, rttvar, min_rtt, min_rtt_us;
+  guint64 delivered;
+  gint64 delivered_us;
+  gint64 first_sent_us;     // of the newest packet acknowledged
+  guint64 next_round_delivered;
+  guint round;
+  gdouble bw_max[RUDP_BW_ROUNDS];   // bytes per µs
+  gdouble btl_bw, full_bw;
+  guint full_bw_rounds;
+  gint mode;
+  guint cycle;
+  gint64 cycle_us;
+
+  // incoming
+  guint64 recv_offset;      // everything before arrived
+  guint64 consumed;         // handed on, the window starts here
+  GHashTable *out_of_order; // segments by offset
+  GByteArray *held;         // in order, while receiving is paused
+  RudpRange ranges[RUDP_MAX_RANGES];  // newest first
+  guint n_ranges;
+  gint64 largest_recv_us;
+  guint unacked;
+  guint ack_id;
+};
+
+static guint64 sent_packets = 0, resent_packets = 0, probes = 0;
+
+static void rudp_pump(Rudp *rudp);
+
+static void
+put32(guint8 *p, guint32 v) {
+  p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+}
+
+static guint32
+get32(const guint8 *p) {
+  return ((guint32) p[0] << 24) | ((guint32) p[1] << 16) | ((guint32) p[2] << 8) | p[3];
+}
+
+static void
+put64(guint8 *p, guint64 v) {
+  put32(p, v >> 32);
+  put32(p + 4, v);
+}
+
+static guint64
+get64(const guint8 *p) {
+  return ((guint64) get32(p) << 32) | get32(p + 4);
+}
+
+static void
+rudp_datagram(Rudp *rudp, guint len, const guint8 *packet) {
+  NiceSession *session = rudp->session;
+
+  if(nice_agent_send(session->agent, session->stream_id, 1, len, (const gchar*) packet) < 0)
+    metrics.send_failed++;
+}
+
+static gdouble
+rudp_pacing_rate(Rudp *rudp) {
+  gdouble gain = rudp->mode == RUDP_STARTUP ? RUDP_STARTUP_GAIN
+    : rudp->mode == RUDP_DRAIN ? 1 / RUDP_STARTUP_GAIN : probe_gains[rudp->cycle];
+
+  if(rudp->btl_bw == 0)
+    return RUDP_STARTUP_GAIN * RUDP_INITIAL_CWND / rudp->srtt;
+
+  return gain * rudp->btl_bw;
+}
+
+// before the first sample the smoothed RTT has to do
+static gint64
+rudp_min_rtt(Rudp *rudp) {
+  return rudp->min_rtt > 0 ? rudp->min_rtt : rudp->srtt;
+}
+
+static guint64
+rudp_cwnd(Rudp *rudp) {
+  gdouble gain = rudp->mode == RUDP_PROBE_BW ? 2 : RUDP_STARTUP_GAIN;
+  guint64 cwnd = RUDP_INITIAL_CWND;
+
+  if(rudp->btl_bw > 0) {
+    cwnd = MAX(gain * rudp->btl_bw * rudp_min_rtt(rudp), RUDP_MIN_CWND);
+    if(rudp->mode == RUDP_STARTUP)
+      cwnd = MAX(cwnd, RUDP_INITIAL_CWND);
+  }
+
+  return MIN(cwnd, rudp->window);
+}
+
+static gint64
+rudp_pto(Rudp *rudp) {
+  return (rudp->srtt + MAX(4 * rudp->rttvar, 1000) + RUDP_ACK_DELAY_US)
+    << MIN(rudp->pto_count, RUDP_MAX_PTO_BACKOFF);
+}
+
+static RudpSegment*
+rudp_segment_new(Rudp *rudp) {
+  GList *link = g_queue_pop_head_link(&rudp->spare);
+  RudpSegment *segment = link != NULL ? link->data : g_new(RudpSegment, 1);
+
+  segment->link = (GList) { segment, NULL, NULL };
+  segment->lost_link = (GList) { segment, NULL, NULL };
+  segment->acked = FALSE;
+  return segment;
+}
+
+static void
+rudp_segment_free(Rudp *rudp, RudpSegment *segment) {
+  g_queue_push_head_link(&rudp->spare, &segment->link);
+}
+
+static RudpSegment*
+rudp_in_flight(Rudp *rudp, guint32 pn) {
+  RudpSegment *segment = rudp->flight[pn & rudp->flight_mask];
+
+  return (segment != NULL && segment->pn == pn) ? segment : NULL;
+}
+
+static void
+rudp_land(Rudp *rudp, RudpSegment *segment) {
+  rudp->flight[segment->pn & rudp->flight_mask] = NULL;
+  rudp->in_flight -= segment->len;
+}
+
+static void
+rudp_advance_floor(Rudp *rudp) {
+  while(rudp->floor_pn != rudp->next_pn && rudp_in_flight(rudp, rudp->floor_pn) == NULL)
+    rudp->floor_pn++;
+}
+
+static void
+rudp_header(Rudp *rudp, guint8 *packet, guint len, guint32 pn, guint64 offset) {
+  packet[0] = RUDP_DATA;
+  packet[1] = 0;
+  packet[2] = len >> 8;
+  packet[3] = len & 0xff;
+  put32(packet + 4, pn);
+  put32(packet + 8, rudp->floor_pn);
+  put64(packet + 12, offset);
+}
+
+static void
+rudp_transmit(Rudp *rudp, RudpSegment *segment) {
+  guint8 packet[RUDP_HEADER_SIZE + RUDP_MSS];
+  gint64 now = g_get_monotonic_time();
+
+  // idle time is no delivery time, nor time without progress
+  if(rudp->in_flight == 0) {
+    rudp->delivered_us = now;
+    rudp->first_sent_us = now;
+    rudp->progress_us = now;
+  }
+
+  segment->pn = rudp->next_pn++;
+  segment->sent_us = now;
+  segment->delivered = rudp->delivered;
+  segment->delivered_us = rudp->delivered_us;
+  segment->first_sent_us = rudp->first_sent_us;
+  rudp->flight[segment->pn & rudp->flight_mask] = segment;
+  rudp->in_flight += segment->len;
+  rudp_advance_floor(rudp);
+
+  rudp_header(rudp, packet, segment->len, segment->pn, segment->offset);
+  memcpy(packet + RUDP_HEADER_SIZE, segment->data, segment->len);
+  rudp_datagram(rudp, RUDP_HEADER_SIZE + segment->len, packet);
+  sent_packets++;
+}
+
+// an empty packet, the peer answers with its window
+static void
+rudp_probe(Rudp *rudp) {
+  guint8 packet[RUDP_HEADER_SIZE];
+
+  rudp_header(rudp, packet, 0, rudp->next_pn++, rudp->next_offset);
+  rudp_advance_floor(rudp);
+  rudp_datagram(rudp, sizeof(packet), packet);
+  probes++;
+}
+
+static void
+rudp_lose(Rudp *rudp, RudpSegment *segment) {
+  rudp_land(rudp, segment);
+  g_queue_push_tail_link(&rudp->lost, &segment->lost_link);
+}
+
+static void
+rudp_detect_loss(Rudp *rudp, gint64 now) {
+  gint64 delay = 9 * rudp->srtt / 8;
+  guint32 pn;
+
+  for(pn = rudp->floor_pn; RUDP_AFTER(rudp->largest_acked, pn); pn++) {
+    RudpSegment *segment = rudp_in_flight(rudp, pn);
+
+    if(segment != NULL && (rudp->largest_acked - pn >= RUDP_REORDER_PACKETS
+        || segment->sent_us + delay <= now))
+      rudp_lose(rudp, segment);
+  }
+  rudp_advance_floor(rudp);
+}
+
+static gboolean rudp_timeout(gpointer rudp_ptr);
+
+static void
+rudp_arm_timer(Rudp *rudp) {
+  RudpSegment *oldest = rudp_in_flight(rudp, rudp->floor_pn);
+  gint64 now = g_get_monotonic_time(), deadline;
+
+  if(oldest != NULL) {
+    deadline = MAX(oldest->sent_us, rudp->progress_us) + rudp_pto(rudp);
+    if(RUDP_AFTER(rudp->largest_acked, oldest->pn))
+      deadline = MIN(deadline, oldest->sent_us + 9 * rudp->srtt / 8);
+  }
+  // the window update that would reopen the peer's window may get lost
+  else if(!g_queue_is_empty(&rudp->unsent))
+    deadline = now + RUDP_PERSIST_US;
+  else
+    return;
+
+  // an earlier timer finds out itself what is due
+  if(rudp->timer_id != 0 && rudp->timer_deadline <= deadline)
+    return;
+  if(rudp->timer_id != 0)
+    g_source_remove(rudp->timer_id);
+
+  rudp->timer_deadline = deadline;
+  rudp->timer_id = g_timeout_add(MAX(1, (deadline - now + 999) / 1000), rudp_timeout, rudp);
+}
+
+static gboolean
+rudp_timeout(gpointer rudp_ptr) {
+  Rudp *rudp = rudp_ptr;
+  gint64 now = g_get_monotonic_time();
+  RudpSegment *oldest;
+
+  rudp->timer_id = 0;
+  rudp_detect_loss(rudp, now);
+
+  oldest = rudp_in_flight(rudp, rudp->floor_pn);
+  if(oldest != NULL && now >= MAX(oldest->sent_us, rudp->progress_us) + rudp_pto(rudp)) {
+    g_debug("rudp: nothing acknowledged for %" G_GINT64_FORMAT " ms, sending %" G_GUINT64_FORMAT " again\n",
+      (now - rudp->progress_us) / 1000, oldest->offset);
+    rudp->pto_count++;
+    rudp_lose(rudp, oldest);
+    rudp_advance_floor(rudp);
+  }
+  else if(oldest == NULL && rudp->in_flight == 0 && !g_queue_is_empty(&rudp->unsent))
+    rudp_probe(rudp);
+
+  rudp_pump(rudp);
+  return FALSE;
+}
+
+static gboolean
+rudp_pace(gpointer rudp_ptr) {
+  Rudp *rudp = rudp_ptr;
+
+  rudp->pace_id = 0;
+  rudp_pump(rudp);
+
+  return FALSE;
+}
+
+// sends what the congestion window, the peer's window and the pacing allow,
+// lost data first
+static void
+rudp_pump(Rudp *rudp) {
+  gint64 now = g_get_monotonic_time();
+  gdouble rate = rudp_pacing_rate(rudp);
+  guint64 cwnd = rudp_cwnd(rudp);
+
+  rudp->tokens = MIN(MAX(2.0 * RUDP_MSS, rate * RUDP_PACING_BURST_US),
+    rudp->tokens + rate * (now - rudp->tokens_us));
+  rudp->tokens_us = now;
+
+  while(rudp->announced) {
+    GQueue *queue = g_queue_is_empty(&rudp->lost) ? &rudp->unsent : &rudp->lost;
+    RudpSegment *segment = g_queue_peek_head(queue);
+
+    if(segment == NULL || rudp->in_flight + segment->len > cwnd
+        || rudp->next_pn - rudp->floor_pn >= rudp->flight_mask)
+      break;
+    if(queue == &rudp->unsent && segment->offset + segment->len > rudp->peer_max_offset)
+      break;
+
+    if(rudp->tokens < segment->len) {
+      if(rudp->pace_id == 0)
+        rudp->pace_id = g_timeout_add(MAX(1, (segment->len - rudp->tokens) / rate / 1000),
+          rudp_pace, rudp);
+      break;
+    }
+    rudp->tokens -= segment->len;
+
+    g_queue_pop_head_link(queue);
+    if(queue == &rudp->unsent)
+      g_queue_push_tail_link(&rudp->sent, &segment->link);
+    else {
+      resent_packets++;
+      metrics.retransmits++;
+    }
+    rudp_transmit(rudp, segment);
+  }
+
+  rudp_arm_timer(rudp);
+}
+
+static void
+rudp_update_rtt(Rudp *rudp, gint64 rtt, gint64 ack_delay, gint64 now) {
+  gboolean first = rudp->min_rtt == 0;
+
+  if(rudp->min_rtt == 0 || rtt <= rudp->min_rtt || now - rudp->min_rtt_us > RUDP_MIN_RTT_WINDOW_US) {
+    rudp->min_rtt = MAX(rtt, 1);
+    rudp->min_rtt_us = now;
+  }
+
+  // the peer's delay, as long as that does not make it shorter than possible
+  if(rtt - ack_delay >= rudp->min_rtt)
+    rtt -= ack_delay;
+
+  if(first) {
+    rudp->srtt = rtt;
+    rudp->rttvar = rtt / 2;
+  }
+  else {
+    rudp->rttvar = (3 * rudp->rttvar + ABS(rudp->srtt - rtt)) / 4;
+    rudp->srtt = (7 * rudp->srtt + rtt) / 8;
+  }
+}
+
+static void
+rudp_update_model(Rudp *rudp, RudpSegment *newest, gint64 now) {
+  // ACKs that arrive in a bunch do not make the path faster than the
+  // packets were sent
+  gint64 interval = MAX(now - newest->delivered_us, newest->sent_us - newest->first_sent_us);
+  gboolean new_round = FALSE;
+  guint i;
+
+  // a round trip is over once a packet sent after it began is acknowledged
+  if(newest->delivered >= rudp->next_round_delivered) {
+    rudp->next_round_delivered = rudp->delivered;
+    rudp->round++;
+    rudp->bw_max[rudp->round % RUDP_BW_ROUNDS] = 0;
+    new_round = TRUE;
+  }
+
+  if(interval > 0) {
+    gdouble rate = (gdouble) (rudp->delivered - newest->delivered) / interval;
+    gdouble *slot = &rudp->bw_max[rudp->round % RUDP_BW_ROUNDS];
+
+    *slot = MAX(*slot, rate);
+  }
+  rudp->btl_bw = 0;
+  for(i = 0; i < RUDP_BW_ROUNDS; i++)
+    rudp->btl_bw = MAX(rudp->btl_bw, rudp->bw_max[i]);
+
+  switch(rudp->mode) {
+  case RUDP_STARTUP:
+    // the bandwidth stopped growing: the pipe is full
+    if(!new_round)
+      break;
+    if(rudp->btl_bw >= 1.25 * rudp->full_bw) {
+      rudp->full_bw = rudp->btl_bw;
+      rudp->full_bw_rounds = 0;
+    }
+    else if(++rudp->full_bw_rounds >= RUDP_STARTUP_ROUNDS) {
+      rudp->mode = RUDP_DRAIN;
+      g_debug("rudp: %.1f MB/s at %.1f ms, leaving startup\n", rudp->btl_bw, rudp->min_rtt / 1000.0);
+    }
+    break;
+  case RUDP_DRAIN:
+    // the queue startup built up is gone
+    if(rudp->in_flight <= rudp->btl_bw * rudp_min_rtt(rudp)) {
+      rudp->mode = RUDP_PROBE_BW;
+      rudp->cycle = 2;
+      rudp->cycle_us = now;
+    }
+    break;
+  case RUDP_PROBE_BW:
+    if(now - rudp->cycle_us > rudp_min_rtt(rudp)) {
+      rudp->cycle = (rudp->cycle + 1) % RUDP_PROBE_CYCLE;
+      rudp->cycle_us = now;
+    }
+    break;
+  }
+}
+
+static guint64
+rudp_room(Rudp *rudp) {
+  guint64 buffered = rudp->next_offset - rudp->acked_offset;
+
+  return buffered < rudp->window ? rudp->window - buffered : 0;
+}
+
+static void
+rudp_on_ack(Rudp *rudp, guint len, const guint8 *packet) {
+  NiceSession *session = rudp->session;
+  guint n_ranges = packet[1], i;
+  guint32 ack_delay = get32(packet + 4);
+  guint64 max_offset = get64(packet + 8);
+  RudpSegment *newest = NULL, *segment;
+  gint64 now = g_get_monotonic_time();
+
+  if(len < RUDP_ACK_HEADER_SIZE + 8 * n_ranges) {
+    metrics.dropped++;
+    return;
+  }
+
+  if(max_offset > rudp->peer_max_offset)
+    rudp->peer_max_offset = max_offset;
+
+  for(i = 0; i < n_ranges; i++) {
+    guint32 hi = get32(packet + RUDP_ACK_HEADER_SIZE + 8 * i);
+    guint32 lo = get32(packet + RUDP_ACK_HEADER_SIZE + 8 * i + 4);
+    guint32 pn;
+
+    if(!RUDP_AFTER(rudp->next_pn, hi) || RUDP_AFTER(lo, hi))
+      continue;
+    if(i == 0 && RUDP_AFTER(hi, rudp->largest_acked))
+      rudp->largest_acked = hi;
+
+    // below the floor everything was acknowledged or is lost already
+    if(RUDP_AFTER(rudp->floor_pn, lo))
+      lo = rudp->floor_pn;
+    for(pn = lo; !RUDP_AFTER(pn, hi); pn++) {
+      segment = rudp_in_flight(rudp, pn);
+      if(segment == NULL)
+        continue;
+
+      rudp_land(rudp, segment);
+      segment->acked = TRUE;
+      rudp->delivered += segment->len;
+      rudp->delivered_us = now;
+      if(newest == NULL || RUDP_AFTER(pn, newest->pn))
+        newest = segment;
+    }
+  }
+
+  if(newest != NULL) {
+    rudp->pto_count = 0;
+    rudp->progress_us = now;
+    if(newest->pn == rudp->largest_acked)
+      rudp_update_rtt(rudp, now - newest->sent_us, ack_delay, now);
+    rudp_update_model(rudp, newest, now);
+    rudp->first_sent_us = newest->sent_us;
+    rudp_detect_loss(rudp, now);
+
+    while((segment = g_queue_peek_head(&rudp->sent)) != NULL && segment->acked) {
+      g_queue_pop_head_link(&rudp->sent);
+      rudp_segment_free(rudp, segment);
+    }
+    segment = g_queue_peek_head(&rudp->sent);
+    if(segment == NULL)
+      segment = g_queue_peek_head(&rudp->unsent);
+    rudp->acked_offset = segment != NULL ? segment->offset : rudp->next_offset;
+  }
+
+  rudp_pump(rudp);
+
+  // the same signal as the pseudo TCP, so the send queue moves on
+  if(rudp->blocked && rudp_room(rudp) >= rudp->window / 4) {
+    rudp->blocked = FALSE;
+    g_signal_emit_by_name(session->agent, "reliable-transport-writable", session->stream_id, 1);
+  }
+}
+
+static void
+rudp_send_ack(Rudp *rudp) {
+  guint8 packet[RUDP_ACK_HEADER_SIZE + 8 * RUDP_MAX_RANGES];
+  gint64 delay = rudp->n_ranges > 0 ? g_get_monotonic_time() - rudp->largest_recv_us : 0;
+  guint i;
+
+  packet[0] = RUDP_ACK;
+  packet[1] = rudp->n_ranges;
+  packet[2] = 0;
+  packet[3] = 0;
+  put32(packet + 4, MIN(delay, G_MAXUINT32));
+  put64(packet + 8, rudp->consumed + rudp->window);
+  for(i = 0; i < rudp->n_ranges; i++) {
+    put32(packet + RUDP_ACK_HEADER_SIZE + 8 * i, rudp->ranges[i].hi);
+    put32(packet + RUDP_ACK_HEADER_SIZE + 8 * i + 4, rudp->ranges[i].lo);
+  }
+  rudp_datagram(rudp, RUDP_ACK_HEADER_SIZE + 8 * rudp->n_ranges, packet);
+
+  rudp->unacked = 0;
+  if(rudp->ack_id != 0) {
+    g_source_remove(rudp->ack_id);
+    rudp->ack_id = 0;
+  }
+}
+
+static gboolean
+rudp_delayed_ack(gpointer rudp_ptr) {
+  Rudp *rudp = rudp_ptr;
+
+  rudp->ack_id = 0;
+  rudp_send_ack(rudp);
+
+  return FALSE;
+}
+
+// remembers the packet number for the next ACKs, FALSE if it was seen
+static gboolean
+rudp_record(Rudp *rudp, guint32 pn, guint32 floor_pn) {
+  RudpRange *ranges = rudp->ranges;
+  guint i;
+
+  // the sender does not wait for these any more
+  while(rudp->n_ranges > 0 && RUDP_AFTER(floor_pn, ranges[rudp->n_ranges - 1].hi))
+    rudp->n_ranges--;
+  if(rudp->n_ranges > 0 && RUDP_AFTER(floor_pn, ranges[rudp->n_ranges - 1].lo))
+    ranges[rudp->n_ranges - 1].lo = floor_pn;
+
+  for(i = 0; i < rudp->n_ranges; i++) {
+    if(!RUDP_AFTER(pn, ranges[i].hi) && !RUDP_AFTER(ranges[i].lo, pn))
+      return FALSE;
+
+    if(pn == ranges[i].hi + 1) {
+      ranges[i].hi = pn;
+      if(i > 0 && ranges[i - 1].lo == pn + 1) {
+        ranges[i - 1].lo = ranges[i].lo;
+        memmove(ranges + i, ranges + i + 1, (rudp->n_ranges - i - 1) * sizeof(RudpRange));
+        rudp->n_ranges--;
+      }
+      return TRUE;
+    }
+    if(pn + 1 == ranges[i].lo) {
+      ranges[i].lo = pn;
+      if(i + 1 < rudp->n_ranges && ranges[i + 1].hi + 1 == pn) {
+        ranges[i].lo = ranges[i + 1].lo;
+        memmove(ranges + i + 1, ranges + i + 2, (rudp->n_ranges - i - 2) * sizeof(RudpRange));
+        rudp->n_ranges--;
+      }
+      return TRUE;
+    }
+    if(RUDP_AFTER(pn, ranges[i].hi))
+      break;
+  }
+
+  // a range of its own, the oldest one goes if there are too many
+  if(i == RUDP_MAX_RANGES)
+    return TRUE;
+  if(rudp->n_ranges == RUDP_MAX_RANGES)
+    rudp->n_ranges--;
+  memmove(ranges + i + 1, ranges + i, (rudp->n_ranges - i) * sizeof(RudpRange));
+  ranges[i].hi = pn;
+  ranges[i].lo = pn;
+  rudp->n_ranges++;
+
+  return TRUE;
+}
+
+static void
+rudp_accept(Rudp *rudp, guint len, const guint8 *data) {
+  NiceSession *session = rudp->session;
+
+  rudp->recv_offset += len;
+
+  if(session->receiving_paused || rudp->held->len > 0) {
+    g_byte_array_append(rudp->held, data, len);
+    return;
+  }
+
+  rudp->consumed += len;
+  rudp->deliver(session->agent, session->stream_id, 1, len, (gchar*) data, session);
+}
+
+static void
+rudp_on_data(Rudp *rudp, guint len, const guint8 *packet) {
+  guint data_len = (packet[2] << 8) | packet[3];
+  guint32 pn = get32(packet + 4), floor_pn = get32(packet + 8);
+  guint64 offset = get64(packet + 12), end = offset + data_len;
+  const guint8 *data = packet + RUDP_HEADER_SIZE;
+  gboolean ack_now = FALSE;
+  RudpSegment *segment;
+
+  if(len != RUDP_HEADER_SIZE + data_len || data_len > RUDP_MSS) {
+    metrics.dropped++;
+    return;
+  }
+
+  // beyond the window: not acknowledged, so it comes again
+  if(end > rudp->consumed + rudp->window) {
+    g_debug("rudp: dropping %u bytes beyond the window\n", data_len);
+    return;
+  }
+
+  if(rudp->n_ranges == 0 || RUDP_AFTER(pn, rudp->ranges[0].hi)) {
+    rudp->largest_recv_us = g_get_monotonic_time();
+    // a gap, the sender should hear about it right away
+    ack_now = rudp->n_ranges > 0 && pn != rudp->ranges[0].hi + 1;
+  }
+  if(!rudp_record(rudp, pn, floor_pn) || data_len == 0 || end <= rudp->recv_offset)
+    ack_now = TRUE;
+
+  if(data_len > 0 && end > rudp->recv_offset) {
+    if(offset <= rudp->recv_offset) {
+      guint skip = rudp->recv_offset - offset;
+
+      rudp_accept(rudp, data_len - skip, data + skip);
+      while((segment = g_hash_table_lookup(rudp->out_of_order, &rudp->recv_offset)) != NULL) {
+        g_hash_table_steal(rudp->out_of_order, &segment->offset);
+        rudp_accept(rudp, segment->len, segment->data);
+        rudp_segment_free(rudp, segment);
+      }
+    }
+    else if(!g_hash_table_contains(rudp->out_of_order, &offset)) {
+      segment = rudp_segment_new(rudp);
+      segment->offset = offset;
+      segment->len = data_len;
+      memcpy(segment->data, data, data_len);
+      g_hash_table_insert(rudp->out_of_order, &segment->offset, segment);
+    }
+  }
+
+  // every packet while there is a hole
+  if(g_hash_table_size(rudp->out_of_order) > 0)
+    ack_now = TRUE;
+
+  if(ack_now || ++rudp->unacked >= RUDP_ACK_EVERY)
+    rudp_send_ack(rudp);
+  else if(rudp->ack_id == 0)
+    rudp->ack_id = g_timeout_add(RUDP_ACK_DELAY_US / 1000, rudp_delayed_ack, rudp);
+}
+
+void
+rudp_recv(NiceAgent *agent, guint stream_id, guint component_id, guint len,
+    gchar *buf, gpointer session_ptr) {
+  NiceSession *session = session_ptr;
+  const guint8 *packet = (const guint8*) buf;
+
+  if(len >= RUDP_HEADER_SIZE && packet[0] == RUDP_DATA)
+    rudp_on_data(session->rudp, len, packet);
+  else if(len >= RUDP_ACK_HEADER_SIZE && packet[0] == RUDP_ACK)
+    rudp_on_ack(session->rudp, len, packet);
+  else {
+    g_debug("rudp: dropping a datagram of %u bytes\n", len);
+    metrics.dropped++;
+  }
+}
+
+// takes as much as fits into the window, like the pseudo TCP
+gint
+rudp_send(NiceSession *session, guint len, const gchar *buf) {
+  Rudp *rudp = session->rudp;
+  guint taken = MIN(len, rudp_room(rudp)), offset = 0;
+
+  while(offset < taken) {
+    RudpSegment *segment = g_queue_peek_tail(&rudp->unsent);
+    guint chunk;
+
+    if(segment == NULL || segment->len == RUDP_MSS) {
+      segment = rudp_segment_new(rudp);
+      segment->offset = rudp->next_offset;
+      segment->len = 0;
+      g_queue_push_tail_link(&rudp->unsent, &segment->link);
+    }
+
+    chunk = MIN(RUDP_MSS - segment->len, taken - offset);
+    memcpy(segment->data + segment->len, buf + offset, chunk);
+    segment->len += chunk;
+    rudp->next_offset += chunk;
+    offset += chunk;
+  }
+
+  if(taken < len)
+    rudp->blocked = TRUE;
+  rudp_pump(rudp);
+
+  return taken;
+}
+
+void
+rudp_set_deliver(NiceSession *session, NiceAgentRecvFunc deliver) {
+  session->rudp->deliver = deliver;
+}
+
+// receiving is not paused any more, hands on what arrived in the meantime
+void
+rudp_resume(NiceSession *session) {
+  Rudp *rudp = session->rudp;
+
+  while(rudp->held->len > 0 && !session->receiving_paused) {
+    guint len = MIN(rudp->held->len, 65536);
+
+    rudp->consumed += len;
+    rudp->deliver(session->agent, session->stream_id, 1, len, (gchar*) rudp->held->data, session);
+    g_byte_array_remove_range(rudp->held, 0, len);
+  }
+
+  // the window opened
+  rudp_send_ack(rudp);
+}
+
+static void
+rudp_state_changed(NiceAgent *agent, guint stream_id, guint component_id, guint state,
+    gpointer session_ptr) {
+  NiceSession *session = session_ptr;
+  Rudp *rudp = session->rudp;
+
+  if(state != NICE_COMPONENT_STATE_READY || rudp->announced)
+    return;
+  rudp->announced = TRUE;
+
+  rudp_send_ack(rudp);
+  g_signal_emit_by_name(agent, "reliable-transport-writable", stream_id, component_id);
+  rudp_pump(rudp);
+}
+
+void
+rudp_init(NiceSession *session) {
+  Rudp *rudp = g_new0(Rudp, 1);
+  guint32 slots = 1;
+
+  rudp->session = session;
+  rudp->window = (guint64) transport_window * 1024;
+  rudp->peer_max_offset = rudp->window;
+
+  // every packet in flight needs a slot, with room for the ones in between
+  while(slots < 2 * rudp->window / RUDP_MSS + 64)
+    slots <<= 1;
+  rudp->flight = g_new0(RudpSegment*, slots);
+  rudp->flight_mask = slots - 1;
+  rudp->next_pn = 1;
+  rudp->floor_pn = 1;
+
+  g_queue_init(&rudp->sent);
+  g_queue_init(&rudp->unsent);
+  g_queue_init(&rudp->lost);
+  g_queue_init(&rudp->spare);
+  rudp->srtt = RUDP_INITIAL_RTT_US;
+  rudp->rttvar = RUDP_INITIAL_RTT_US / 2;
+  rudp->tokens_us = g_get_monotonic_time();
+  rudp->mode = RUDP_STARTUP;
+
+  rudp->out_of_order = g_hash_table_new_full(g_int64_hash, g_int64_equal, NULL, g_free);
+  rudp->held = g_byte_array_new();
+
+  session->rudp = rudp;
+  g_signal_connect(G_OBJECT(session->agent), "component-state-changed", G_CALLBACK(rudp_state_changed), session);
+}
+
+void
+rudp_free(NiceSession *session) {
+  Rudp *rudp = session->rudp;
+  GList *link;
+
+  if(rudp == NULL)
+    return;
+
+  if(rudp->timer_id != 0)
+    g_source_remove(rudp->timer_id);
+  if(rudp->pace_id != 0)
+    g_source_remove(rudp->pace_id);
+  if(rudp->ack_id != 0)
+    g_source_remove(rudp->ack_id);
+
+  // the links are part of the segments, lost ones are still in the sent queue
+  while((link = g_queue_pop_head_link(&rudp->sent)) != NULL)
+    g_free(link->data);
+  while((link = g_queue_pop_head_link(&rudp->unsent)) != NULL)
+    g_free(link->data);
+  while((link = g_queue_pop_head_link(&rudp->spare)) != NULL)
+    g_free(link->data);
+  g_free(rudp->flight);
+  g_hash_table_destroy(rudp->out_of_order);
+  g_byte_array_unref(rudp->held);
+
+  g_free(rudp);
+  session->rudp = NULL;
+}
+
+void
+rudp_report() {
+  g_message("rudp: sent %" G_GUINT64_FORMAT " packets, %" G_GUINT64_FORMAT " of them again (%.2f%%), %"
+    G_GUINT64_FORMAT " window probes\n", sent_packets, resent_packets,
+    sent_packets ? 100.0 * resent_packets / sent_packets : 0.0, probes);
+}
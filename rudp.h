@@ -0,0 +1,25 @@
+#ifndef __RUDP_H__
+#define __RUDP_H__
+
+#include <glib.h>
+#include <agent.h>
+
+#include "session.h"
+
+// flags, length, packet number, lowest packet number in flight, offset
+#define RUDP_HEADER_SIZE 20
+// with the header, IPv6, UDP and TURN this stays below 1280 bytes
+#define RUDP_MSS 1180
+// default for -w in KB: twice the BDP of a 150 ms path at 100 MB/s, a
+// lost packet holds up the window for about two round trips
+#define RUDP_DEFAULT_WINDOW 32768
+
+void rudp_init(NiceSession *session);
+void rudp_free(NiceSession *session);
+gint rudp_send(NiceSession *session, guint len, const gchar *buf);
+void rudp_set_deliver(NiceSession *session, NiceAgentRecvFunc deliver);
+void rudp_recv(NiceAgent *agent, guint stream_id, guint component_id, guint len, gchar *buf, gpointer session_ptr);
+void rudp_resume(NiceSession *session);
+void rudp_report();
+
+#endif
@@ -0,0 +1,171 @@
+#include <glib.h>
+#include <agent.h>
+
+#include "sendq.h"
+#include "session.h"
+#include "global.h"
+#include "metrics.h"
+#include "rudp.h"
+
+typedef struct {
+  GSourceFunc func;
+  gpointer data;
+} DrainCallback;
+
+// the agent's pseudo TCP, or the transport of our own with -U
+static gint
+sendq_agent_send(NiceSession *session, guint component_id, guint len, const gchar *buf) {
+  if(udp_transport)
+    return rudp_send(session, len, buf);
+
+  return nice_agent_send(session->agent, session->stream_id, component_id, len, buf);
+}
+
+static void
+sendq_flush(NiceSession *session, guint component_id) {
+  GByteArray *queue = session->send_queues[component_id - 1];
+  gint res;
+
+  while(queue->len > 0) {
+    res = sendq_agent_send(session, component_id, queue->len, (gchar*) queue->data);
+    if(res <= 0) {
+      metrics.send_failed++;
+      break;
+    }
+    if(res < queue->len)
+      metrics.send_short++;
+
+    g_byte_array_remove_range(queue, 0, res);
+    session->send_queued -= res;
+  }
+}
+
+static void
+sendq_run_drain_callbacks(NiceSession *session) {
+  GArray *callbacks = session->drain_callbacks;
+  guint i;
+
+  // callbacks may register themselves again, they go to the other array;
+  // both keep their size, so parking a source does not allocate
+  session->drain_callbacks = session->drain_running;
+  session->drain_running = callbacks;
+  for(i = 0; i < callbacks->len; i++) {
+    DrainCallback *callback = &g_array_index(callbacks, DrainCallback, i);
+    callback->func(callback->data);
+  }
+  g_array_set_size(callbacks, 0);
+}
+
+static void
+sendq_writable(NiceAgent *agent, guint stream_id, guint component_id, gpointer session_ptr) {
+  NiceSession *session = session_ptr;
+
+  sendq_flush(session, component_id);
+  g_debug("sendq: component %u writable, %zu bytes queued\n", component_id, session->send_queued);
+
+  if(session->send_queued < SENDQ_LOW_WATER)
+    sendq_run_drain_callbacks(session);
+}
+
+void
+sendq_init(NiceSession *session) {
+  guint i;
+
+  session->send_queues = g_new0(GByteArray*, n_components);
+  for(i = 0; i < n_components; i++)
+    session->send_queues[i] = g_byte_array_new();
+  session->drain_callbacks = g_array_new(FALSE, FALSE, sizeof(DrainCallback));
+  session->drain_running = g_array_new(FALSE, FALSE, sizeof(DrainCallback));
+
+  if(!not_reliable)
+    g_signal_connect(G_OBJECT(session->agent), "reliable-transport-writable",  G_CALLBACK(sendq_writable), session);
+}
+
+void
+sendq_free(NiceSession *session) {
+  guint i;
+
+  if(session->send_queues == NULL)
+    return;
+
+  for(i = 0; i < n_components; i++)
+    g_byte_array_unref(session->send_queues[i]);
+  g_free(session->send_queues);
+  session->send_queues = NULL;
+  g_array_unref(session->drain_callbacks);
+  g_array_unref(session->drain_running);
+  session->drain_callbacks = NULL;
+  session->drain_running = NULL;
+}
+
+gint
+sendq_send(NiceSession *session, guint component_id, guint len, const gchar *buf) {
+  GByteArray *queue = session->send_queues[component_id - 1];
+  gint res = 0;
+
+  // datagrams are either sent as a whole or lost
+  if(not_reliable) {
+    res = nice_agent_send(session->agent, session->stream_id, component_id, len, buf);
+    if(res < 0)
+      metrics.send_failed++;
+    return res;
+  }
+
+  // keep the byte order: only send directly if nothing is waiting
+  if(queue->len == 0) {
+    res = sendq_agent_send(session, component_id, len, buf);
+    if(res <= 0)
+      metrics.send_failed++;
+    else if(res < len)
+      metrics.send_short++;
+    if(res < 0)
+      res = 0;
+  }
+
+  if(res < len) {
+    g_byte_array_append(queue, (guint8*) buf + res, len - res);
+    session->send_queued += len - res;
+    g_debug("sendq: queued %u bytes on component %u (%zu total)\n", len - res, component_id, session->send_queued);
+  }
+
+  return len;
+}
+
+gsize
+sendq_pending(NiceSession *session, guint component_id) {
+  if(session->send_queues == NULL)
+    return 0;
+
+  return session->send_queues[component_id - 1]->len;
+}
+
+gboolean
+sendq_full(NiceSession *session) {
+  return session->send_held || session->send_queued >= SENDQ_HIGH_WATER;
+}
+
+// while held, sendq_full() tells local sources to stop reading
+void
+sendq_hold(NiceSession *session, gboolean hold) {
+  session->send_held = hold;
+
+  if(!hold && session->send_queued < SENDQ_LOW_WATER)
+    sendq_run_drain_callbacks(session);
+}
+
+// forgets what the agent did not accept, e.g. when its stream is gone
+void
+sendq_reset(NiceSession *session) {
+  guint i;
+
+  for(i = 0; i < n_components; i++)
+    g_byte_array_set_size(session->send_queues[i], 0);
+  session->send_queued = 0;
+}
+
+void
+sendq_on_drain(NiceSession *session, GSourceFunc func, gpointer data) {
+  DrainCallback callback = { func, data };
+
+  g_array_append_val(session->drain_callbacks, callback);
+}
@@ -0,0 +1,23 @@
+#ifndef __SENDQ_H__
+#define __SENDQ_H__
+
+#include <glib.h>
+#include <agent.h>
+
+#include "session.h"
+
+// stop reading local sources above this many queued bytes ...
+#define SENDQ_HIGH_WATER (256*1024)
+// ... and resume once the queue drained below this
+#define SENDQ_LOW_WATER (64*1024)
+
+void sendq_init(NiceSession *session);
+void sendq_free(NiceSession *session);
+gint sendq_send(NiceSession *session, guint component_id, guint len, const gchar *buf);
+gsize sendq_pending(NiceSession *session, guint component_id);
+gboolean sendq_full(NiceSession *session);
+void sendq_on_drain(NiceSession *session, GSourceFunc func, gpointer data);
+void sendq_hold(NiceSession *session, gboolean hold);
+void sendq_reset(NiceSession *session);
+
+#endif
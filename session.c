@@ -0,0 +1,153 @@
+#include <glib.h>
+#include <gio/gio.h>
+#include <agent.h>
+
+#include "session.h"
+#include "exchange.h"
+#include "sendq.h"
+#include "rudp.h"
+#include "resume.h"
+#include "dataplane.h"
+#include "tun.h"
+#include "coalesce.h"
+#include "batch.h"
+#include "mux.h"
+#include "compress.h"
+#include "tls.h"
+#include "reconnect.h"
+#include "fec.h"
+#include "stripe.h"
+#include "outq.h"
+#include "global.h"
+
+static GList *sessions = NULL;
+static gboolean keep_loop = FALSE;
+
+static void
+session_exchange_failed(gpointer session_ptr) {
+  session_end(session_ptr);
+}
+
+// exchange_options: NULL for the ones given with -e
+NiceSession*
+session_new(NiceAgent *agent, guint stream_id, const gchar *remote_hostname,
+    gint is_caller, guint forward_port, const gchar *exchange_options) {
+  NiceSession *session = g_new0(NiceSession, 1);
+
+  session->agent = agent;
+  session->stream_id = stream_id;
+  session->remote_hostname = g_strdup(remote_hostname);
+  session->is_caller = is_caller;
+  session->forward_port = forward_port;
+  session->exchange = exchange_session_new(is_caller, session->remote_hostname, exchange_options,
+    session_exchange_failed, session);
+
+  // setup who's caller and callee
+  if(is_caller)
+    g_debug("This instance is the caller of %s\n", remote_hostname);
+  else
+    g_debug("This instance is the callee of %s\n", remote_hostname);
+  g_object_set(G_OBJECT(agent), "controlling-mode", is_caller, NULL);
+
+  sessions = g_list_prepend(sessions, session);
+
+  return session;
+}
+
+void
+session_free(NiceSession *session) {
+  sessions = g_list_remove(sessions, session);
+
+  if(session->republish_id != 0)
+    g_source_remove(session->republish_id);
+  exchange_unwatch(session->exchange, session->remote_watch_id);
+  exchange_session_free(session->exchange);
+
+  // nothing of the agent may call back into the session any more
+  g_signal_handlers_disconnect_matched(session->agent, G_SIGNAL_MATCH_DATA,
+    0, 0, NULL, NULL, session);
+  g_object_unref(session->agent);
+
+  // the writer thread flushes into the connection
+  dataplane_free(session);
+
+  if(session->server != NULL) {
+    g_socket_service_stop(session->server);
+    g_object_unref(session->server);
+  }
+  // the connect callback sees that it was cancelled and leaves the session alone
+  if(session->connecting != NULL) {
+    g_cancellable_cancel(session->connecting);
+    g_object_unref(session->connecting);
+  }
+  if(session->connection != NULL)
+    g_object_unref(session->connection);
+  if(session->output_queue != NULL)
+    outq_free(session->output_queue);
+  if(session->parked_source != NULL)
+    g_io_channel_unref(session->parked_source);
+  if(session->known_candidates != NULL)
+    g_hash_table_destroy(session->known_candidates);
+  tun_free(session);
+  coalesce_free(session);
+  batch_free(session);
+  mux_free(session);
+  compress_free(session);
+  tls_free(session);
+  reconnect_free(session);
+  fec_free(session);
+  stripe_free(session);
+  sendq_free(session);
+  rudp_free(session);
+  resume_free(session);
+
+  g_free(session->remote_hostname);
+  g_free(session);
+}
+
+void
+session_free_all() {
+  while(sessions != NULL)
+    session_free(sessions->data);
+}
+
+static gboolean
+session_free_source(gpointer session_ptr) {
+  session_free(session_ptr);
+
+  // the sessions ended before the main loop ran, nothing is left
+  if(sessions == NULL && !keep_loop)
+    g_main_loop_quit(gloop);
+  return FALSE;
+}
+
+// The connection to this peer is over. The process ends with its last
+// session (unless it is a daemon), the others are freed once the current
+// callback returned. A session that fails while starting is freed as well,
+// other peers may still be added.
+void
+session_end(NiceSession *session) {
+  if(g_list_find(sessions, session) == NULL)
+    return;
+
+  if(sessions->next == NULL && !keep_loop && g_main_loop_is_running(gloop)) {
+    g_main_loop_quit(gloop);
+    return;
+  }
+
+  g_message("Session with %s ended, %u left.\n", session->remote_hostname,
+    g_list_length(sessions) - 1);
+  sessions = g_list_remove(sessions, session);
+  g_idle_add(session_free_source, session);
+}
+
+// the main loop keeps running without sessions
+void
+session_keep_loop(gboolean keep) {
+  keep_loop = keep;
+}
+
+guint
+session_count() {
+  return g_list_length(sessions);
+}
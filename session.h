@@ -0,0 +1,94 @@
+#ifndef __SESSION_H__
+#define __SESSION_H__
+
+#include <glib.h>
+#include <gio/gio.h>
+#include <agent.h>
+
+#include "exchange.h"
+#include "outq.h"
+
+typedef struct _Rudp Rudp;
+typedef struct _Resume Resume;
+typedef struct _Dataplane Dataplane;
+typedef struct _Tun Tun;
+typedef struct _Coalesce Coalesce;
+typedef struct _Batch Batch;
+typedef struct _Mux Mux;
+typedef struct _Compress Compress;
+typedef struct _Tls Tls;
+typedef struct _Reconnect Reconnect;
+typedef struct _Fec Fec;
+typedef struct _Stripe Stripe;
+
+// Everything about the connection to one peer. Callbacks get their session
+// as user data, so one main loop can drive the agents of many sessions; the
+// options in global.h are the same for all of them.
+typedef struct {
+  NiceAgent *agent;
+  guint stream_id;
+  gint is_caller;
+  gchar *remote_hostname;
+  guint forward_port;
+  gint output_fd;                 // where received data is written to
+  GSocketService *server;         // caller: accepts the local connection
+  GSocketConnection *connection;  // the local connection, once there is one
+  GCancellable *connecting;       // callee: set while connecting to the local port
+
+  ExchangeSession *exchange;
+
+  // remote data seen so far (util.c)
+  GHashTable *known_candidates;
+  gboolean remote_gathering_done;
+  gboolean remote_received;
+  gboolean remote_compression;    // offered by the peer, stays once seen
+  guint remote_watch_id;
+
+  // callbacks.c
+  guint republish_id;
+  gboolean started;
+  guint32 writable_components;
+  NiceAgentRecvFunc recv_func;
+  gboolean first_received;
+  gboolean receiving_paused;
+  guint32 held_components;      // striping: not read while ahead of the others
+  OutputQueue *output_queue;
+  guint read_chunks;            // size of the next read, in pool buffers
+  GIOChannel *parked_source;    // waits for the send queue to drain
+
+  // bytes the agent did not accept yet, per component (sendq.c)
+  GByteArray **send_queues;
+  gsize send_queued;
+  GArray *drain_callbacks;
+  GArray *drain_running;
+  gboolean send_held;
+
+  // the transport of its own with -U (rudp.c)
+  Rudp *rudp;
+
+  // the cached pair with -R (resume.c)
+  Resume *resume;
+
+  // the layers between the local side and the agent, each one NULL
+  // unless its option is given
+  Dataplane *dataplane;   // -x (dataplane.c)
+  Tun *tun;               // -T (tun.c)
+  Coalesce *coalesce;     // -T over pseudo TCP (coalesce.c)
+  Batch *batch;           // -b (batch.c)
+  Mux *mux;               // -m (mux.c)
+  Compress *compress;     // -Z (compress.c)
+  Tls *tls;               // -t (tls.c)
+  Reconnect *reconnect;   // -r (reconnect.c)
+  Fec *fec;               // -F (fec.c)
+  Stripe *stripe;         // -k (stripe.c)
+} NiceSession;
+
+NiceSession* session_new(NiceAgent *agent, guint stream_id, const gchar *remote_hostname,
+  gint is_caller, guint forward_port, const gchar *exchange_options);
+void session_free(NiceSession *session);
+void session_free_all();
+void session_end(NiceSession *session);
+void session_keep_loop(gboolean keep);
+guint session_count();
+
+#endif
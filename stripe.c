@@ -0,0 +1,229 @@
+#include <glib.h>
+#include <agent.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "stripe.h"
+#include "sendq.h"
+#include "callbacks.h"
+#include "metrics.h"
+#include "global.h"
+
+struct _Stripe {
+  NiceAgentRecvFunc deliver;
+  GByteArray **rx_buffers; // partially received segments, per component
+  GHashTable *reorder;     // out-of-order segments by sequence number
+  gsize reorder_bytes;
+  guint32 next_send_seq;
+  guint32 next_recv_seq;
+  guint next_component;
+};
+
+static void
+stripe_send_segment(NiceSession *session, const gchar *segment, gsize len) {
+  Stripe *stripe = session->stripe;
+  guint next_component = stripe->next_component;
+  guint i, index = next_component;
+
+  // round robin over the components that have no backlog, otherwise
+  // queue on the component with the shortest one
+  for(i = 0; i < n_components; i++) {
+    index = (next_component + i) % n_components;
+    if(sendq_pending(session, index + 1) == 0)
+      break;
+  }
+  if(i == n_components) {
+    for(i = 0; i < n_components; i++)
+      if(sendq_pending(session, i + 1) < sendq_pending(session, index + 1))
+        index = i;
+  }
+  stripe->next_component = (index + 1) % n_components;
+
+  sendq_send(session, index + 1, len, segment);
+}
+
+static void stripe_process(NiceSession *session, guint component_id);
+
+// the components that were ahead are read again
+static void
+stripe_release(NiceSession *session) {
+  guint component_id;
+
+  for(component_id = 1; component_id <= n_components && !session->receiving_paused; component_id++) {
+    if(!(session->held_components & (1 << (component_id - 1))))
+      continue;
+
+    g_debug("stripe: reading component %u again\n", component_id);
+    session->held_components &= ~(1 << (component_id - 1));
+    stripe_process(session, component_id);
+    resume_component(session, component_id);
+  }
+}
+
+// a component delivered a segment that has to wait, the missing one comes
+// on another component as every component is in order
+static void
+stripe_hold(NiceSession *session, guint component_id) {
+  g_debug("stripe: %zu bytes waiting, not reading component %u\n", session->stripe->reorder_bytes, component_id);
+  session->held_components |= 1 << (component_id - 1);
+  nice_agent_attach_recv(session->agent, session->stream_id, component_id,
+    g_main_loop_get_context(gloop), NULL, NULL);
+}
+
+// segments that were waiting for the ones delivered so far
+static void
+stripe_deliver_waiting(NiceSession *session) {
+  Stripe *stripe = session->stripe;
+  GByteArray *segment;
+
+  while(!session->receiving_paused
+      && (segment = g_hash_table_lookup(stripe->reorder, GUINT_TO_POINTER(stripe->next_recv_seq))) != NULL) {
+    stripe->reorder_bytes -= segment->len;
+    stripe->deliver(session->agent, session->stream_id, 1, segment->len, (gchar*) segment->data, session);
+    g_hash_table_remove(stripe->reorder, GUINT_TO_POINTER(stripe->next_recv_seq));
+    stripe->next_recv_seq++;
+  }
+
+  if(session->held_components != 0 && stripe->reorder_bytes < STRIPE_REORDER_MAX / 2)
+    stripe_release(session);
+}
+
+void
+stripe_init(NiceSession *session, NiceAgentRecvFunc deliver) {
+  Stripe *stripe = g_new0(Stripe, 1);
+  guint i;
+
+  stripe->deliver = deliver;
+  stripe->rx_buffers = g_new0(GByteArray*, n_components);
+  for(i = 0; i < n_components; i++)
+    stripe->rx_buffers[i] = g_byte_array_new();
+  stripe->reorder = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
+    (GDestroyNotify) g_byte_array_unref);
+  session->stripe = stripe;
+}
+
+void
+stripe_free(NiceSession *session) {
+  Stripe *stripe = session->stripe;
+  guint i;
+
+  if(stripe == NULL)
+    return;
+
+  for(i = 0; i < n_components; i++)
+    g_byte_array_unref(stripe->rx_buffers[i]);
+  g_free(stripe->rx_buffers);
+  g_hash_table_destroy(stripe->reorder);
+  g_free(stripe);
+  session->stripe = NULL;
+}
+
+// both peers start over on a new stream
+void
+stripe_reset(NiceSession *session) {
+  Stripe *stripe = session->stripe;
+  guint i;
+
+  for(i = 0; i < n_components; i++)
+    g_byte_array_set_size(stripe->rx_buffers[i], 0);
+  g_hash_table_remove_all(stripe->reorder);
+  stripe->reorder_bytes = 0;
+  session->held_components = 0;
+  stripe->next_send_seq = 0;
+  stripe->next_recv_seq = 0;
+  stripe->next_component = 0;
+}
+
+gint
+stripe_send(NiceSession *session, guint len, const gchar *buf) {
+  static gchar segment[STRIPE_HEADER_SIZE + STRIPE_MAX_SEGMENT];
+  gsize offset, chunk;
+
+  for(offset = 0; offset < len; offset += chunk) {
+    guint32 net_seq = g_htonl(session->stripe->next_send_seq++);
+    guint32 net_len;
+
+    chunk = MIN(len - offset, STRIPE_MAX_SEGMENT);
+    net_len = g_htonl(chunk);
+
+    memcpy(segment, &net_seq, sizeof(net_seq));
+    memcpy(segment + 4, &net_len, sizeof(net_len));
+    memcpy(segment + STRIPE_HEADER_SIZE, buf + offset, chunk);
+
+    stripe_send_segment(session, segment, STRIPE_HEADER_SIZE + chunk);
+  }
+
+  return len;
+}
+
+// delivers the segments received on the component, until receiving is
+// paused or the component is ahead too far
+static void
+stripe_process(NiceSession *session, guint component_id) {
+  Stripe *stripe = session->stripe;
+  GByteArray *rx = stripe->rx_buffers[component_id - 1];
+  guint32 held = 1 << (component_id - 1);
+  gsize offset = 0;
+
+  while(rx->len - offset >= STRIPE_HEADER_SIZE && !session->receiving_paused
+      && !(session->held_components & held)) {
+    gchar *segment = (gchar*) rx->data + offset;
+    guint32 seq, seg_len;
+
+    memcpy(&seq, segment, sizeof(seq));
+    memcpy(&seg_len, segment + 4, sizeof(seg_len));
+    seq = g_ntohl(seq);
+    seg_len = g_ntohl(seg_len);
+
+    // the peer never sends these; the stream cannot go on without the
+    // segment, but the other sessions of the process can
+    if(seg_len > STRIPE_MAX_SEGMENT) {
+      g_critical("stripe: segment too large (%u bytes), ending the session", seg_len);
+      metrics.dropped++;
+      g_byte_array_set_size(rx, 0);
+      session_end(session);
+      return;
+    }
+
+    // wait for the rest of the segment
+    if(rx->len - offset < STRIPE_HEADER_SIZE + seg_len)
+      break;
+
+    offset += STRIPE_HEADER_SIZE + seg_len;
+    if(seq == stripe->next_recv_seq) {
+      stripe->deliver(session->agent, session->stream_id, 1, seg_len, segment + STRIPE_HEADER_SIZE, session);
+      stripe->next_recv_seq++;
+      stripe_deliver_waiting(session);
+    }
+    else {
+      GByteArray *copy = g_byte_array_sized_new(seg_len);
+      g_byte_array_append(copy, (guint8*) segment + STRIPE_HEADER_SIZE, seg_len);
+      g_hash_table_insert(stripe->reorder, GUINT_TO_POINTER(seq), copy);
+      stripe->reorder_bytes += seg_len;
+      if(stripe->reorder_bytes >= STRIPE_REORDER_MAX)
+        stripe_hold(session, component_id);
+    }
+  }
+
+  g_byte_array_remove_range(rx, 0, offset);
+}
+
+void
+stripe_recv(NiceAgent *agent, guint stream_id, guint component_id, guint len,
+    gchar *buf, gpointer session_ptr) {
+  NiceSession *session = session_ptr;
+
+  g_byte_array_append(session->stripe->rx_buffers[component_id - 1], (guint8*) buf, len);
+  stripe_process(session_ptr, component_id);
+}
+
+// receiving is not paused any more: first what waited in the buffers
+void
+stripe_resume(NiceSession *session) {
+  guint component_id;
+
+  stripe_deliver_waiting(session);
+  for(component_id = 1; component_id <= n_components; component_id++)
+    stripe_process(session, component_id);
+}
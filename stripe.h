@@ -0,0 +1,23 @@
+#ifndef __STRIPE_H__
+#define __STRIPE_H__
+
+#include <glib.h>
+#include <agent.h>
+
+#include "session.h"
+
+// every segment starts with a sequence number and its payload length
+#define STRIPE_HEADER_SIZE 8
+#define STRIPE_MAX_SEGMENT 65536
+// segments waiting for an earlier one: above this the components that are
+// ahead are not read any more, until the others caught up below half of it
+#define STRIPE_REORDER_MAX (1024*1024)
+
+void stripe_init(NiceSession *session, NiceAgentRecvFunc deliver);
+void stripe_free(NiceSession *session);
+void stripe_reset(NiceSession *session);
+void stripe_resume(NiceSession *session);
+gint stripe_send(NiceSession *session, guint len, const gchar *buf);
+void stripe_recv(NiceAgent *agent, guint stream_id, guint component_id, guint len, gchar *buf, gpointer data);
+
+#endif
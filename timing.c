@@ -0,0 +1,160 @@
+#include <glib.h>
+#include <glib-unix.h>
+#include <agent.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+
+#include "timing.h"
+#include "util.h"
+#include "global.h"
+
+#define TIMING_MAX_COMPONENTS 16
+
+typedef struct {
+  guint component_id;
+  NiceComponentState state;
+  gint64 time;
+} StateChange;
+
+static const gchar *phase_name[TIMING_PHASES] = {
+  "start", "gather_start", "first_publish", "gathering_done", "publish_done",
+  "lookup_done", "writable", "first_sent", "first_received"
+};
+
+static gint64 start_real_time = 0;
+static gint caller = 0;
+static gint64 phase_time[TIMING_PHASES];
+static GArray *state_changes = NULL;
+static NiceCandidateType pair_local[TIMING_MAX_COMPONENTS];
+static NiceCandidateType pair_remote[TIMING_MAX_COMPONENTS];
+static gint pair_ip_version[TIMING_MAX_COMPONENTS];
+static gint64 pair_time[TIMING_MAX_COMPONENTS];
+
+// monotonic time, never 0 once marked
+static gint64
+timing_now() {
+  return g_get_monotonic_time() | 1;
+}
+
+static gboolean
+timing_signal(gpointer data) {
+  timing_report();
+  return TRUE;
+}
+
+void
+timing_init() {
+  state_changes = g_array_new(FALSE, FALSE, sizeof(StateChange));
+  timing_restart();
+
+  g_unix_signal_add(SIGUSR2, timing_signal, NULL);
+}
+
+// phases are measured from now on
+void
+timing_restart() {
+  start_real_time = g_get_real_time();
+  memset(phase_time, 0, sizeof(phase_time));
+  memset(pair_time, 0, sizeof(pair_time));
+  g_array_set_size(state_changes, 0);
+  phase_time[TIMING_START] = timing_now();
+}
+
+static void
+timing_state_changed(NiceAgent *agent, guint stream_id, guint component_id,
+    guint state, gpointer data) {
+  StateChange change = { component_id, state, timing_now() };
+
+  g_array_append_val(state_changes, change);
+}
+
+static void
+timing_writable(NiceAgent *agent, guint stream_id, guint component_id, gpointer data) {
+  timing_mark(TIMING_WRITABLE);
+}
+
+static void
+timing_selected_pair(NiceAgent *agent, guint stream_id, guint component_id,
+    NiceCandidate *lcand, NiceCandidate *rcand, gpointer data) {
+  if(component_id < 1 || component_id > TIMING_MAX_COMPONENTS)
+    return;
+
+  pair_local[component_id - 1] = lcand->type;
+  pair_remote[component_id - 1] = rcand->type;
+  pair_ip_version[component_id - 1] = nice_address_ip_version(&rcand->addr);
+  pair_time[component_id - 1] = timing_now();
+}
+
+void
+timing_attach(NiceSession *session) {
+  caller = session->is_caller;
+  g_signal_connect(G_OBJECT(session->agent), "component-state-changed", G_CALLBACK(timing_state_changed), session);
+  g_signal_connect(G_OBJECT(session->agent), "new-selected-pair-full", G_CALLBACK(timing_selected_pair), session);
+  if(!not_reliable)
+    g_signal_connect(G_OBJECT(session->agent), "reliable-transport-writable", G_CALLBACK(timing_writable), session);
+}
+
+// only the first time counts
+void
+timing_mark(TimingPhase phase) {
+  if(phase_time[phase] == 0)
+    phase_time[phase] = timing_now();
+}
+
+gboolean
+timing_marked(TimingPhase phase) {
+  return phase_time[phase] != 0;
+}
+
+static gdouble
+timing_ms(gint64 time) {
+  return (time - phase_time[TIMING_START]) / 1000.0;
+}
+
+// one JSON line, times in milliseconds since the process started
+void
+timing_report() {
+  GString *json = g_string_new(NULL);
+  const gchar *sep = "";
+  guint i;
+
+  g_string_append_printf(json, "{\"timing\":{\"start_unix_us\":%" G_GINT64_FORMAT
+    ",\"caller\":%i,\"reliable\":%s,\"phases\":{",
+    start_real_time, caller, not_reliable ? "false" : "true");
+
+  for(i = 0; i < TIMING_PHASES; i++) {
+    if(phase_time[i] == 0)
+      continue;
+    g_string_append_printf(json, "%s\"%s\":%.3f", sep, phase_name[i], timing_ms(phase_time[i]));
+    sep = ",";
+  }
+
+  g_string_append(json, "},\"states\":[");
+  for(i = 0; i < state_changes->len; i++) {
+    StateChange *change = &g_array_index(state_changes, StateChange, i);
+
+    g_string_append_printf(json, "%s{\"component\":%u,\"state\":\"%s\",\"ms\":%.3f}",
+      i ? "," : "", change->component_id, nice_component_state_to_string(change->state),
+      timing_ms(change->time));
+  }
+
+  g_string_append(json, "],\"pairs\":[");
+  sep = "";
+  for(i = 0; i < TIMING_MAX_COMPONENTS; i++) {
+    if(pair_time[i] == 0)
+      continue;
+    g_string_append_printf(json, "%s{\"component\":%u,\"local\":\"%s\",\"remote\":\"%s\",\"ip\":%i,\"ms\":%.3f}",
+      sep, i + 1, candidate_type_to_string(pair_local[i]), candidate_type_to_string(pair_remote[i]),
+      pair_ip_version[i], timing_ms(pair_time[i]));
+    sep = ",";
+  }
+  g_string_append(json, "]}}\n");
+
+  // a separate line of its own, so scripts can grep for it
+  fputs(json->str, stderr);
+  fflush(stderr);
+
+  g_string_free(json, TRUE);
+}
@@ -0,0 +1,29 @@
+#ifndef __TIMING_H__
+#define __TIMING_H__
+
+#include <glib.h>
+#include <agent.h>
+
+#include "session.h"
+
+typedef enum {
+  TIMING_START,
+  TIMING_GATHER_START,
+  TIMING_FIRST_PUBLISH,
+  TIMING_GATHERING_DONE,
+  TIMING_PUBLISH_DONE,
+  TIMING_LOOKUP_DONE,
+  TIMING_WRITABLE,
+  TIMING_FIRST_SENT,
+  TIMING_FIRST_RECEIVED,
+  TIMING_PHASES
+} TimingPhase;
+
+void timing_init();
+void timing_restart();
+void timing_attach(NiceSession *session);
+void timing_mark(TimingPhase phase);
+gboolean timing_marked(TimingPhase phase);
+void timing_report();
+
+#endif
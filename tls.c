@@ -0,0 +1,317 @@
+#include <glib.h>
+#include <agent.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#include "tls.h"
+#include "callbacks.h"
+#include "sendq.h"
+#include "global.h"
+
+// DTLS record header: type, version, epoch, sequence number, length
+#define DTLS_RECORD_HEADER_SIZE 13
+
+struct _Tls {
+  NiceAgentRecvFunc deliver;
+  SSL_CTX *ctx;
+  SSL *ssl;
+  BIO *rbio;
+  BIO *wbio;
+  GByteArray *pending_plain; // written before the handshake finished
+  gboolean holding;          // local sources parked for the handshake
+  guint timer_id;
+};
+
+static void tls_schedule_timer(NiceSession *session);
+
+static void
+tls_fail(NiceSession *session, const gchar *what) {
+  gchar err[256];
+
+  ERR_error_string_n(ERR_get_error(), err, sizeof(err));
+  g_critical("TLS error in %s: %s\n", what, err);
+  session_end(session);
+}
+
+static void
+tls_send_datagrams(NiceSession *session, const guint8 *data, gsize len) {
+  gsize start = 0, offset = 0;
+
+  // pack whole records into datagrams, a record must never be split
+  while(offset < len) {
+    gsize record_len = len - offset;
+
+    if(record_len >= DTLS_RECORD_HEADER_SIZE)
+      record_len = MIN(record_len, DTLS_RECORD_HEADER_SIZE +
+        ((data[offset + 11] << 8) | data[offset + 12]));
+
+    if(offset > start && offset + record_len - start > TLS_DATAGRAM_MTU) {
+      send_raw(session, offset - start, (const gchar*) data + start);
+      start = offset;
+    }
+    offset += record_len;
+  }
+
+  if(offset > start)
+    send_raw(session, offset - start, (const gchar*) data + start);
+}
+
+static void
+tls_flush(NiceSession *session) {
+  static guint8 *buf = NULL;
+  static gsize buf_size = 0;
+  BIO *wbio = session->tls->wbio;
+  gsize pending = BIO_ctrl_pending(wbio);
+
+  if(pending == 0)
+    return;
+
+  if(pending > buf_size) {
+    buf_size = pending;
+    buf = g_realloc(buf, buf_size);
+  }
+  BIO_read(wbio, buf, pending);
+
+  if(not_reliable)
+    tls_send_datagrams(session, buf, pending);
+  else
+    send_raw(session, pending, (gchar*) buf);
+}
+
+static void
+tls_write(NiceSession *session, const gchar *buf, gsize len) {
+  SSL *ssl = session->tls->ssl;
+
+  while(len > 0) {
+    // a datagram has to stay one record
+    gint chunk = not_reliable ? len : MIN(len, SSL3_RT_MAX_PLAIN_LENGTH);
+    gint res = SSL_write(ssl, buf, chunk);
+
+    if(res <= 0) {
+      tls_fail(session, "SSL_write");
+      return;
+    }
+
+    buf += res;
+    len -= res;
+
+    if(not_reliable)
+      tls_flush(session);
+  }
+
+  tls_flush(session);
+}
+
+static gboolean
+tls_timeout(gpointer session_ptr) {
+  NiceSession *session = session_ptr;
+
+  session->tls->timer_id = 0;
+
+  if(DTLSv1_handle_timeout(session->tls->ssl) < 0) {
+    tls_fail(session_ptr, "DTLSv1_handle_timeout");
+    return FALSE;
+  }
+  tls_flush(session_ptr);
+  tls_schedule_timer(session_ptr);
+
+  return FALSE;
+}
+
+static void
+tls_schedule_timer(NiceSession *session) {
+  Tls *tls = session->tls;
+  struct timeval tv;
+
+  // DTLS has to retransmit lost handshake flights itself
+  if(!not_reliable || tls->timer_id != 0 || SSL_is_init_finished(tls->ssl))
+    return;
+
+  if(DTLSv1_get_timeout(tls->ssl, &tv))
+    tls->timer_id = g_timeout_add(tv.tv_sec*1000 + tv.tv_usec/1000, tls_timeout, session);
+}
+
+static void
+tls_handshake(NiceSession *session) {
+  Tls *tls = session->tls;
+  SSL *ssl = tls->ssl;
+  gint res = SSL_do_handshake(ssl);
+  gint err;
+
+  tls_flush(session);
+
+  if(res == 1) {
+    g_debug("TLS handshake done (%s, %s)\n", SSL_get_version(ssl), SSL_get_cipher(ssl));
+
+    if(tls->pending_plain->len > 0) {
+      tls_write(session, (gchar*) tls->pending_plain->data, tls->pending_plain->len);
+      g_byte_array_set_size(tls->pending_plain, 0);
+    }
+    if(tls->holding) {
+      tls->holding = FALSE;
+      sendq_hold(session, FALSE);
+    }
+    return;
+  }
+
+  err = SSL_get_error(ssl, res);
+  if(err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE) {
+    tls_fail(session, "SSL_do_handshake");
+    return;
+  }
+
+  tls_schedule_timer(session);
+}
+
+void
+tls_init(NiceSession *session, NiceAgentRecvFunc deliver) {
+  Tls *tls = g_new0(Tls, 1);
+
+  tls->deliver = deliver;
+  tls->pending_plain = g_byte_array_new();
+  session->tls = tls;
+}
+
+void
+tls_free(NiceSession *session) {
+  Tls *tls = session->tls;
+
+  if(tls == NULL)
+    return;
+
+  if(tls->timer_id != 0)
+    g_source_remove(tls->timer_id);
+  // the BIOs belong to the SSL object
+  if(tls->ssl != NULL)
+    SSL_free(tls->ssl);
+  if(tls->ctx != NULL)
+    SSL_CTX_free(tls->ctx);
+  g_byte_array_unref(tls->pending_plain);
+  g_free(tls);
+  session->tls = NULL;
+}
+
+// FALSE if the certificates cannot be used, the session ends then
+gboolean
+tls_start(NiceSession *session) {
+  Tls *tls = session->tls;
+  const gchar *local_crt = g_getenv("NICE_LOCAL_CRT");
+  const gchar *remote_crt = exchange_remote_certificate(session->exchange);
+  gchar *key_file;
+  SSL_CTX *ctx;
+  SSL *ssl;
+
+  if(tls->ssl != NULL)
+    return TRUE;
+
+  if(local_crt == NULL || remote_crt == NULL) {
+    g_critical("TLS needs NICE_LOCAL_CRT and the certificate of the peer (or NICE_REMOTE_CRT)!");
+    session_end(session);
+    return FALSE;
+  }
+
+  // the same key and certificates socat used to be given
+  key_file = g_build_filename(g_get_home_dir(), ".ssh", "id_rsa", NULL);
+  ctx = tls->ctx = SSL_CTX_new(not_reliable ? DTLS_method() : TLS_method());
+  if(SSL_CTX_use_certificate_file(ctx, local_crt, SSL_FILETYPE_PEM) != 1 ||
+      SSL_CTX_use_PrivateKey_file(ctx, key_file, SSL_FILETYPE_PEM) != 1 ||
+      SSL_CTX_check_private_key(ctx) != 1) {
+    g_critical("Error loading certificate '%s' and key '%s'!", local_crt, key_file);
+    goto fail;
+  }
+  if(SSL_CTX_load_verify_locations(ctx, remote_crt, NULL) != 1) {
+    g_critical("Error loading remote certificate '%s'!", remote_crt);
+    goto fail;
+  }
+  SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER | SSL_VERIFY_FAIL_IF_NO_PEER_CERT, NULL);
+  g_free(key_file);
+
+  ssl = tls->ssl = SSL_new(ctx);
+  tls->rbio = BIO_new(BIO_s_mem());
+  tls->wbio = BIO_new(BIO_s_mem());
+  BIO_set_mem_eof_return(tls->rbio, -1);
+  SSL_set_bio(ssl, tls->rbio, tls->wbio);
+
+  if(not_reliable) {
+    SSL_set_options(ssl, SSL_OP_NO_QUERY_MTU);
+    SSL_set_mtu(ssl, TLS_DATAGRAM_MTU);
+  }
+
+  // the caller is the client, like socat's openssl-connect used to be
+  if(session->is_caller)
+    SSL_set_connect_state(ssl);
+  else
+    SSL_set_accept_state(ssl);
+
+  // bytes have to wait for the handshake, so local sources stop after their
+  // first read instead of piling everything up in pending_plain
+  if(!not_reliable) {
+    tls->holding = TRUE;
+    sendq_hold(session, TRUE);
+  }
+
+  tls_handshake(session);
+  return TRUE;
+
+ fail:
+  g_free(key_file);
+  SSL_CTX_free(ctx);
+  tls->ctx = NULL;
+  session_end(session);
+  return FALSE;
+}
+
+gint
+tls_send(NiceSession *session, guint len, const gchar *buf) {
+  Tls *tls = session->tls;
+
+  if(tls->ssl == NULL || !SSL_is_init_finished(tls->ssl)) {
+    // datagrams are not worth keeping, bytes are sent after the handshake
+    if(!not_reliable)
+      g_byte_array_append(tls->pending_plain, (guint8*) buf, len);
+    return len;
+  }
+
+  tls_write(session, buf, len);
+  return len;
+}
+
+void
+tls_recv(NiceAgent *agent, guint stream_id, guint component_id, guint len,
+    gchar *buf, gpointer session_ptr) {
+  static gchar plain[SSL3_RT_MAX_PLAIN_LENGTH];
+  NiceSession *session = session_ptr;
+  Tls *tls = session->tls;
+  gint res, err;
+
+  if(tls->ssl == NULL && !tls_start(session))
+    return;
+
+  BIO_write(tls->rbio, buf, len);
+
+  if(!SSL_is_init_finished(tls->ssl)) {
+    tls_handshake(session);
+    if(!SSL_is_init_finished(tls->ssl))
+      return;
+  }
+
+  while((res = SSL_read(tls->ssl, plain, sizeof(plain))) > 0)
+    tls->deliver(agent, stream_id, component_id, res, plain, session);
+
+  err = SSL_get_error(tls->ssl, res);
+  if(err == SSL_ERROR_ZERO_RETURN) {
+    g_debug("TLS connection closed by peer\n");
+    session_end(session);
+    return;
+  }
+  else if(err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE)
+    tls_fail(session, "SSL_read");
+
+  // e.g. TLS 1.3 session tickets or key updates
+  tls_flush(session);
+}
@@ -0,0 +1,20 @@
+#ifndef __TLS_H__
+#define __TLS_H__
+
+#include <glib.h>
+#include <agent.h>
+
+#include "session.h"
+
+// DTLS records are packed into datagrams of at most this size
+#define TLS_DATAGRAM_MTU 1200
+// a datagram grows by up to this much as a record: header, IV/nonce, MAC and padding
+#define TLS_DATAGRAM_OVERHEAD 80
+
+void tls_init(NiceSession *session, NiceAgentRecvFunc deliver);
+void tls_free(NiceSession *session);
+gboolean tls_start(NiceSession *session);
+gint tls_send(NiceSession *session, guint len, const gchar *buf);
+void tls_recv(NiceAgent *agent, guint stream_id, guint component_id, guint len, gchar *buf, gpointer session_ptr);
+
+#endif
@@ -0,0 +1,286 @@
+#include <glib.h>
+#include <agent.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <linux/if_tun.h>
+#include <linux/ipv6.h>
+
+#include "tun.h"
+#include "batch.h"
+#include "coalesce.h"
+#include "sendq.h"
+#include "callbacks.h"
+#include "util.h"
+#include "metrics.h"
+#include "compress.h"
+#include "fec.h"
+#include "tls.h"
+#include "global.h"
+
+// outer headers that are not part of the tun MTU
+#define TUN_UDP_OVERHEAD 8
+#define TUN_TURN_OVERHEAD 36   // TURN send indication
+
+struct _Tun {
+  gint fd;
+  gchar name[IFNAMSIZ];
+  guint watch_id;
+};
+
+// Exits on errors: only for setting up the device, which -T does once per
+// process (it cannot be combined with -N or -D). Code that runs per session
+// in a process with others has to end the session instead.
+static void
+tun_ioctl(Tun *tun, gint sock, gulong request, gpointer arg, const gchar *what) {
+  if(ioctl(sock, request, arg) < 0) {
+    g_critical("Error setting %s of %s: %s", what, tun->name, g_strerror(errno));
+    exit(1);
+  }
+}
+
+static void
+tun_add_address(Tun *tun, const gchar *address) {
+  gchar **parts = g_strsplit(address, "/", 2);
+  struct ifreq ifr;
+  struct sockaddr_in *sin = (struct sockaddr_in*) &ifr.ifr_addr;
+  struct in6_ifreq ifr6;
+  gint sock;
+
+  memset(&ifr, 0, sizeof(ifr));
+  strncpy(ifr.ifr_name, tun->name, IFNAMSIZ - 1);
+
+  if(inet_pton(AF_INET, parts[0], &sin->sin_addr) == 1) {
+    guint prefix = parts[1] ? atoi(parts[1]) : 32;
+
+    sock = socket(AF_INET, SOCK_DGRAM, 0);
+    sin->sin_family = AF_INET;
+    tun_ioctl(tun, sock, SIOCSIFADDR, &ifr, "address");
+
+    sin->sin_addr.s_addr = htonl(prefix ? 0xffffffff << (32 - prefix) : 0);
+    tun_ioctl(tun, sock, SIOCSIFNETMASK, &ifr, "netmask");
+  }
+  else if(inet_pton(AF_INET6, parts[0], &ifr6.ifr6_addr) == 1) {
+    sock = socket(AF_INET6, SOCK_DGRAM, 0);
+    tun_ioctl(tun, sock, SIOCGIFINDEX, &ifr, "index");
+
+    ifr6.ifr6_ifindex = ifr.ifr_ifindex;
+    ifr6.ifr6_prefixlen = parts[1] ? atoi(parts[1]) : 128;
+    tun_ioctl(tun, sock, SIOCSIFADDR, &ifr6, "IPv6 address");
+  }
+  else {
+    g_critical("Invalid tun address '%s'!", address);
+    exit(1);
+  }
+
+  close(sock);
+  g_strfreev(parts);
+}
+
+gint
+tun_open(NiceSession *session, const gchar *addresses) {
+  Tun *tun = g_new0(Tun, 1);
+  struct ifreq ifr;
+  gchar **list;
+  gint i, sock;
+
+  session->tun = tun;
+  tun->fd = open("/dev/net/tun", O_RDWR | O_NONBLOCK);
+  if(tun->fd < 0) {
+    g_critical("Error opening /dev/net/tun: %s", g_strerror(errno));
+    exit(1);
+  }
+
+  // one IP packet per read() and write(), without packet info header
+  memset(&ifr, 0, sizeof(ifr));
+  ifr.ifr_flags = IFF_TUN | IFF_NO_PI;
+  strncpy(ifr.ifr_name, "nice%d", IFNAMSIZ - 1);
+  if(ioctl(tun->fd, TUNSETIFF, &ifr) < 0) {
+    g_critical("Error creating tun device: %s", g_strerror(errno));
+    exit(1);
+  }
+  strncpy(tun->name, ifr.ifr_name, IFNAMSIZ);
+
+  tun_set_mtu(session, TUN_PATH_MTU);
+
+  // e.g. "10.0.1.2/24,fd00:1::2/64"
+  list = g_strsplit(addresses, ",", 0);
+  for(i = 0; list[i]; i++)
+    if(strlen(list[i]) > 0)
+      tun_add_address(tun, list[i]);
+  g_strfreev(list);
+
+  sock = socket(AF_INET, SOCK_DGRAM, 0);
+  tun_ioctl(tun, sock, SIOCGIFFLAGS, &ifr, "flags");
+  ifr.ifr_flags |= IFF_UP | IFF_RUNNING;
+  tun_ioctl(tun, sock, SIOCSIFFLAGS, &ifr, "flags");
+  close(sock);
+
+  g_message("Created network interface %s with IP# %s\n", tun->name, addresses);
+
+  return tun->fd;
+}
+
+// closing the fd removes the device
+void
+tun_free(NiceSession *session) {
+  Tun *tun = session->tun;
+
+  if(tun == NULL)
+    return;
+
+  if(tun->watch_id != 0)
+    g_source_remove(tun->watch_id);
+  close(tun->fd);
+  g_free(tun);
+  session->tun = NULL;
+}
+
+void
+tun_set_mtu(NiceSession *session, guint mtu) {
+  Tun *tun = session->tun;
+  struct ifreq ifr;
+  gint sock;
+
+  memset(&ifr, 0, sizeof(ifr));
+  strncpy(ifr.ifr_name, tun->name, IFNAMSIZ - 1);
+  ifr.ifr_mtu = mtu;
+
+  sock = socket(AF_INET, SOCK_DGRAM, 0);
+  tun_ioctl(tun, sock, SIOCSIFMTU, &ifr, "MTU");
+  close(sock);
+
+  g_debug("tun: %s MTU set to %u\n", tun->name, mtu);
+}
+
+// the largest inner packet that still fits into one datagram on the
+// selected candidate pair
+static guint
+tun_path_mtu(NiceSession *session) {
+  NiceCandidate *local = NULL, *remote = NULL;
+  guint mtu = TUN_PATH_MTU - TUN_UDP_OVERHEAD;
+
+  if(nice_agent_get_selected_pair(session->agent, session->stream_id, 1, &local, &remote)) {
+    mtu -= (nice_address_ip_version(&remote->addr) == 6) ? 40 : 20;
+    if(local->type == NICE_CANDIDATE_TYPE_RELAYED ||
+        remote->type == NICE_CANDIDATE_TYPE_RELAYED)
+      mtu -= TUN_TURN_OVERHEAD;
+  }
+  else
+    mtu -= 40 + TUN_TURN_OVERHEAD;
+
+  if(use_tls)
+    mtu -= TLS_DATAGRAM_OVERHEAD;
+  if(use_compression)
+    mtu -= COMPRESS_HEADER_SIZE;
+  // the parity of a full sized packet has to fit as well
+  if(fec_spec != NULL)
+    mtu -= FEC_OVERHEAD;
+
+  if(mtu < 1280)
+    g_message("tun: MTU %u is below the IPv6 minimum of 1280\n", mtu);
+
+  return mtu;
+}
+
+static gboolean
+tun_resume(gpointer session_ptr) {
+  NiceSession *session = session_ptr;
+  GIOChannel* channel = g_io_channel_unix_new(session->tun->fd);
+
+  session->tun->watch_id = g_io_add_watch(channel, G_IO_IN, tun_send_data, session);
+  g_io_channel_unref(channel);
+
+  return FALSE;
+}
+
+void
+tun_start(NiceSession *session) {
+  unpublish_local_credentials(session);
+
+  // over the reliable stream packets are framed, their size does not matter
+  tun_set_mtu(session, not_reliable ? tun_path_mtu(session) : TUN_PATH_MTU);
+
+  tun_resume(session);
+}
+
+gboolean
+tun_send_data(GIOChannel *source, GIOCondition cond, gpointer session_ptr) {
+  static gchar buffer[TUN_MAX_PACKET];
+  NiceSession *session = session_ptr;
+  Tun *tun = session->tun;
+  gssize res;
+  gsize packet_len;
+  gint i;
+
+  if(batch_size > 1) {
+    if(batch_send_data(source, cond, session_ptr))
+      return TRUE;
+    tun->watch_id = 0;
+    return FALSE;
+  }
+
+  // every read() returns exactly one packet
+  for(i = 0; i < 64; i++) {
+    if(sendq_full(session)) {
+      // leave the packets in the tun queue until the agent caught up
+      sendq_on_drain(session, tun_resume, session);
+      tun->watch_id = 0;
+      return FALSE;
+    }
+
+    res = read(tun->fd, buffer, sizeof(buffer));
+    if(res < 0) {
+      if(errno != EAGAIN && errno != EWOULDBLOCK) {
+        g_critical("Error reading from %s: errno=%i\n", tun->name, errno);
+        session_end(session);
+        tun->watch_id = 0;
+        return FALSE;
+      }
+      break;
+    }
+
+    if(!parse_packet(buffer, res, &packet_len)) {
+      g_debug("tun: dropping malformed packet (%zi bytes)\n", res);
+      continue;
+    }
+
+    if(not_reliable)
+      send_to_peer(session, packet_len, buffer);
+    else
+      coalesce_packet(session, buffer, packet_len);
+  }
+
+  return TRUE;
+}
+
+void
+tun_recv(NiceAgent *agent, guint stream_id, guint component_id, guint len,
+    gchar *buf, gpointer data) {
+  NiceSession *session = data;
+  gsize packet_len;
+
+  if(!parse_packet(buf, len, &packet_len)) {
+    g_debug("tun: dropping malformed packet (%u bytes)\n", len);
+    return;
+  }
+
+  // a full tun queue drops the packet like a full router queue would
+  if(write(session->tun->fd, buf, packet_len) < 0) {
+    if(errno != EAGAIN)
+      g_debug("tun: write to %s failed: errno=%i\n", session->tun->name, errno);
+    metrics.dropped++;
+    return;
+  }
+
+  metrics.received_bytes += packet_len;
+  metrics.received_messages++;
+}
@@ -0,0 +1,22 @@
+#ifndef __TUN_H__
+#define __TUN_H__
+
+#include <glib.h>
+#include <agent.h>
+
+#include "session.h"
+
+// largest IP packet read from or written to the tun device
+#define TUN_MAX_PACKET 65535
+
+// path MTU assumed when sizing the tun device
+#define TUN_PATH_MTU 1500
+
+gint tun_open(NiceSession *session, const gchar *addresses);
+void tun_free(NiceSession *session);
+void tun_set_mtu(NiceSession *session, guint mtu);
+void tun_start(NiceSession *session);
+gboolean tun_send_data(GIOChannel *source, GIOCondition cond, gpointer session_ptr);
+void tun_recv(NiceAgent *agent, guint stream_id, guint component_id, guint len, gchar *buf, gpointer data);
+
+#endif
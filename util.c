@@ -2,19 +2,33 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <glib-unix.h>
 
 #include "util.h"
+#include "exchange.h"
+#include "timing.h"
+#include "resume.h"
+#include "reconnect.h"
+#include "session.h"
 #include "global.h"
 
 static const gchar *candidate_type_name[] = {"host", "srflx", "prflx", "relay"};
 
+const gchar*
+candidate_type_to_string(NiceCandidateType type) {
+  return candidate_type_name[type];
+}
+
 void
 log_stderr(const gchar *log_domain,
             GLogLevelFlags log_level,
             const gchar *message,
-            gpointer user_data) {
+            gpointer is_caller) {
   //if(log_level < G_LOG_LEVEL_DEBUG)
-    fprintf(stderr, "%i: %s", is_caller, message);
+    fprintf(stderr, "%i: %s", GPOINTER_TO_INT(is_caller), message);
 }
 
 gboolean
@@ -41,83 +55,184 @@ resolve_hostname(gchar* hostname, gchar** out_addr) {
 }
 
 
-gint
-execute_sync(gchar *cmd, gchar* stdin, gchar** stdout, gchar** stderr) {
+typedef struct {
+  gchar *cmd;
   GPid pid;
-  gboolean spawned;
-  gint exit_status;
-  gint stdio[3];
-  gint i;
+  gint status;
+  gboolean exited;
+  guint open_pipes;
+  gint out_fd, err_fd;
+  GString *in, *out, *err;
+  gsize in_written;
+  guint timeout_id;
+  ExecuteDoneFunc done;
+  gpointer user_data;
+} Execution;
+
+static void
+execute_finish(Execution *e) {
+  // the output is complete once the child exited and both pipes hit EOF
+  if(!e->exited || e->open_pipes > 0)
+    return;
+
+  if(e->timeout_id != 0)
+    g_source_remove(e->timeout_id);
+
+  e->done(e->status, e->out, e->err, e->user_data);
+
+  g_string_free(e->in, TRUE);
+  g_string_free(e->out, TRUE);
+  g_string_free(e->err, TRUE);
+  g_free(e->cmd);
+  g_free(e);
+}
 
-  gchar **env = g_get_environ();
-  env = g_environ_setenv(env, "NICE_REMOTE_HOSTNAME", remote_hostname, TRUE);
-  gchar** argv;
-  gint argc;
+static gboolean
+execute_write(GIOChannel *source, GIOCondition cond, gpointer execution_ptr) {
+  Execution *e = execution_ptr;
+  gint fd = g_io_channel_unix_get_fd(source);
+  gssize res = 0;
 
-  // parse command line to argv array
-  if(!g_shell_parse_argv(cmd, &argc, &argv, NULL)) {
-    g_critical("Error parsing command line '%s'", cmd);
+  if(e->in_written < e->in->len)
+    res = write(fd, e->in->str + e->in_written, e->in->len - e->in_written);
 
-    exit(1);
+  if(res > 0)
+    e->in_written += res;
+  else if(res < 0 && (errno == EAGAIN || errno == EINTR))
+    return TRUE;
+
+  if(res < 0 || e->in_written == e->in->len) {
+    close(fd);
+    return FALSE;
   }
 
-  g_debug("Executing '%s'\n", cmd);
-  // spawn process
-  spawned = g_spawn_async_with_pipes(".", argv, env, G_SPAWN_DO_NOT_REAP_CHILD, NULL, NULL,
-    &pid, &stdio[0], &stdio[1], &stdio[2], NULL);
-  g_assert(spawned);
+  return TRUE;
+}
+
+static gboolean
+execute_read(GIOChannel *source, GIOCondition cond, gpointer execution_ptr) {
+  Execution *e = execution_ptr;
+  gint fd = g_io_channel_unix_get_fd(source);
+  GString *buf = (fd == e->out_fd) ? e->out : e->err;
+  gchar chunk[4096];
+  gssize res;
+
+  res = read(fd, chunk, sizeof(chunk));
+  if(res > 0) {
+    g_string_append_len(buf, chunk, res);
+    return TRUE;
+  }
+  if(res < 0 && (errno == EAGAIN || errno == EINTR))
+    return TRUE;
+
+  close(fd);
+  e->open_pipes--;
+  execute_finish(e);
+
+  return FALSE;
+}
 
-  // write stdin data
-  if(stdin)
-    write(stdio[0], stdin, strlen(stdin));
-  close(stdio[0]);
+static void
+execute_exited(GPid pid, gint status, gpointer execution_ptr) {
+  Execution *e = execution_ptr;
 
-  // wait for process to finish
-  waitpid(pid, &exit_status, 0);
   g_spawn_close_pid(pid);
+  e->status = status;
+  e->exited = TRUE;
+  execute_finish(e);
+}
 
-  gsize max_size = 10240;
-  gsize bytes_read;
+static gboolean
+execute_timeout(gpointer execution_ptr) {
+  Execution *e = execution_ptr;
 
-  // read stdout
-  if(stdout) {
-    gchar* buf = g_malloc(max_size*sizeof(gchar));
+  g_critical("'%s' did not finish in time, terminating it", e->cmd);
+  kill(e->pid, SIGTERM);
+  e->timeout_id = 0;
 
-    bytes_read = read(stdio[1], buf, sizeof(gchar)*max_size);
-    g_assert(bytes_read != max_size); // let's assume the output won't be larger than max_size-1
-    *stdout = g_malloc0(bytes_read);
-    memcpy(*stdout, buf, bytes_read);
+  return FALSE;
+}
 
-    g_free(buf);
-  }
+static void
+execute_watch(gint fd, GIOCondition cond, GIOFunc func, Execution *e) {
+  GIOChannel *channel;
 
-  // read stderr
-  if(stderr) {
-    gchar* buf = g_malloc(max_size*sizeof(gchar));
+  g_unix_set_fd_nonblocking(fd, TRUE, NULL);
+  channel = g_io_channel_unix_new(fd);
+  g_io_add_watch(channel, cond | G_IO_HUP | G_IO_ERR, func, e);
+  g_io_channel_unref(channel);
+}
 
-    bytes_read = read(stdio[2], buf, sizeof(gchar)*max_size);
-    g_assert(bytes_read != max_size); // let's assume the output won't be larger than max_size-1
-    *stderr = g_malloc0(bytes_read);
-    memcpy(*stderr, buf, bytes_read);
+// Runs cmd without blocking the main loop. stdin is written to the child,
+// its whole stdout and stderr are passed to done once it exited. The child
+// is terminated if it runs longer than timeout_ms (0: no timeout). A cmd
+// that cannot be started reaches done with status -1 before this returns.
+void
+execute_async(const gchar *cmd, const gchar *remote_hostname, const gchar *stdin,
+    guint timeout_ms, ExecuteDoneFunc done, gpointer user_data) {
+  Execution *e;
+  gint in_fd;
+  GError *error = NULL;
 
-    g_free(buf);
-  }
+  gchar **env = g_get_environ();
+  env = g_environ_setenv(env, "NICE_REMOTE_HOSTNAME", remote_hostname, TRUE);
+  gchar** argv;
+  gint argc;
 
-  close(stdio[1]);
-  close(stdio[2]);
+  e = g_new0(Execution, 1);
+  e->cmd = g_strdup(cmd);
+  e->in = g_string_new(stdin);
+  e->out = g_string_new(NULL);
+  e->err = g_string_new(NULL);
+  e->done = done;
+  e->user_data = user_data;
 
-  return exit_status;
+  // parse command line to argv array
+  if(!g_shell_parse_argv(cmd, &argc, &argv, &error)) {
+    g_critical("Error parsing command line '%s'", cmd);
+    goto fail;
+  }
+
+  g_debug("Executing '%s'\n", cmd);
+  // spawn process
+  if(!g_spawn_async_with_pipes(".", argv, env, G_SPAWN_DO_NOT_REAP_CHILD, NULL, NULL,
+      &e->pid, &in_fd, &e->out_fd, &e->err_fd, &error)) {
+    g_critical("Error executing '%s': %s", cmd, error->message);
+    g_strfreev(argv);
+    goto fail;
+  }
+  g_strfreev(argv);
+  g_strfreev(env);
+
+  execute_watch(in_fd, G_IO_OUT, execute_write, e);
+  execute_watch(e->out_fd, G_IO_IN, execute_read, e);
+  execute_watch(e->err_fd, G_IO_IN, execute_read, e);
+  e->open_pipes = 2;
+
+  g_child_watch_add(e->pid, execute_exited, e);
+  if(timeout_ms > 0)
+    e->timeout_id = g_timeout_add(timeout_ms, execute_timeout, e);
+  return;
+
+ fail:
+  // reported to done like a command that failed, right away
+  g_string_append(e->err, error->message);
+  g_error_free(error);
+  g_strfreev(env);
+  e->status = -1;
+  e->exited = TRUE;
+  execute_finish(e);
 }
 
 
 void
-local_credentials_to_string(NiceAgent *agent, guint stream_id, guint component_id, gchar** out) {
-  gchar buf[1024];
-  gchar tmp[1024];
+local_credentials_to_string(NiceAgent *agent, guint stream_id, gboolean gathering_done, gchar** out) {
+  GString *buf;
   gchar *local_ufrag = NULL;
   gchar *local_password = NULL;
   gchar ipaddr[INET6_ADDRSTRLEN];
   GSList *cands = NULL, *item;
+  guint component_id;
 
   if(!nice_agent_get_local_credentials(agent, stream_id,
       &local_ufrag, &local_password)) {
@@ -126,52 +241,83 @@ local_credentials_to_string(NiceAgent *agent, guint stream_id, guint component_i
     exit(1);
   }
 
-  cands = nice_agent_get_local_candidates(agent, stream_id, component_id);
-  if(cands == NULL) {
-    g_critical("Error reading local candidates!");
-    g_object_unref(agent);
-    exit(1);
-  }
+  buf = g_string_new(NULL);
+  g_string_append_printf(buf, "%s %s", local_ufrag, local_password);
+
+  for(component_id = 1; component_id <= n_components; component_id++) {
+    cands = nice_agent_get_local_candidates(agent, stream_id, component_id);
+    if(cands == NULL) {
+      // while trickling, a component may not have candidates yet
+      if(!gathering_done)
+        continue;
+
+      g_critical("Error reading local candidates!");
+      g_object_unref(agent);
+      exit(1);
+    }
 
-  sprintf(buf, "%s %s", local_ufrag, local_password);
+    for (item = cands; item; item = item->next) {
+      NiceCandidate *c = (NiceCandidate *)item->data;
 
-  for (item = cands; item; item = item->next) {
-    NiceCandidate *c = (NiceCandidate *)item->data;
+      nice_address_to_string(&c->addr, ipaddr);
 
-    nice_address_to_string(&c->addr, ipaddr);
+      // (foundation),(prio),(addr),(port),(type)[,(component)]
+      g_string_append_printf(buf, " %s,%u,%s,%u,%s",
+          c->foundation,
+          c->priority,
+          ipaddr,
+          nice_address_get_port(&c->addr),
+          candidate_type_name[c->type]);
+      if(component_id != 1)
+        g_string_append_printf(buf, ",%u", component_id);
+    }
 
-    // (foundation),(prio),(addr),(port),(type)
-    sprintf(tmp, " %s,%u,%s,%u,%s",
-        c->foundation,
-        c->priority,
-        ipaddr,
-        nice_address_get_port(&c->addr),
-        candidate_type_name[c->type]);
-    strcat(buf, tmp);
+    g_slist_free_full(cands, (GDestroyNotify)&nice_candidate_free);
   }
-  sprintf(tmp, "\n");
-  strcat(buf, tmp);
+
+  if(use_compression)
+    g_string_append(buf, " " COMPRESSION_OFFER);
+
+  // tells the peer that no more candidates will follow
+  if(gathering_done)
+    g_string_append(buf, " " END_OF_CANDIDATES);
+  g_string_append(buf, "\n");
 
   g_free(local_ufrag);
   g_free(local_password);
-  g_slist_free_full(cands, (GDestroyNotify)&nice_candidate_free);
 
-  *out = g_malloc(strlen(buf)+1);
-  strcpy(*out, buf);
+  *out = g_string_free(buf, FALSE);
 }
 
 
+// the next remote data is for a new stream (ICE restart)
 void
-parse_remote_data(NiceAgent *agent, guint stream_id, guint component_id, char *line, gsize len) {
+forget_remote_data(NiceSession *session) {
+  if(session->known_candidates != NULL)
+    g_hash_table_remove_all(session->known_candidates);
+  session->remote_gathering_done = FALSE;
+}
+
+// May be called again whenever the remote peer published more candidates
+// (trickle ICE): only candidates that were not seen before are added.
+// Broken data ends the session, FALSE then.
+gboolean
+parse_remote_data(NiceSession *session, char *line, gsize len) {
+  NiceAgent *agent = session->agent;
+  guint stream_id = session->stream_id;
   GSList *remote_candidates = NULL;
   gchar **line_argv = NULL;
   const gchar *ufrag = NULL;
   const gchar *passwd = NULL;
-  int result = EXIT_FAILURE;
+  gboolean end_of_candidates = FALSE;
+  guint component_id;
   int i;
 
   g_assert(line[len] == '\0'); // Make sure string is null-terminated
 
+  if(session->known_candidates == NULL)
+    session->known_candidates = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
   line_argv = g_strsplit_set(line, " \t\n", 0);
   for (i = 0; line_argv && line_argv[i]; i++) {
     if (strlen (line_argv[i]) == 0)
@@ -182,48 +328,74 @@ parse_remote_data(NiceAgent *agent, guint stream_id, guint component_id, char *l
       ufrag = line_argv[i];
     } else if (!passwd) {
       passwd = line_argv[i];
-    } else {
-      // Remaining args are serialized canidates (at least one is required)
+    } else if (strcmp(line_argv[i], END_OF_CANDIDATES) == 0) {
+      end_of_candidates = TRUE;
+    } else if (strcmp(line_argv[i], COMPRESSION_OFFER) == 0) {
+      if (!session->remote_compression)
+        g_debug("remote peer offers compression%s\n", use_compression ? ", using it" : "");
+      session->remote_compression = TRUE;
+    } else if (!g_hash_table_contains(session->known_candidates, line_argv[i])) {
+      // Remaining args are serialized canidates
       NiceCandidate *c = parse_candidate(line_argv[i], stream_id);
 
       if (c == NULL) {
         g_critical("failed to parse candidate: %s", line_argv[i]);
         continue;
       }
+      g_hash_table_add(session->known_candidates, g_strdup(line_argv[i]));
       remote_candidates = g_slist_prepend(remote_candidates, c);
     }
   }
-  if (ufrag == NULL || passwd == NULL || remote_candidates == NULL) {
-    g_critical("line must have at least ufrag, password, and one candidate");
-
-    if (line_argv != NULL)
-      g_strfreev(line_argv);
-    if (remote_candidates != NULL)
-      g_slist_free_full(remote_candidates, (GDestroyNotify)&nice_candidate_free);
-    exit(1);
+  if (ufrag == NULL || passwd == NULL) {
+    g_critical("line must have at least ufrag and password");
+    goto fail;
   }
 
   if (!nice_agent_set_remote_credentials(agent, stream_id, ufrag, passwd)) {
     g_critical("failed to set remote credentials");
-
-    if (line_argv != NULL)
-      g_strfreev(line_argv);
-    if (remote_candidates != NULL)
-      g_slist_free_full(remote_candidates, (GDestroyNotify)&nice_candidate_free);
-    exit(1);
+    goto fail;
   }
+  resume_remote_credentials(session, ufrag, passwd);
 
   // Note: this will trigger the start of negotiation.
-  if (nice_agent_set_remote_candidates(agent, stream_id, component_id,
-      remote_candidates) < 1) {
-    g_critical("failed to set remote candidates");
-
-    if (line_argv != NULL)
-      g_strfreev(line_argv);
-    if (remote_candidates != NULL)
-      g_slist_free_full(remote_candidates, (GDestroyNotify)&nice_candidate_free);
-    exit(1);
+  for (component_id = 1; component_id <= n_components; component_id++) {
+    GSList *component_candidates = NULL, *item;
+
+    for (item = remote_candidates; item; item = item->next) {
+      NiceCandidate *c = (NiceCandidate *)item->data;
+      if (c->component_id == component_id)
+        component_candidates = g_slist_prepend(component_candidates, c);
+    }
+
+    if (component_candidates != NULL &&
+        nice_agent_set_remote_candidates(agent, stream_id, component_id,
+        component_candidates) < 1) {
+      g_critical("failed to set remote candidates for component %u", component_id);
+
+      g_slist_free(component_candidates);
+      goto fail;
+    }
+    g_slist_free(component_candidates);
+  }
+  g_debug("added %u remote candidates\n", g_slist_length(remote_candidates));
+
+  // until then the agent keeps waiting for more candidates instead of failing
+  if (end_of_candidates && !session->remote_gathering_done) {
+    g_debug("remote candidate gathering done\n");
+    nice_agent_peer_candidate_gathering_done(agent, stream_id);
+    session->remote_gathering_done = TRUE;
   }
+
+  g_strfreev(line_argv);
+  g_slist_free_full(remote_candidates, (GDestroyNotify)&nice_candidate_free);
+  return TRUE;
+
+ fail:
+  // only this peer's session, the others in the process go on
+  g_strfreev(line_argv);
+  g_slist_free_full(remote_candidates, (GDestroyNotify)&nice_candidate_free);
+  session_end(session);
+  return FALSE;
 }
 
 
@@ -234,9 +406,9 @@ parse_candidate(char *scand, guint stream_id) {
   gchar **tokens = NULL;
   guint i;
 
-  tokens = g_strsplit(scand, ",", 5);
+  tokens = g_strsplit(scand, ",", 6);
   for(i = 0; tokens && tokens[i]; i++);
-  if (i != 5)
+  if (i != 5 && i != 6)
     goto end;
 
   for (i = 0; i < G_N_ELEMENTS(candidate_type_name); i++) {
@@ -249,7 +421,7 @@ parse_candidate(char *scand, guint stream_id) {
     goto end;
 
   cand = nice_candidate_new(ntype);
-  cand->component_id = 1;
+  cand->component_id = (tokens[5] != NULL) ? atoi(tokens[5]) : 1;
   cand->stream_id = stream_id;
   cand->transport = NICE_CANDIDATE_TRANSPORT_UDP;
   strncpy(cand->foundation, tokens[0], NICE_CANDIDATE_MAX_FOUNDATION);
@@ -271,84 +443,61 @@ parse_candidate(char *scand, guint stream_id) {
 }
 
 void
-publish_local_credentials(NiceAgent* agent, guint stream_id) {
-  gint retval;
-
-  // publish local credentials
-  gchar publish_cmd[1024];
-  g_snprintf(publish_cmd, sizeof(publish_cmd), "./niceexchange.sh 0 %s publish dummy", remote_hostname);
-  if(is_caller)
-    publish_cmd[18] = '1';
-
-  gchar *stdin;
-  local_credentials_to_string(agent, stream_id, 1, &stdin);
-
-  retval = execute_sync(publish_cmd, stdin, NULL, NULL);
-  if(retval != 0) {
-    g_critical("niceexchange publish returned a non-zero return value (%i)!", retval);
- 
-    g_main_loop_unref(gloop);
-    g_object_unref(agent);
+publish_local_credentials(NiceSession *session, gboolean gathering_done) {
+  gchar *credentials;
+
+  local_credentials_to_string(session->agent, session->stream_id, gathering_done, &credentials);
+  exchange_publish(session->exchange, credentials, gathering_done);
+  g_free(credentials);
 
-    exit(1);
-  }
-  g_free(stdin);
   g_debug("published local credentials\n");
 }
 
 void
-unpublish_local_credentials(NiceAgent* agent, guint stream_id) {
-  guint retval;
+unpublish_local_credentials(NiceSession *session) {
+  exchange_unpublish(session->exchange);
 
-  g_debug("lookup remote credentials done\n");
-  gchar unpublish_cmd[1024];
-  g_snprintf(unpublish_cmd, sizeof(unpublish_cmd), "./niceexchange.sh 0 %s unpublish dummy", remote_hostname);
-  if(is_caller)
-    unpublish_cmd[18] = '1';
-
-  retval = execute_sync(unpublish_cmd, NULL, NULL, NULL);
-  if(retval != 0) {
-    g_critical("niceexchange unpublish returned a non-zero return value (%i)!", retval);
- 
-    g_main_loop_unref(gloop);
-    g_object_unref(agent);
+  // with -r new remote data means that the peer restarted ICE
+  if(auto_reconnect)
+    return;
 
-    exit(1);
-  }
-  g_debug("unpublish local credentials done\n");
+  exchange_unwatch(session->exchange, session->remote_watch_id);
+  session->remote_watch_id = 0;
 }
 
-void
-lookup_remote_credentials(NiceAgent* agent, guint stream_id) {
-  guint retval;
-
-  gchar lookup_cmd[1024];
-  g_snprintf(lookup_cmd, sizeof(lookup_cmd), "./niceexchange.sh 0 %s lookup dummy", remote_hostname);
-  if(is_caller)
-    lookup_cmd[18] = '1';
-
-  gchar *stdout;
-  gchar *stderr;
-  retval = execute_sync(lookup_cmd, NULL, &stdout, &stderr);
-  if(retval != 0) {
-    g_critical("niceexchange lookup returned a non-zero return value (%i)!", retval);
-    if(stderr != NULL)
-      g_critical("This was written to stderr:\n%s", stderr);
-    g_free(stdout);
-    g_free(stderr);
- 
-    g_main_loop_unref(gloop);
-    g_object_unref(agent);
+static void
+remote_credentials_received(const gchar *data, gsize len, gpointer session_ptr) {
+  NiceSession *session = session_ptr;
+  gchar *line = g_strndup(data, len);
 
-    exit(1);
+  g_debug("lookup remote credentials done\n");
+  timing_mark(TIMING_LOOKUP_DONE);
+  if((!auto_reconnect || reconnect_remote_data(session, line)) && !parse_remote_data(session, line, len)) {
+    g_free(line);
+    return;
   }
-  parse_remote_data(agent, stream_id, 1, stdout, strlen(stdout));
-  g_free(stdout);
-  g_free(stderr);
+  g_free(line);
+
+  if(!session->remote_received)
+    pipe_stdio_to_hook(session->remote_hostname, "NICE_PIPE_BEFORE", exit_if_child_exited);
+  session->remote_received = TRUE;
+}
+
+// Providers that can watch deliver every update of the remote data, so
+// candidates trickle in; otherwise the data is looked up once.
+void
+lookup_remote_credentials(NiceSession *session) {
+  // still watching since the last ICE restart
+  if(session->remote_watch_id != 0)
+    return;
+
+  session->remote_watch_id = exchange_watch(session->exchange, remote_credentials_received, session);
+  if(session->remote_watch_id == 0)
+    exchange_lookup(session->exchange, remote_credentials_received, session);
 }
 
 GPid
-pipe_stdio_to_hook(const gchar* envvar_name, GSourceFunc callback) {
+pipe_stdio_to_hook(const gchar *remote_hostname, const gchar* envvar_name, GSourceFunc callback) {
   gchar** argv;
   gint argc;
   gchar **env = g_get_environ();
@@ -396,25 +545,46 @@ pipe_stdio_to_hook(const gchar* envvar_name, GSourceFunc callback) {
   return pid;
 }
 
+// Returns TRUE if buffer starts with a complete IPv4 or IPv6 packet and
+// stores its length in packet_len. Otherwise packet_len is the number of
+// bytes needed to tell, or 0 if buffer does not start with an IP packet.
 gboolean
-parse_packet(gchar* buffer, gsize *buf_len, gchar* packet, gsize* packet_len) {
-  gchar ip_ver = buffer[0] & 0xf0;
-  switch(ip_ver) {
+parse_packet(const gchar* buffer, gsize buf_len, gsize* packet_len) {
+  const guint8 *header = (const guint8*) buffer;
+
+  if(buf_len < 1) {
+    *packet_len = 20;
+    return FALSE;
+  }
+
+  switch(header[0] & 0xf0) {
     case 0x40:
-      *packet_len = buffer[2] < 8 | buffer[3];
+      if(buf_len < 20) {
+        *packet_len = 20;
+        return FALSE;
+      }
+      // total length includes the header
+      *packet_len = header[2] << 8 | header[3];
+      if(*packet_len < 20) {
+        *packet_len = 0;
+        return FALSE;
+      }
     break;
     case 0x60:
-    //break;
+      if(buf_len < 40) {
+        *packet_len = 40;
+        return FALSE;
+      }
+      // payload length excludes the fixed header
+      *packet_len = 40 + (header[4] << 8 | header[5]);
+    break;
     default:
-      g_critical("Unknown packet type (%x)!", ip_ver);
-      exit(1);
-  }
-  if(*buf_len >= *packet_len) {
-    memcpy(packet, buffer, *packet_len);
-    *buf_len -= *packet_len;
-    return TRUE;
+      g_debug("Unknown packet type (%x)!\n", header[0] & 0xf0);
+      *packet_len = 0;
+      return FALSE;
   }
-  return FALSE;
+
+  return buf_len >= *packet_len;
 }
 
 gboolean
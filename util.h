@@ -4,24 +4,38 @@
 #include <glib.h>
 #include <agent.h>
 
+#include "session.h"
+
 gboolean resolve_hostname(gchar* hostname, gchar** out_addr);
-gint execute_sync(gchar *cmd, gchar* stdin, gchar** stdout, gchar** stderr);
-void local_credentials_to_string(NiceAgent *agent, guint stream_id, guint component_id, gchar** out);
-void parse_remote_data(NiceAgent *agent, guint stream_id, guint component_id, char *line, gsize len);
+typedef void (*ExecuteDoneFunc)(gint status, GString *out, GString *err, gpointer user_data);
+
+void execute_async(const gchar *cmd, const gchar *remote_hostname, const gchar *stdin, guint timeout_ms,
+  ExecuteDoneFunc done, gpointer user_data);
+// last token of the credentials line once all local candidates are in it
+#define END_OF_CANDIDATES "end-of-candidates"
+// offers compression (-Z), it is used if both peers offer it
+#define COMPRESSION_OFFER "compress-lz4"
+
+void local_credentials_to_string(NiceAgent *agent, guint stream_id, gboolean gathering_done, gchar** out);
+void forget_remote_data(NiceSession *session);
+gboolean parse_remote_data(NiceSession *session, char *line, gsize len);
 NiceCandidate* parse_candidate(char *scand, guint stream_id);
 
-void publish_local_credentials(NiceAgent* agent, guint stream_id);
-void unpublish_local_credentials(NiceAgent* agent, guint stream_id);
-void lookup_remote_credentials(NiceAgent* agent, guint stream_id);
+void publish_local_credentials(NiceSession *session, gboolean gathering_done);
+void unpublish_local_credentials(NiceSession *session);
+void lookup_remote_credentials(NiceSession *session);
+
+const gchar* candidate_type_to_string(NiceCandidateType type);
 
 void log_stderr(const gchar *log_domain,
                       GLogLevelFlags log_level,
                       const gchar *message,
-                      gpointer user_data);
+                      gpointer is_caller);
 
 gboolean
-parse_packet(gchar* buffer, gsize *buf_len, gchar* packet, gsize* packet_len);
+parse_packet(const gchar* buffer, gsize buf_len, gsize* packet_len);
 
+GPid pipe_stdio_to_hook(const gchar *remote_hostname, const gchar* envvar_name, GSourceFunc callback);
 gboolean exit_if_child_exited(gpointer data);
 gboolean terminate_child_and_exit(gpointer data);
 
@@ -0,0 +1,259 @@
+#define _GNU_SOURCE
+
+#include <glib.h>
+#include <gio/gio.h>
+#include <agent.h>
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "zerocopy.h"
+#include "callbacks.h"
+#include "util.h"
+#include "timing.h"
+#include "metrics.h"
+#include "global.h"
+
+typedef struct {
+  gchar *data;
+  // stream offset just past the last byte read into it, free once the reader
+  // has consumed up to there
+  guint64 end;
+} ZerocopyBuffer;
+
+// nicepipe_raw has a single session
+static NiceSession *zerocopy_session = NULL;
+static GPollableInputStream *zerocopy_input = NULL;
+static gint zerocopy_fd = -1;
+
+static ZerocopyBuffer ring[ZEROCOPY_BUFFERS];
+static guint ring_next = 0;
+
+// copied with write() when the next ring buffer is still in the pipe
+static gchar *bounce = NULL;
+
+// bytes handed to the pipe, and how many of them the reader has taken
+static guint64 handed_on = 0;
+static guint64 consumed = 0;
+
+// data that did not fit into the pipe yet
+static gchar *parked = NULL;
+static gboolean parked_splice = FALSE;
+static gsize parked_offset = 0;
+static gsize parked_len = 0;
+
+static void zerocopy_watch_agent();
+
+// vmsplice() without SPLICE_F_GIFT only lends our pages to the pipe, so a
+// buffer may not be overwritten before the reader has taken its bytes: ask
+// the pipe how much it still holds. A reader that splice()s the pages on
+// instead of read()ing them could still see a buffer change afterwards.
+static gboolean
+zerocopy_reusable(ZerocopyBuffer *buffer) {
+  gint queued;
+
+  if(buffer->end <= consumed)
+    return TRUE;
+  if(ioctl(zerocopy_fd, FIONREAD, &queued) != 0)
+    return FALSE;
+
+  consumed = handed_on - queued;
+  return buffer->end <= consumed;
+}
+
+// Returns FALSE on errors; a full pipe leaves the rest in parked.
+static gboolean
+zerocopy_hand_on() {
+  struct iovec iov;
+
+  while(parked_offset < parked_len) {
+    gssize res;
+
+    if(parked_splice) {
+      iov.iov_base = parked + parked_offset;
+      iov.iov_len = parked_len - parked_offset;
+      res = vmsplice(zerocopy_fd, &iov, 1, SPLICE_F_NONBLOCK);
+    } else {
+      res = write(zerocopy_fd, parked + parked_offset, parked_len - parked_offset);
+    }
+
+    if(res < 0) {
+      if(errno == EAGAIN)
+        return TRUE;
+      if(errno == EINTR)
+        continue;
+
+      g_critical("Error writing to output: %s() errno=%i\n", parked_splice ? "vmsplice" : "write", errno);
+      return FALSE;
+    }
+
+    parked_offset += res;
+    handed_on += res;
+  }
+
+  parked = NULL;
+  return TRUE;
+}
+
+// the reader made room, hand on the rest and read from the agent again
+static gboolean
+zerocopy_writable(GIOChannel *source, GIOCondition cond, gpointer data) {
+  if(!zerocopy_hand_on()) {
+    session_end(zerocopy_session);
+    return FALSE;
+  }
+  if(parked != NULL)
+    return TRUE;
+
+  g_debug("zerocopy: output drained, reading again\n");
+  zerocopy_watch_agent();
+  return FALSE;
+}
+
+static void
+zerocopy_park() {
+  GIOChannel *channel = g_io_channel_unix_new(zerocopy_fd);
+
+  // the agent keeps the data meanwhile and the pseudo TCP window closes
+  g_debug("zerocopy: output full, %zu bytes waiting\n", parked_len - parked_offset);
+  g_io_add_watch(channel, G_IO_OUT, zerocopy_writable, NULL);
+  g_io_channel_unref(channel);
+}
+
+static gboolean
+zerocopy_recv(GObject *stream, gpointer session_ptr) {
+  NiceSession *session = session_ptr;
+  GPollableInputStream *input = G_POLLABLE_INPUT_STREAM(stream);
+  GError *error = NULL;
+  ZerocopyBuffer *buffer;
+  gchar *data;
+  gssize len;
+
+  while(TRUE) {
+    // many short reads can pin every buffer, copy until the reader catches up
+    buffer = &ring[ring_next];
+    data = zerocopy_reusable(buffer) ? buffer->data : bounce;
+
+    len = g_pollable_input_stream_read_nonblocking(input, data, ZEROCOPY_READ_SIZE, NULL, &error);
+    if(len < 0) {
+      if(g_error_matches(error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK)) {
+        g_error_free(error);
+        return TRUE;
+      }
+
+      g_critical("Error receiving: %s\n", error->message);
+      g_error_free(error);
+      session_end(session);
+      return FALSE;
+    }
+
+    if(len == 0) {
+      // remote side closed the stream
+      session_end(session);
+      return FALSE;
+    }
+
+    g_debug("zerocopy_recv(fd=%i, len=%zi, splice=%i)\n", zerocopy_fd, len, data != bounce);
+    if(!session->first_received) {
+      timing_mark(TIMING_FIRST_RECEIVED);
+      session->first_received = TRUE;
+      unpublish_local_credentials(session);
+    }
+    metrics.received_bytes += len;
+    metrics.received_messages++;
+
+    if(data != bounce) {
+      buffer->end = handed_on + len;
+      ring_next = (ring_next + 1) % ZEROCOPY_BUFFERS;
+    }
+
+    parked = data;
+    parked_splice = data != bounce;
+    parked_offset = 0;
+    parked_len = len;
+    if(!zerocopy_hand_on()) {
+      session_end(session);
+      return FALSE;
+    }
+    if(parked != NULL) {
+      zerocopy_park();
+      return FALSE;
+    }
+  }
+}
+
+static void
+zerocopy_watch_agent() {
+  GSource *source = g_pollable_input_stream_create_source(zerocopy_input, NULL);
+
+  g_source_set_callback(source, (GSourceFunc) zerocopy_recv, zerocopy_session, NULL);
+  g_source_attach(source, g_main_loop_get_context(gloop));
+  g_source_unref(source);
+}
+
+gboolean
+zerocopy_init(gint fd) {
+  struct stat st;
+  glong pipe_size;
+  glong page_size = sysconf(_SC_PAGESIZE);
+  gint queued;
+  void *chunk;
+  guint i;
+
+  if(fstat(fd, &st) != 0 || !S_ISFIFO(st.st_mode)) {
+    g_debug("zerocopy: fd %i is not a pipe, falling back to write()\n", fd);
+    return FALSE;
+  }
+
+  fcntl(fd, F_SETPIPE_SZ, ZEROCOPY_PIPE_SIZE);
+  pipe_size = fcntl(fd, F_GETPIPE_SZ);
+  if(pipe_size < 0) {
+    g_debug("zerocopy: cannot query pipe size, falling back to write()\n");
+    return FALSE;
+  }
+  if(pipe_size > ZEROCOPY_PIPE_SIZE) {
+    // more full buffers could sit in the pipe than the ring has
+    g_debug("zerocopy: pipe size %li too large, falling back to write()\n", pipe_size);
+    return FALSE;
+  }
+
+  // buffers are only recycled once the pipe says the reader took their bytes
+  if(ioctl(fd, FIONREAD, &queued) != 0) {
+    g_debug("zerocopy: cannot query pipe fill, falling back to write()\n");
+    return FALSE;
+  }
+
+  for(i = 0; i <= ZEROCOPY_BUFFERS; i++) {
+    if(posix_memalign(&chunk, page_size, ZEROCOPY_READ_SIZE) != 0) {
+      g_critical("zerocopy: cannot allocate %u bytes\n", ZEROCOPY_READ_SIZE);
+      exit(1);
+    }
+
+    if(i < ZEROCOPY_BUFFERS) {
+      ring[i].data = chunk;
+      ring[i].end = 0;
+    } else {
+      bounce = chunk;
+    }
+  }
+
+  zerocopy_fd = fd;
+  g_debug("zerocopy: splicing into fd %i (pipe size %li, %u buffers)\n", fd, pipe_size, ZEROCOPY_BUFFERS);
+
+  return TRUE;
+}
+
+// read straight into our pages instead of having libnice hand us its buffer
+void
+zerocopy_attach(NiceSession *session) {
+  GIOStream *io_stream = nice_agent_get_io_stream(session->agent, session->stream_id, 1);
+
+  zerocopy_session = session;
+  zerocopy_input = G_POLLABLE_INPUT_STREAM(g_io_stream_get_input_stream(io_stream));
+  zerocopy_watch_agent();
+}
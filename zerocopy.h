@@ -0,0 +1,22 @@
+#ifndef __ZEROCOPY_H__
+#define __ZEROCOPY_H__
+
+#include <glib.h>
+#include <agent.h>
+
+#include "session.h"
+
+// bytes read from the agent per call, at most
+#define ZEROCOPY_READ_SIZE (64*1024)
+
+// pipe size we ask the kernel for, fewer wakeups for the reader
+#define ZEROCOPY_PIPE_SIZE (1024*1024)
+
+// page aligned read buffers, reused in turn: a full pipe of full reads plus
+// the read in progress
+#define ZEROCOPY_BUFFERS (ZEROCOPY_PIPE_SIZE / ZEROCOPY_READ_SIZE + 2)
+
+gboolean zerocopy_init(gint fd);
+void zerocopy_attach(NiceSession *session);
+
+#endif